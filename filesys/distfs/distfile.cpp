@@ -107,14 +107,17 @@ void DistFile::truncate(
     DataKeyType end(fileid(), ~0ull);
 
     if (blockSize || newSize == 0) {
+        // We still need to visit each piece to remove it from the
+        // data devices but the piece locations can be removed from
+        // the data namespace with a single operation
         auto iterator = fs->dataNS()->iterator(start, end);
         while (iterator->valid()) {
             PieceData dk(iterator->key());
             fs->removePiece(
                 cred, PieceId{dk.fileid(), dk.offset(), dk.size()}, trans);
-            trans->remove(fs->dataNS(), iterator->key());
             iterator->next();
         }
+        trans->removeRange(fs->dataNS(), start, end);
     }
     meta_.attr.size = newSize;
 
@@ -149,8 +152,7 @@ shared_ptr<Buffer> DistOpenFile::read(
     if ((flags_ & OpenFlags::READ) == 0) {
         throw system_error(EBADF, system_category());
     }
-    file_->updateAccessTime();
-    file_->writeMeta();
+    file_->accessed();
     auto& meta = file_->meta();
 
     auto blockSize = meta.blockSize;
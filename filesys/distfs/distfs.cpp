@@ -555,12 +555,15 @@ void DistFilesystem::restoreDevice(std::shared_ptr<DistDevice> dev)
     map<PieceId, uint64_t> expectedPieces;
     DoubleKeyType sk(dev->id(), 0);
     DoubleKeyType ek(dev->id(), ~0ull);
-    for (auto iter = piecesNS_->iterator(sk, ek); iter->valid(); iter->next()) {
-        auto val = PieceData(iter->value());
-        auto id = PieceId{val.fileid(), val.offset(), val.size()};
-        VLOG(2) << "Expected piece " << id;
-        expectedPieces[id] = DoubleKeyType(iter->key()).id1();
-    }
+    scanRange(
+        piecesNS_, sk, ek,
+        [&](auto& e) {
+            auto val = PieceData(e.value());
+            auto id = PieceId{val.fileid(), val.offset(), val.size()};
+            VLOG(2) << "Expected piece " << id;
+            expectedPieces[id] = DoubleKeyType(e.key()).id1();
+            return true;
+        });
 
     // Iterate over the device's piece collection and check that it
     // matches what we expect to see
@@ -722,11 +725,14 @@ DistFilesystem::decommissionDevice(std::shared_ptr<DistDevice> dev)
     map<PieceId, uint64_t> expectedPieces;
     DoubleKeyType sk(dev->id(), 0);
     DoubleKeyType ek(dev->id(), ~0ull);
-    for (auto iter = piecesNS_->iterator(sk, ek); iter->valid(); iter->next()) {
-        auto val = PieceData(iter->value());
-        auto id = PieceId{val.fileid(), val.offset(), val.size()};
-        expectedPieces[id] = DoubleKeyType(iter->key()).id1();
-    }
+    scanRange(
+        piecesNS_, sk, ek,
+        [&](auto& e) {
+            auto val = PieceData(e.value());
+            auto id = PieceId{val.fileid(), val.offset(), val.size()};
+            expectedPieces[id] = DoubleKeyType(e.key()).id1();
+            return true;
+        });
 
     auto trans = db_->beginTransaction();
 
@@ -773,15 +779,25 @@ DistFilesystemFactory::mount(const string& url)
     for (auto it = replicaRange.first; it != replicaRange.second; ++it)
         replicas.push_back(it->second);
 
+    auto dbopts = ObjFilesystem::databaseOptions();
+    for (auto& q: p.query)
+        dbopts.parse(q.first, q.second);
+
     shared_ptr<Database> db;
     if (replicas.size() > 0) {
-        db = make_paxosdb(p.path, replicas);
+        db = make_paxosdb(p.path, replicas, dbopts);
     }
     else {
-        db = make_rocksdb(p.path);
+        db = make_rocksdb(p.path, dbopts);
     }
     auto backingFs = make_shared<posix::PosixFilesystem>(p.path);
-    return make_shared<DistFilesystem>(db, backingFs, addrs);
+    auto fs = make_shared<DistFilesystem>(db, backingFs, addrs);
+
+    auto atime = p.query.find("atime");
+    if (atime != p.query.end())
+        fs->setAtimePolicy(parseAtimePolicy(atime->second));
+
+    return fs;
 };
 
 void filesys::distfs::init(FilesystemManager* fsman)
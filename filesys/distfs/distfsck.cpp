@@ -47,9 +47,10 @@ void DistfsCheck::check()
 {
     ObjfsCheck::check(false);
 
-    auto devicesNS = db_->getNamespace("devices");
-    auto dataNS = db_->getNamespace("data");
-    auto piecesNS = db_->getNamespace("pieces");
+    // Use the same snapshot as the objfs checks
+    auto devicesNS = snapshot_->getNamespace("devices");
+    auto dataNS = snapshot_->getNamespace("data");
+    auto piecesNS = snapshot_->getNamespace("pieces");
 
     auto clock = make_shared<util::SystemClock>();
 
@@ -161,6 +161,11 @@ public:
 
     /// Advance the iterator to the next directory entry (if any)
     virtual void next() = 0;
+
+    /// Hint that the caller intends to call file() for each entry. If
+    /// supported, the iterator may fetch file metadata for up to count
+    /// entries at a time instead of one at a time.
+    virtual void prefetchFiles(int count) {}
 };
 
 /// Access the attributes of a file
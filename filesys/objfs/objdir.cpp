@@ -31,18 +31,32 @@ using namespace filesys;
 using namespace filesys::objfs;
 using namespace std;
 
+// Seek cookies encode the name hash of the last entry returned in the
+// upper 32 bits and that entry's position in the run of entries sharing
+// the hash in the lower 32 bits. The position is offset so that we never
+// generate the cookie values 0, 1 and 2 which are reserved by NFSv4.
+static constexpr uint32_t COOKIE_BIAS = 2;
+
 ObjDirectoryIterator::ObjDirectoryIterator(
     std::shared_ptr<ObjFilesystem> fs, FileId fileid, uint64_t seek)
     : fs_(fs),
-      seek_(seek + 1),
-      start_(fileid, ""),
-      end_(FileId(fileid + 1), ""),
+      start_(DirectoryKeyType::prefix(fileid, uint32_t(seek >> 32))),
+      end_(DirectoryKeyType::prefix(FileId(fileid + 1))),
       iterator_(fs->directoriesNS()->iterator(start_, end_))
 {
-    // XXX: lame seek implementation
-    while (seek > 0 && iterator_->valid()) {
-        iterator_->next();
-        seek--;
+    if (seek > 0) {
+        // Skip past the entries with the cookie's hash value which were
+        // returned by the previous iteration. If some of them have since
+        // been deleted, we stop early at the first entry with a
+        // different hash.
+        hash_ = uint32_t(seek >> 32);
+        uint32_t index = uint32_t(seek);
+        index = index > COOKIE_BIAS ? index - COOKIE_BIAS : 0;
+        while (index_ < index && iterator_->valid()
+               && DirectoryKeyType(iterator_->key()).hash() == hash_) {
+            iterator_->next();
+            index_++;
+        }
     }
     decodeEntry();
 }
@@ -59,14 +73,22 @@ FileId ObjDirectoryIterator::fileid() const
 
 std::string ObjDirectoryIterator::name() const
 {
-    auto key = iterator_->key();
-    return string(
-        reinterpret_cast<const char*>(key->data() + sizeof(uint64_t)),
-        key->size() - sizeof(uint64_t));
+    return DirectoryKeyType(iterator_->key()).name();
 }
 
 std::shared_ptr<File> ObjDirectoryIterator::file() const
 {
+    if (!file_ && prefetchCount_ > 0) {
+        auto i = prefetched_.find(entry_.fileid);
+        if (i == prefetched_.end()) {
+            prefetch();
+            i = prefetched_.find(entry_.fileid);
+        }
+        if (i != prefetched_.end()) {
+            file_ = i->second;
+            prefetched_.erase(i);
+        }
+    }
     if (!file_)
         file_ = fs_->find(fileid());
     return file_;
@@ -74,20 +96,53 @@ std::shared_ptr<File> ObjDirectoryIterator::file() const
 
 uint64_t ObjDirectoryIterator::seek() const
 {
-    return seek_;
+    return (uint64_t(hash_) << 32) | (index_ + COOKIE_BIAS);
 }
 
 void ObjDirectoryIterator::next()
 {
-    seek_++;
     file_.reset();
     iterator_->next();
     decodeEntry();
 }
 
+void ObjDirectoryIterator::prefetchFiles(int count)
+{
+    prefetchCount_ = count;
+}
+
+void ObjDirectoryIterator::prefetch() const
+{
+    // Read ahead in the directory to find the next batch of fileids
+    // starting with the current entry
+    prefetched_.clear();
+    vector<FileId> fileids;
+    auto iterator = fs_->directoriesNS()->iterator(iterator_->key(), end_);
+    while (iterator->valid() && int(fileids.size()) < prefetchCount_) {
+        DirectoryEntry entry;
+        auto val = iterator->value();
+        oncrpc::XdrMemory xm(val->data(), val->size());
+        xdr(entry, static_cast<oncrpc::XdrSource*>(&xm));
+        fileids.push_back(FileId(entry.fileid));
+        iterator->next();
+    }
+    for (auto& file: fs_->prefetch(fileids))
+        prefetched_[file->fileid()] = file;
+}
+
 void ObjDirectoryIterator::decodeEntry()
 {
     if (valid()) {
+        // Track our position within the run of entries with this hash
+        // so that seek() can return a cookie for the current entry
+        auto hash = DirectoryKeyType(iterator_->key()).hash();
+        if (hash == hash_) {
+            index_++;
+        }
+        else {
+            hash_ = hash;
+            index_ = 1;
+        }
         auto val = iterator_->value();
         oncrpc::XdrMemory xm(val->data(), val->size());
         xdr(entry_, static_cast<oncrpc::XdrSource*>(&xm));
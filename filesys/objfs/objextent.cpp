@@ -0,0 +1,163 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include "objfs.h"
+
+using namespace filesys;
+using namespace filesys::objfs;
+using namespace keyval;
+using namespace std;
+
+// Large writes are split into extents no larger than this. Since no
+// extent is larger, any extent overlapping a given offset must start
+// less than MAX_EXTENT_SIZE bytes before it.
+static constexpr uint64_t MAX_EXTENT_SIZE = 1024*1024;
+
+// A write which starts at the end of an existing extent is merged with
+// it if the result is no larger than this. This coalesces small
+// sequential writes while limiting the cost of re-writing the extent.
+static constexpr uint64_t MERGE_EXTENT_SIZE = 64*1024;
+
+namespace {
+
+struct Extent
+{
+    uint64_t offset;
+    shared_ptr<Buffer> data;
+
+    uint64_t end() const { return offset + data->size(); }
+};
+
+}
+
+// Return the extents of a file which overlap the range [start, end)
+static vector<Extent> findExtents(
+    ObjFilesystem* fs, FileId fileid, uint64_t start, uint64_t end)
+{
+    vector<Extent> res;
+    auto first = start >= MAX_EXTENT_SIZE ? start - MAX_EXTENT_SIZE + 1 : 0;
+    auto iterator = fs->dataNS()->iterator(
+        DataKeyType(fileid, first), DataKeyType(fileid, end));
+    for (; iterator->valid(); iterator->next()) {
+        DataKeyType key(iterator->key());
+        Extent e{key.offset(), iterator->value()};
+        if (e.end() > start)
+            res.push_back(e);
+    }
+    return res;
+}
+
+shared_ptr<Buffer> ObjFile::readExtents(uint64_t offset, uint32_t len)
+{
+    auto fs = fs_.lock();
+    auto end = offset + len;
+    auto res = make_shared<Buffer>(len);
+    fill_n(res->data(), len, 0);
+    for (auto& e: findExtents(fs.get(), fileid(), offset, end)) {
+        auto from = max(e.offset, offset);
+        auto to = min(e.end(), end);
+        copy_n(e.data->data() + (from - e.offset), to - from,
+               res->data() + (from - offset));
+    }
+    return res;
+}
+
+void ObjFile::writeExtents(
+    Transaction* trans, uint64_t offset, shared_ptr<Buffer> data)
+{
+    auto fs = fs_.lock();
+    auto end = offset + data->size();
+
+    // Find the extents overlapping the write, including any extent
+    // which ends exactly at offset so that we can merge appends. The
+    // parts of overlapping extents outside the written range are kept
+    // as separate extents so that an overwrite only writes its own
+    // data.
+    auto ns = fs->dataNS();
+    auto start = offset;
+    shared_ptr<Buffer> head;
+    auto extents = findExtents(
+        fs.get(), fileid(), offset > 0 ? offset - 1 : 0, end);
+    for (auto& e: extents) {
+        if (e.end() <= offset) {
+            if (e.data->size() + data->size() <= MERGE_EXTENT_SIZE) {
+                head = e.data;
+                start = e.offset;
+            }
+            continue;
+        }
+        if (e.offset < offset) {
+            trans->put(
+                ns, DataKeyType(fileid(), e.offset),
+                make_shared<Buffer>(e.data, 0, offset - e.offset));
+        }
+        else {
+            trans->remove(ns, DataKeyType(fileid(), e.offset));
+        }
+        if (e.end() > end) {
+            trans->put(
+                ns, DataKeyType(fileid(), end),
+                make_shared<Buffer>(e.data, end - e.offset, e.data->size()));
+        }
+    }
+
+    // Merge a sequential append with the preceding extent, otherwise
+    // write the new data, splitting it if it is too large
+    if (head) {
+        auto buf = make_shared<Buffer>(head->size() + data->size());
+        copy_n(head->data(), head->size(), buf->data());
+        copy_n(data->data(), data->size(), buf->data() + head->size());
+        data = buf;
+    }
+    for (uint64_t i = 0; i < data->size(); i += MAX_EXTENT_SIZE) {
+        auto len = min<uint64_t>(MAX_EXTENT_SIZE, data->size() - i);
+        shared_ptr<Buffer> extent = data;
+        if (len < data->size())
+            extent = make_shared<Buffer>(data, i, i + len);
+        trans->put(ns, DataKeyType(fileid(), start + i), extent);
+    }
+}
+
+void ObjFile::truncateExtents(Transaction* trans, uint64_t newSize)
+{
+    auto fs = fs_.lock();
+
+    // Trim the extent which spans the new size, if any
+    if (newSize > 0) {
+        for (auto& e: findExtents(fs.get(), fileid(), newSize - 1, newSize)) {
+            if (e.end() > newSize) {
+                trans->put(
+                    fs->dataNS(), DataKeyType(fileid(), e.offset),
+                    make_shared<Buffer>(e.data, 0, newSize - e.offset));
+            }
+        }
+    }
+
+    trans->removeRange(
+        fs->dataNS(),
+        DataKeyType(fileid(), newSize), DataKeyType(fileid(), ~0ull));
+}
@@ -24,6 +24,7 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <system_error>
 #include <fcntl.h>
@@ -38,6 +39,10 @@ using namespace keyval;
 using namespace std;
 using namespace chrono;
 
+// For AtimePolicy::RELATIME, update atime at least this often
+static constexpr uint64_t RELATIME_INTERVAL =
+    duration_cast<nanoseconds>(hours(24)).count();
+
 ObjFile::ObjFile(shared_ptr<ObjFilesystem> fs, FileId fileid)
     : fs_(fs)
 {
@@ -92,14 +97,20 @@ shared_ptr<Getattr> ObjFile::getattr()
         auto fs = fs_.lock();
         DataKeyType start(fileid(), 0);
         DataKeyType end(fileid(), ~0ull);
-        return fs->dataNS()->spaceUsed(start, end);
+        auto inlineSize = hasInlineData() ? meta_.extra.size() : 0;
+        return fs->dataNS()->spaceUsed(start, end) + inlineSize;
     };
+    unique_lock<mutex> lock(mutex_);
+    auto attr = meta_.attr;
+    if (wbSize_ > attr.size)
+        attr.size = wbSize_;
     return make_shared<ObjGetattr>(
-        fileid(), meta_.attr, meta_.blockSize, used);
+        fileid(), attr, meta_.blockSize, used);
 }
 
 void ObjFile::setattr(const Credential& cred, function<void(Setattr*)> cb)
 {
+    flushWriteBack();
     unique_lock<mutex> lock(mutex_);
     auto oldSize = meta_.attr.size;
     ObjSetattr sattr(cred, meta_.attr);
@@ -112,6 +123,7 @@ void ObjFile::setattr(const Credential& cred, function<void(Setattr*)> cb)
     if (meta_.attr.size != oldSize) {
         // Purge any data after the new size.
         truncate(cred, trans.get(), oldSize, meta_.attr.size);
+        resetWriteBackSize();
     }
     writeMeta(trans.get());
     fs->db()->commit(move(trans));
@@ -164,6 +176,7 @@ shared_ptr<OpenFile> ObjFile::open(
     if (!created && (flags & OpenFlags::TRUNCATE)) {
         if (!fs->db()->isMaster())
             throw system_error(EROFS, system_category());
+        file->flushWriteBack();
         if (file->meta_.attr.size > 0) {
             unique_lock<mutex> lock(file->mutex_);
             file->meta_.attr.size = 0;
@@ -171,6 +184,7 @@ shared_ptr<OpenFile> ObjFile::open(
             auto trans = fs->db()->beginTransaction();
             // Purge file contents
             file->truncate(cred, trans.get(), file->meta_.attr.size, 0);
+            file->resetWriteBackSize();
             file->writeMeta(trans.get());
             fs->db()->commit(move(trans));
         }
@@ -201,8 +215,7 @@ string ObjFile::readlink(const Credential& cred)
         throw system_error(EINVAL, system_category());
     checkAccess(cred, AccessFlags::READ);
 
-    updateAccessTime();
-    writeMeta();
+    accessed();
     auto& val = meta_.extra;
     return string(reinterpret_cast<const char*>(val.data()), val.size());
 }
@@ -256,9 +269,9 @@ void ObjFile::remove(const Credential& cred, const string& name)
     checkSticky(cred, file.get());
 
     auto fs = fs_.lock();
-    auto trans = fs->db()->beginTransaction();
+    auto trans = fs->beginTransaction();
     unlink(cred, trans.get(), name, file.get(), true);
-    fs->db()->commit(move(trans));
+    fs->commit(move(trans), false);
 }
 
 void ObjFile::rmdir(const Credential& cred, const string& name)
@@ -273,9 +286,9 @@ void ObjFile::rmdir(const Credential& cred, const string& name)
     checkSticky(cred, file.get());
 
     auto fs = fs_.lock();
-    auto trans = fs->db()->beginTransaction();
+    auto trans = fs->beginTransaction();
     unlink(cred, trans.get(), name, file.get(), true);
-    fs->db()->commit(move(trans));
+    fs->commit(move(trans), false);
 }
 
 void ObjFile::rename(
@@ -328,7 +341,7 @@ void ObjFile::rename(
     }
 
     ofrom->checkSticky(cred, file.get());
-    auto trans = fs->db()->beginTransaction();
+    auto trans = fs->beginTransaction();
     auto h = fs->directoriesNS();
 
     if (tofile) {
@@ -358,7 +371,7 @@ void ObjFile::rename(
     ofrom->writeMeta(trans.get());
     writeMeta(trans.get());
 
-    fs->db()->commit(move(trans));
+    fs->commit(move(trans), false);
 }
 
 void ObjFile::link(
@@ -396,8 +409,7 @@ shared_ptr<DirectoryIterator> ObjFile::readdir(
     if (meta_.attr.type != PT_DIR)
         throw system_error(ENOTDIR, system_category());
     checkAccess(cred, AccessFlags::READ);
-    updateAccessTime();
-    writeMeta();
+    accessed();
     return make_shared<ObjDirectoryIterator>(
         fs_.lock(), FileId(meta_.fileid), seek);
 }
@@ -436,9 +448,11 @@ void ObjFile::readMeta()
     try {
         oncrpc::XdrMemory xm(buf->data(), buf->size());
         xdr(meta_, static_cast<oncrpc::XdrSource*>(&xm));
-        if (meta_.vers != 1) {
+        if (meta_.vers != FILE_VERSION_BLOCKS &&
+            meta_.vers != FILE_VERSION_EXTENTS) {
             LOG(ERROR) << "unexpected file metadata version: "
-                << meta_.vers << ", expected: " << 1;
+                << meta_.vers << ", expected: " << FILE_VERSION_BLOCKS
+                << " or " << FILE_VERSION_EXTENTS;
             throw system_error(EACCES, system_category());
         }
     }
@@ -464,10 +478,16 @@ void ObjFile::writeMeta(Transaction* trans)
 {
     auto fs = fs_.lock();
     assert(fs->db()->isMaster());
+    writeMeta(trans, fs->defaultNS());
+}
+
+void ObjFile::writeMeta(Transaction* trans, shared_ptr<Namespace> ns)
+{
     auto buf = make_shared<Buffer>(oncrpc::XdrSizeof(meta_));
     oncrpc::XdrMemory xm(buf->data(), buf->size());
     xdr(meta_, static_cast<oncrpc::XdrSink*>(&xm));
-    trans->put(fs->defaultNS(), KeyType(fileid()), buf);
+    trans->put(ns, KeyType(fileid()), buf);
+    atimeDirty_ = false;
 }
 
 void ObjFile::writeDirectoryEntry(
@@ -521,9 +541,9 @@ void ObjFile::unlink(
         trans->remove(fs->defaultNS(), KeyType(id));
         meta_.attr.nlink--;
         assert(meta_.attr.size > 0);
+        file->clearAccessTime();
         fs->remove(file->fileid());
-        fs->fileDestroyed();
-        fs->writeMeta(trans);
+        fs->fileDestroyed(trans, file->fileid());
     }
     else {
         file->meta_.attr.nlink--;
@@ -534,9 +554,9 @@ void ObjFile::unlink(
             // Purge file data
             file->truncate(cred, trans, file->meta_.attr.size, 0);
             trans->remove(fs->defaultNS(), KeyType(id));
+            file->clearAccessTime();
             fs->remove(file->fileid());
-            fs->fileDestroyed();
-            fs->writeMeta(trans);
+            fs->fileDestroyed(trans, file->fileid());
         }
     }
     DirectoryKeyType key(fileid(), name);
@@ -594,6 +614,8 @@ shared_ptr<ObjFile> ObjFile::createNewFile(
     meta.attr.mtime = now;
     meta.attr.ctime = now;
     meta.attr.birthtime = now;
+    if (type == PT_REG && fs->dataLayout() == DataLayout::EXTENTS)
+        meta.vers = FILE_VERSION_EXTENTS;
 
     ObjSetattr sattr(cred, meta.attr);
     attrCb(&sattr);
@@ -602,14 +624,13 @@ shared_ptr<ObjFile> ObjFile::createNewFile(
     auto newFile = fs->makeNewFile(move(meta));
     fs->add(newFile);
 
-    // Write a single transaction which increments ObjFilesystem::nextId,
-    // and our size, writes the new file meta and adds the directory entry
-    fs->fileCreated();
-    auto trans = fs->db()->beginTransaction();
+    // Write a single transaction which updates the file count and our
+    // size, writes the new file meta and adds the directory entry
+    auto trans = fs->beginTransaction();
     writeCb(trans.get(), newFile);
-    fs->writeMeta(trans.get());
+    fs->fileCreated(trans.get(), newFile->fileid());
     link(trans.get(), name, newFile.get(), true);
-    fs->db()->commit(move(trans));
+    fs->commit(move(trans), false);
 
     return newFile;
 }
@@ -666,6 +687,52 @@ void ObjFile::updateModifyTime()
     }
 }
 
+void ObjFile::accessed()
+{
+    auto fs = fs_.lock();
+    if (!fs->db()->isMaster())
+        return;
+
+    switch (fs->atimePolicy()) {
+    case AtimePolicy::STRICT:
+        updateAccessTime();
+        writeMeta();
+        break;
+
+    case AtimePolicy::RELATIME: {
+        // Note: we don't change ctime here since that would change
+        // the NFS change attribute and invalidate client caches
+        auto now = getTime();
+        auto& attr = meta_.attr;
+        if (attr.atime <= attr.mtime || attr.atime <= attr.ctime ||
+            now - attr.atime >= RELATIME_INTERVAL) {
+            attr.atime = now;
+            writeMeta();
+        }
+        break;
+    }
+
+    case AtimePolicy::LAZY:
+        meta_.attr.atime = getTime();
+        if (!atimeDirty_) {
+            atimeDirty_ = true;
+            fs->accessTimeChanged(this);
+        }
+        break;
+
+    case AtimePolicy::NOATIME:
+        break;
+    }
+}
+
+bool ObjFile::writeAccessTime(Transaction* trans, shared_ptr<Namespace> ns)
+{
+    if (!atimeDirty_)
+        return false;
+    writeMeta(trans, ns);
+    return true;
+}
+
 void ObjFile::truncate(
     const Credential& cred, Transaction* trans,
     uint64_t oldSize, uint64_t newSize)
@@ -678,15 +745,27 @@ void ObjFile::truncate(
     if (!fs->db()->isMaster())
         throw system_error(EROFS, system_category());
 
+    // Inline data is simply resized unless the file grows too large,
+    // in which case it moves to data blocks. There are no blocks to
+    // purge in either case.
+    if (hasInlineData()) {
+        if (newSize <= fs->inlineThreshold())
+            meta_.extra.resize(newSize);
+        else
+            promoteInlineData(trans);
+        return;
+    }
+
+    if (hasExtents()) {
+        truncateExtents(trans, newSize);
+        return;
+    }
+
     DataKeyType start(
         fileid(), (newSize + blockMask) & ~blockMask);
     DataKeyType end(fileid(), ~0ull);
 
-    auto iterator = fs->dataNS()->iterator(start, end);
-    while (iterator->valid()) {
-        trans->remove(fs->dataNS(), iterator->key());
-        iterator->next();
-    }
+    trans->removeRange(fs->dataNS(), start, end);
 
     // If there is a block containing newSize, zero out the tail of
     // the block so that if the file is extended again in the future,
@@ -707,8 +786,96 @@ void ObjFile::truncate(
     }
 }
 
+void ObjFile::flushWriteBack()
+{
+    unique_lock<mutex> flushLock(flushMutex_);
+    unique_lock<mutex> lock(mutex_);
+    if (writeBack_.empty())
+        return;
+    auto pending = takeAllWriteBack();
+    lock.unlock();
+    for (auto& p: pending)
+        writeBuffered(p.first, p.second);
+}
+
+vector<pair<uint64_t, shared_ptr<Buffer>>> ObjFile::takeAllWriteBack()
+{
+    vector<pair<uint64_t, shared_ptr<Buffer>>> pending;
+    auto opens = writeBack_;
+    for (auto of: opens) {
+        auto offset = of->wbOffset_;
+        pending.emplace_back(offset, of->takeWriteBack());
+    }
+    return pending;
+}
+
+void ObjFile::writeBuffered(uint64_t offset, shared_ptr<Buffer> data)
+{
+    try {
+        writeData(offset, data);
+    }
+    catch (system_error& e) {
+        unique_lock<mutex> lock(mutex_);
+        wbError_ = e.code().value();
+        throw;
+    }
+}
+
+void ObjFile::resetWriteBackSize()
+{
+    wbSize_ = meta_.attr.size;
+    for (auto of: writeBack_)
+        wbSize_ = max<uint64_t>(wbSize_, of->wbOffset_ + of->wbLen_);
+}
+
+void ObjFile::removeWriteBack(ObjOpenFile* of)
+{
+    writeBack_.erase(
+        std::remove(writeBack_.begin(), writeBack_.end(), of),
+        writeBack_.end());
+}
+
+void ObjFile::promoteInlineData(Transaction* trans)
+{
+    auto fs = fs_.lock();
+    auto blockSize = meta_.blockSize;
+    auto& val = meta_.extra;
+    if (hasExtents()) {
+        trans->put(
+            fs->dataNS(), DataKeyType(fileid(), 0),
+            make_shared<Buffer>(val.size(), val.data()));
+        val.clear();
+        return;
+    }
+    for (size_t off = 0; off < val.size(); off += blockSize) {
+        auto blen = min(size_t(blockSize), val.size() - off);
+        auto block = make_shared<Buffer>(blockSize);
+        copy_n(val.data() + off, blen, block->data());
+        fill_n(block->data() + blen, blockSize - blen, 0);
+        trans->put(fs->dataNS(), DataKeyType(fileid(), off), block);
+    }
+    val.clear();
+}
+
 ObjOpenFile::~ObjOpenFile()
 {
+    // Normally the buffer was written by flush. If not, we have no way
+    // to return an error here so writeBuffered keeps it for the next
+    // flush of this file.
+    unique_lock<mutex> flushLock(file_->flushMutex_);
+    unique_lock<mutex> lock(file_->mutex_);
+    auto offset = wbOffset_;
+    auto data = takeWriteBack();
+    lock.unlock();
+    if (data) {
+        try {
+            file_->writeBuffered(offset, data);
+        }
+        catch (system_error& e) {
+            LOG(ERROR) << "fileid: " << file_->fileid()
+                       << ": error writing buffered data: " << e.what();
+        }
+    }
     if (fd_ >= 0)
         ::close(fd_);
 }
@@ -716,12 +883,12 @@ ObjOpenFile::~ObjOpenFile()
 shared_ptr<Buffer> ObjOpenFile::read(
     uint64_t offset, uint32_t len, bool& eof)
 {
+    file_->flushWriteBack();
     unique_lock<mutex> lock(file_->mutex_);
     if ((flags_ & OpenFlags::READ) == 0) {
         throw system_error(EBADF, system_category());
     }
-    file_->updateAccessTime();
-    file_->writeMeta();
+    file_->accessed();
     auto& meta = file_->meta();
 
     auto fs = file_->fs_.lock();
@@ -739,14 +906,27 @@ shared_ptr<Buffer> ObjOpenFile::read(
         len = meta.attr.size - offset;
     }
 
-    // Read one block at a time and copy out to buffer
+    if (file_->hasInlineData()) {
+        auto res = make_shared<oncrpc::Buffer>(len);
+        copy_n(meta.extra.data() + offset, len, res->data());
+        return res;
+    }
+
+    if (file_->hasExtents())
+        return file_->readExtents(offset, len);
+
+    // Fetch all the blocks covering the range with a single lookup
+    vector<shared_ptr<Buffer>> keys;
+    for (auto off = bn * blockSize; off < offset + len; off += blockSize)
+        keys.push_back(DataKeyType(file_->fileid(), off));
+    auto blocks = fs->dataNS()->multiGet(keys);
+
+    // Copy out to buffer one block at a time
     auto res = make_shared<oncrpc::Buffer>(len);
-    for (int i = 0; i < int(len); ) {
-        auto off = bn * blockSize;
-        try {
+    for (int i = 0, j = 0; i < int(len); j++) {
+        auto& block = blocks[j];
+        if (block) {
             // If the block exists copy out to buffer
-            auto block = fs->dataNS()->get(
-                DataKeyType(file_->fileid(), off));
             auto blen = block->size() - boff;
             if (i + blen > len) {
                 blen = len - i;
@@ -754,7 +934,7 @@ shared_ptr<Buffer> ObjOpenFile::read(
             copy_n(block->data() + boff, blen, res->data() + i);
             i += blen;
         }
-        catch (system_error&) {
+        else {
             // otherwise copy zeros
             auto blen = blockSize - boff;
             if (i + blen > len) {
@@ -765,7 +945,6 @@ shared_ptr<Buffer> ObjOpenFile::read(
         }
 
         boff = 0;
-        bn++;
     }
 
     return res;
@@ -774,20 +953,167 @@ shared_ptr<Buffer> ObjOpenFile::read(
 uint32_t ObjOpenFile::write(uint64_t offset, shared_ptr<Buffer> data)
 {
     auto fs = file_->fs_.lock();
+    if (!fs->db()->isMaster())
+        throw system_error(EROFS, system_category());
+
+    if ((flags_ & OpenFlags::WRITE) == 0) {
+        throw system_error(EBADF, system_category());
+    }
+
+    auto limit = fs->writeBackSize();
+    if (limit == 0) {
+        auto len = file_->writeData(offset, data);
+        unique_lock<mutex> lock(file_->mutex_);
+        needFlush_ = true;
+        return len;
+    }
+
+    // Accumulate contiguous writes in the write-back buffer. If this
+    // write doesn't follow on from the buffered data, write the old
+    // buffer contents first.
     auto& meta = file_->meta_;
+    auto len = data->size();
+    unique_lock<mutex> flushLock(file_->flushMutex_);
+    unique_lock<mutex> lock(file_->mutex_);
+    needFlush_ = true;
+    if (wbLen_ == 0 && len >= limit) {
+        // Large writes gain nothing from buffering. Data buffered by
+        // other open files is older than this write so it must be
+        // written first or it could later overwrite this write.
+        auto pending = file_->takeAllWriteBack();
+        lock.unlock();
+        for (auto& p: pending)
+            file_->writeBuffered(p.first, p.second);
+        return file_->writeData(offset, data);
+    }
+    if (file_->writeBack_.empty() && meta.attr.type == PT_REG
+        && (file_->hasInlineData() || meta.attr.size == 0)
+        && max<uint64_t>(offset + len, meta.attr.size)
+            <= fs->inlineThreshold()) {
+        // Writes which leave the file inline gain nothing from
+        // buffering
+        lock.unlock();
+        return file_->writeData(offset, data);
+    }
+    shared_ptr<Buffer> pending, full;
+    uint64_t pendingOffset = wbOffset_, fullOffset;
+    if (wbLen_ > 0 && offset != wbOffset_ + wbLen_)
+        pending = takeWriteBack();
+    if (wbLen_ + len > wbData_.size()) {
+        wbData_.resize(max<size_t>(limit, wbLen_ + len));
+    }
+    if (wbLen_ == 0) {
+        wbOffset_ = offset;
+        file_->writeBack_.push_back(this);
+    }
+    copy_n(data->data(), len, wbData_.data() + wbLen_);
+    wbLen_ += len;
+
+    // Make the buffered write visible in the file attributes. The
+    // stored size only changes when the data is written.
+    meta.attr.ctime = meta.attr.mtime = file_->getTime();
+    file_->wbSize_ = max<uint64_t>(
+        {file_->wbSize_, meta.attr.size, offset + len});
+
+    // When the buffer is full, write out as many whole blocks as
+    // possible, keeping any trailing partial block
+    if (wbLen_ >= limit) {
+        auto blockSize = meta.blockSize;
+        auto end = wbOffset_ + wbLen_;
+        auto alignedEnd = end - end % blockSize;
+        fullOffset = wbOffset_;
+        if (alignedEnd > wbOffset_) {
+            auto n = alignedEnd - wbOffset_;
+            full = make_shared<Buffer>(n);
+            copy_n(wbData_.data(), n, full->data());
+            copy(wbData_.data() + n, wbData_.data() + wbLen_,
+                 wbData_.data());
+            wbOffset_ = alignedEnd;
+            wbLen_ -= n;
+            if (wbLen_ == 0)
+                file_->removeWriteBack(this);
+        }
+    }
+    lock.unlock();
+
+    if (pending)
+        file_->writeBuffered(pendingOffset, pending);
+    if (full)
+        file_->writeBuffered(fullOffset, full);
+    return len;
+}
+
+shared_ptr<Buffer> ObjOpenFile::takeWriteBack()
+{
+    if (wbLen_ == 0)
+        return nullptr;
+    auto res = make_shared<Buffer>(wbLen_);
+    copy_n(wbData_.data(), wbLen_, res->data());
+    wbLen_ = 0;
+    file_->removeWriteBack(this);
+    return res;
+}
+
+uint32_t ObjFile::writeData(uint64_t offset, shared_ptr<Buffer> data)
+{
+    auto fs = fs_.lock();
+    auto& meta = meta_;
     auto blockSize = meta.blockSize;
 
     if (!fs->db()->isMaster())
         throw system_error(EROFS, system_category());
 
-    if ((flags_ & OpenFlags::WRITE) == 0) {
-        throw system_error(EBADF, system_category());
+    auto len = data->size();
+    unique_lock<mutex> lock(mutex_);
+    if (meta.attr.type == PT_REG
+        && (hasInlineData() || meta.attr.size == 0)
+        && max<uint64_t>(offset + len, meta.attr.size)
+            <= fs->inlineThreshold()) {
+        // Small files keep their contents in the metadata record
+        auto& val = meta.extra;
+        if (offset + len > val.size())
+            val.resize(offset + len);
+        copy_n(data->data(), len, val.data() + offset);
+        meta.attr.ctime = meta.attr.mtime = getTime();
+        meta.attr.size = val.size();
+        auto trans = fs->beginTransaction();
+        writeMeta(trans.get());
+        lock.unlock();
+        fs->commit(move(trans), false);
+        return len;
+    }
+    if (hasInlineData()) {
+        // The file has outgrown the inline threshold - move its
+        // contents to data blocks before writing
+        auto trans = fs->beginTransaction();
+        promoteInlineData(trans.get());
+        writeMeta(trans.get());
+        lock.unlock();
+        fs->commit(move(trans), false);
+    }
+    else {
+        lock.unlock();
+    }
+
+    if (hasExtents()) {
+        // Writing an extent may re-write its neighbours so unlike
+        // block writes, we must hold the lock until the transaction
+        // commits
+        lock.lock();
+        auto trans = fs->beginTransaction();
+        writeExtents(trans.get(), offset, data);
+        meta.attr.ctime = meta.attr.mtime = getTime();
+        if (offset + len > meta.attr.size) {
+            meta.attr.size = offset + len;
+        }
+        writeMeta(trans.get());
+        fs->commit(move(trans), false);
+        return len;
     }
 
     auto bn = offset / blockSize;
     auto boff = offset % blockSize;
-    auto len = data->size();
-    auto trans = fs->db()->beginTransaction();
+    auto trans = fs->beginTransaction();
 
     // Write one block at a time, merging if necessary. We don't hold
     // the lock to avoid serialising writes - if two threads have
@@ -799,7 +1125,7 @@ uint32_t ObjOpenFile::write(uint64_t offset, shared_ptr<Buffer> data)
             blen = len - i;
         // If we need to merge, read the existing block
         shared_ptr<Buffer> block;
-        DataKeyType key(file_->fileid(), off);
+        DataKeyType key(fileid(), off);
         if (boff > 0 ||
             (blen < blockSize && off + blen < meta.attr.size)) {
             try {
@@ -813,7 +1139,7 @@ uint32_t ObjOpenFile::write(uint64_t offset, shared_ptr<Buffer> data)
             }
             copy_n(data->data() + i, blen, block->data() + boff);
             trans->put(
-                fs->dataNS(), DataKeyType(file_->fileid(), off), block);
+                fs->dataNS(), DataKeyType(fileid(), off), block);
         }
         else {
             shared_ptr<Buffer> block;
@@ -826,7 +1152,7 @@ uint32_t ObjOpenFile::write(uint64_t offset, shared_ptr<Buffer> data)
                 fill_n(block->data() + blen, blockSize - blen, 0);
             }
             trans->put(
-                fs->dataNS(), DataKeyType(file_->fileid(), off), block);
+                fs->dataNS(), DataKeyType(fileid(), off), block);
         }
 
         // Set up for the next block - note that only the first block can
@@ -836,30 +1162,44 @@ uint32_t ObjOpenFile::write(uint64_t offset, shared_ptr<Buffer> data)
         bn++;
     }
 
-    unique_lock<mutex> lock(file_->mutex_);
+    lock.lock();
 
-    needFlush_ = true;
-    meta.attr.ctime = meta.attr.mtime = file_->getTime();
+    meta.attr.ctime = meta.attr.mtime = getTime();
     if (offset + len > meta.attr.size) {
         meta.attr.size = offset + len;
     }
-    file_->writeMeta(trans.get());
+    writeMeta(trans.get());
 
     lock.unlock();
 
-    fs->db()->commit(move(trans));
+    fs->commit(move(trans), false);
     return len;
 }
 
 void ObjOpenFile::flush()
 {
+    try {
+        file_->flushWriteBack();
+    }
+    catch (system_error&) {
+        unique_lock<mutex> lock(file_->mutex_);
+        file_->wbError_ = 0;
+        throw;
+    }
     unique_lock<mutex> lock(file_->mutex_);
+    if (file_->wbError_) {
+        // Report a failure to write data buffered by another open
+        // file or by a write which has already returned
+        auto err = file_->wbError_;
+        file_->wbError_ = 0;
+        throw system_error(err, system_category());
+    }
     if (needFlush_) {
         needFlush_ = false;
         lock.unlock();
         auto fs = file_->fs_.lock();
         if (!fs->db()->isMaster())
             throw system_error(EROFS, system_category());
-        fs->db()->flush();
+        fs->commit(nullptr, true);
     }
 }
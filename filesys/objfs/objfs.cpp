@@ -44,6 +44,30 @@ using namespace std;
 
 static std::random_device rnd;
 
+// For AtimePolicy::LAZY, write unsaved access times when this many
+// files have changed or after this much time has elapsed
+static constexpr size_t ATIME_BATCH_SIZE = 256;
+static constexpr auto ATIME_FLUSH_INTERVAL = std::chrono::seconds(30);
+
+// Limit the amount of data combined into a single group commit. For
+// replicated databases, each commit is a single log entry which must
+// fit in a datagram.
+static constexpr size_t GROUP_COMMIT_LIMIT = 4*1024*1024;
+static constexpr size_t REPLICATED_GROUP_COMMIT_LIMIT = 1024;
+
+// Number of fileids reserved each time the filesystem metadata is
+// written by nextId()
+static constexpr uint64_t FILEID_RESERVE = 10000;
+
+// Limit the size of each directory upgrade transaction. For replicated
+// databases, each transaction must fit in a single log entry.
+static constexpr size_t UPGRADE_BATCH_BYTES = 4*1024*1024;
+static constexpr size_t REPLICATED_UPGRADE_BATCH_BYTES = 1024;
+
+// Largest write-back buffer which can be set with the writeback mount
+// option. Each open file may buffer this much data.
+static constexpr uint32_t MAX_WRITE_BACK_SIZE = 64*1024*1024;
+
 ObjFilesystem::ObjFilesystem(
     shared_ptr<Database> db,
     shared_ptr<Filesystem> backingFs,
@@ -52,23 +76,28 @@ ObjFilesystem::ObjFilesystem(
     : clock_(clock),
       db_(db),
       backingFs_(backingFs),
-      blockSize_(blockSize)
+      blockSize_(blockSize),
+      atimeFlushTime_(clock->now())
 {
     defaultNS_ = db_->getNamespace("default");
     directoriesNS_ = db_->getNamespace("directories");
     dataNS_ = db_->getNamespace("data");
+    for (auto& delta: fileCountDeltas_)
+        delta = 0;
+    cache_.setExpireCallback(
+        [this](auto file) { fileExpired(file); });
 
 again:
     try {
         auto buf = defaultNS_->get(KeyType(FileId(0)));
         oncrpc::XdrMemory xm(buf->data(), buf->size());
         xdr(meta_, static_cast<oncrpc::XdrSource*>(&xm));
-        if (meta_.vers != 1) {
+        if (meta_.vers != 1 && meta_.vers != FS_VERSION) {
             LOG(ERROR) << "unexpected filesystem metadata version: "
-                << meta_.vers << ", expected: " << 1;
+                << meta_.vers << ", expected: " << FS_VERSION;
             throw system_error(EACCES, system_category());
         }
-        nextId_ = meta_.nextId;
+        nextId_ = reservedId_ = meta_.nextId;
         fileCount_ = meta_.fileCount;
     }
     catch (oncrpc::XdrError&) {
@@ -82,16 +111,25 @@ again:
             std::this_thread::sleep_for(std::chrono::seconds(1));
             goto again;
         }
-        meta_.vers = 1;
+        meta_.vers = FS_VERSION;
         for (auto& v: meta_.fsid.data)
             v = rnd();
         meta_.nextId = 2;
         meta_.fileCount = 0;
-        nextId_ = meta_.nextId;
+        nextId_ = reservedId_ = meta_.nextId;
         auto trans = db_->beginTransaction();
         writeMeta(trans.get());
         db_->commit(move(trans));
     }
+    if (meta_.vers < FS_VERSION) {
+        if (!db_->isMaster()) {
+            // Wait for the master replica to upgrade the filesystem
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            goto again;
+        }
+        upgradeDirectories();
+    }
+    readFileCount(db_->isMaster());
     setFsid();
 
     // Register a callback for database master changes
@@ -112,6 +150,27 @@ ObjFilesystem::ObjFilesystem(
 
 ObjFilesystem::~ObjFilesystem()
 {
+    if (atimeThread_.joinable()) {
+        std::unique_lock<std::mutex> lock(atimeMutex_);
+        atimeStopping_ = true;
+        atimeCv_.notify_one();
+        lock.unlock();
+        atimeThread_.join();
+    }
+    try {
+        flushAccessTimes();
+    }
+    catch (system_error& e) {
+        LOG(ERROR) << "error writing access times: " << e.what();
+    }
+}
+
+void
+ObjFilesystem::setAtimePolicy(AtimePolicy policy)
+{
+    atimePolicy_ = policy;
+    if (policy == AtimePolicy::LAZY && !atimeThread_.joinable())
+        atimeThread_ = std::thread([this]() { atimeLoop(); });
 }
 
 std::shared_ptr<File>
@@ -145,17 +204,20 @@ ObjFilesystem::root()
             meta.attr.ctime = time.count();
             meta.attr.birthtime = time.count();
             root_ = makeNewFile(move(meta));
-            fileCount_++;
             add(root_);
 
             if (db_->isMaster()) {
                 // Write the root directory metadata and directory entries for
                 // "." and ".."
-                auto trans = db_->beginTransaction();
+                auto trans = beginTransaction();
+                fileCreated(trans.get(), FileId(1));
                 root_->link(trans.get(), ".", root_.get(), false);
                 root_->link(trans.get(), "..", root_.get(), false);
                 root_->writeMeta(trans.get());
-                db_->commit(move(trans));
+                commit(move(trans), false);
+            }
+            else {
+                fileCount_++;
             }
         }
     }
@@ -196,10 +258,57 @@ ObjFilesystem::find(FileId fileid)
         fileid,
         [](auto) {},
         [this](uint64_t id) {
-            return makeNewFile(FileId(id));
+            auto file = takeExpired(FileId(id));
+            return file ? file : makeNewFile(FileId(id));
         });
 }
 
+vector<shared_ptr<ObjFile>>
+ObjFilesystem::prefetch(const vector<FileId>& fileids)
+{
+    vector<shared_ptr<ObjFile>> res;
+    vector<FileId> missing;
+    vector<shared_ptr<Buffer>> keys;
+    for (auto fileid: fileids) {
+        auto file = cache_.peek(fileid);
+        if (!file) {
+            file = cache_.find(
+                fileid,
+                [](auto) {},
+                [this](uint64_t id) { return takeExpired(FileId(id)); });
+        }
+        if (file) {
+            res.push_back(file);
+        }
+        else {
+            missing.push_back(fileid);
+            keys.push_back(KeyType(fileid));
+        }
+    }
+    if (keys.size() == 0)
+        return res;
+
+    auto vals = defaultNS_->multiGet(keys);
+    for (size_t i = 0; i < missing.size(); i++) {
+        if (!vals[i])
+            continue;
+        ObjFileMetaImpl meta;
+        try {
+            oncrpc::XdrMemory xm(vals[i]->data(), vals[i]->size());
+            xdr(meta, static_cast<oncrpc::XdrSource*>(&xm));
+        }
+        catch (oncrpc::XdrError&) {
+            continue;
+        }
+        if ((meta.vers != FILE_VERSION_BLOCKS &&
+             meta.vers != FILE_VERSION_EXTENTS) ||
+            meta.fileid != missing[i])
+            continue;
+        res.push_back(cache_.addCold(missing[i], makeNewFile(move(meta))));
+    }
+    return res;
+}
+
 shared_ptr<ObjFile>
 ObjFilesystem::makeNewFile(FileId fileid)
 {
@@ -223,6 +332,9 @@ void
 ObjFilesystem::remove(FileId fileid)
 {
     cache_.remove(fileid);
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    atimeDirty_.erase(fileid);
+    atimeExpired_.erase(fileid);
 }
 
 void
@@ -231,14 +343,150 @@ ObjFilesystem::add(std::shared_ptr<ObjFile> file)
     cache_.add(file->fileid(), file);
 }
 
+FileId
+ObjFilesystem::nextId()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (nextId_ >= reservedId_) {
+        // Reserve another block of fileids. We commit this before
+        // using any fileid from the block so that we never re-use a
+        // fileid after a restart. Other threads wait for the
+        // reservation if they need a fileid from the new block.
+        beginMetaWrite(lock);
+        if (nextId_ < reservedId_) {
+            // Someone else reserved a block while we were waiting
+            metaWriting_ = false;
+            metaCv_.notify_all();
+            break;
+        }
+        auto limit = nextId_ + FILEID_RESERVE;
+        meta_.nextId = limit;
+        commitMeta(lock);
+        reservedId_ = limit;
+    }
+    return FileId(nextId_++);
+}
+
+void
+ObjFilesystem::beginMetaWrite(std::unique_lock<std::mutex>& lock)
+{
+    assert(lock);
+    while (metaWriting_)
+        metaCv_.wait(lock);
+    metaWriting_ = true;
+}
+
+void
+ObjFilesystem::commitMeta(
+    std::unique_lock<std::mutex>& lock, unique_ptr<Transaction> trans)
+{
+    assert(lock && metaWriting_);
+    if (!trans)
+        trans = db_->beginTransaction();
+    writeMeta(lock, trans.get());
+    lock.unlock();
+    try {
+        db_->commit(move(trans));
+    }
+    catch (...) {
+        lock.lock();
+        metaWriting_ = false;
+        metaCv_.notify_all();
+        throw;
+    }
+    lock.lock();
+    metaWriting_ = false;
+    metaCv_.notify_all();
+}
+
+void
+ObjFilesystem::fileCountChanged(Transaction* trans, FileId fileid, int delta)
+{
+    // The counter record can't be written here: two transactions which
+    // change the same shard may commit in either order, leaving the
+    // older value in the database
+    auto otrans = dynamic_cast<ObjTransaction*>(trans);
+    assert(otrans);
+    fileCount_ += delta;
+    otrans->fileCountChanged(fileid % FILE_COUNT_SHARDS, delta);
+}
+
+vector<pair<int, int64_t>>
+ObjFilesystem::writeFileCounts(
+    Transaction* trans, const vector<unique_ptr<ObjTransaction>>& transactions)
+{
+    vector<pair<int, int64_t>> res;
+    int64_t deltas[FILE_COUNT_SHARDS] = {};
+    bool changed[FILE_COUNT_SHARDS] = {};
+    for (auto& ot: transactions) {
+        for (auto& fc: ot->fileCounts()) {
+            deltas[fc.first] += fc.second;
+            changed[fc.first] = true;
+        }
+    }
+    for (int shard = 0; shard < FILE_COUNT_SHARDS; shard++) {
+        if (!changed[shard])
+            continue;
+        uint64_t val = fileCountDeltas_[shard] + deltas[shard];
+        oncrpc::XdrMemory xm(sizeof(uint64_t));
+        xdr(val, static_cast<oncrpc::XdrSink*>(&xm));
+        trans->put(
+            defaultNS(),
+            DoubleKeyType(0, shard),
+            make_shared<oncrpc::Buffer>(xm.writePos(), xm.buf()));
+        res.emplace_back(shard, int64_t(val));
+    }
+    return res;
+}
+
+void
+ObjFilesystem::readFileCount(bool fold)
+{
+    unique_ptr<Transaction> trans;
+    if (fold)
+        trans = db_->beginTransaction();
+
+    int64_t total = 0;
+    bool found = false;
+    auto iterator = defaultNS_->iterator(DoubleKeyType(0, 0), KeyType(1));
+    for (; iterator->valid(); iterator->next()) {
+        DoubleKeyType key(iterator->key());
+        auto buf = iterator->value();
+        uint64_t val;
+        oncrpc::XdrMemory xm(buf->data(), buf->size());
+        xdr(val, static_cast<oncrpc::XdrSource*>(&xm));
+        total += int64_t(val);
+        found = true;
+        if (fold)
+            trans->remove(defaultNS_, iterator->key());
+        else
+            fileCountDeltas_[key.id1() % FILE_COUNT_SHARDS] = int64_t(val);
+    }
+    iterator.reset();
+    fileCount_ = meta_.fileCount + total;
+
+    if (fold && found) {
+        for (auto& delta: fileCountDeltas_)
+            delta = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        beginMetaWrite(lock);
+        meta_.fileCount = fileCount_;
+        commitMeta(lock, move(trans));
+    }
+}
+
 void
 ObjFilesystem::writeMeta(Transaction* trans)
 {
     std::unique_lock<std::mutex> lock(mutex_);
+    writeMeta(lock, trans);
+}
+
+void
+ObjFilesystem::writeMeta(std::unique_lock<std::mutex>& lock, Transaction* trans)
+{
+    assert(lock);
     oncrpc::XdrMemory xm(512);
-    assert(nextId_ >= meta_.nextId);
-    meta_.nextId = nextId_;
-    meta_.fileCount = fileCount_;
     xdr(meta_, static_cast<oncrpc::XdrSink*>(&xm));
     trans->put(
         defaultNS(),
@@ -246,6 +494,271 @@ ObjFilesystem::writeMeta(Transaction* trans)
         make_shared<oncrpc::Buffer>(xm.writePos(), xm.buf()));
 }
 
+void
+ObjFilesystem::upgradeDirectories()
+{
+    LOG(INFO) << "upgrading directory keys to filesystem version "
+              << FS_VERSION;
+
+    // Version 1 keys are the fileid followed by the name. Keys which
+    // already contain a matching name hash were written by an earlier
+    // interrupted upgrade and are left alone.
+    auto isUpgraded = [](shared_ptr<Buffer> key) {
+        if (key->size() <= DirectoryKeyType::HEADER_SIZE)
+            return false;
+        DirectoryKeyType k(key);
+        return k.hash() == DirectoryKeyType::hashName(k.name());
+    };
+
+    auto limit = db_->isReplicated() ?
+        REPLICATED_UPGRADE_BATCH_BYTES : UPGRADE_BATCH_BYTES;
+    shared_ptr<Buffer> resume;
+    for (;;) {
+        // Collect a batch of old-style keys, re-creating the iterator
+        // for each batch since we modify the namespace as we go
+        vector<pair<shared_ptr<Buffer>, shared_ptr<Buffer>>> batch;
+        size_t batchBytes = 0;
+        auto iterator = directoriesNS_->iterator();
+        if (resume)
+            iterator->seek(resume);
+        else
+            iterator->seekToFirst();
+        while (iterator->valid() && batchBytes < limit) {
+            auto key = iterator->key();
+            if (!isUpgraded(key)) {
+                auto val = iterator->value();
+                batch.emplace_back(key, val);
+                batchBytes += 2 * key->size() + val->size();
+            }
+
+            // The smallest key greater than this one
+            resume = make_shared<Buffer>(key->size() + 1);
+            copy_n(key->data(), key->size(), resume->data());
+            resume->data()[key->size()] = 0;
+
+            iterator->next();
+        }
+        bool more = iterator->valid();
+        iterator.reset();
+
+        if (batch.size() > 0) {
+            auto trans = db_->beginTransaction();
+            for (auto& entry: batch) {
+                auto key = entry.first;
+                KeyType id(make_shared<Buffer>(key, 0, sizeof(uint64_t)));
+                string name(
+                    reinterpret_cast<const char*>(
+                        key->data() + sizeof(uint64_t)),
+                    key->size() - sizeof(uint64_t));
+                trans->remove(directoriesNS_, key);
+                trans->put(
+                    directoriesNS_, DirectoryKeyType(id.id(), name),
+                    entry.second);
+            }
+            db_->commit(move(trans));
+        }
+        if (!more)
+            break;
+    }
+
+    meta_.vers = FS_VERSION;
+    auto trans = db_->beginTransaction();
+    writeMeta(trans.get());
+    db_->commit(move(trans));
+}
+
+unique_ptr<Transaction>
+ObjFilesystem::beginTransaction()
+{
+    return make_unique<ObjTransaction>();
+}
+
+void
+ObjFilesystem::commit(unique_ptr<Transaction>&& trans, bool sync)
+{
+    auto limit = db_->isReplicated() ?
+        REPLICATED_GROUP_COMMIT_LIMIT : GROUP_COMMIT_LIMIT;
+    unique_ptr<ObjTransaction> otrans(
+        static_cast<ObjTransaction*>(trans.release()));
+    auto size = otrans ? otrans->size() : 0;
+
+    // Join the newest batch if it has room, otherwise start a new one
+    unique_lock<mutex> lock(commitMutex_);
+    if (commitQueue_.empty() ||
+        (commitQueue_.back()->transactions.size() > 0 &&
+         commitQueue_.back()->size + size > limit)) {
+        commitQueue_.push_back(make_shared<CommitBatch>());
+    }
+    auto batch = commitQueue_.back();
+    if (otrans)
+        batch->transactions.push_back(move(otrans));
+    batch->size += size;
+    batch->sync |= sync;
+
+    // Either wait for our batch to be committed by another thread or
+    // commit the oldest batch ourselves
+    while (!batch->done) {
+        if (committing_) {
+            commitCv_.wait(lock);
+            continue;
+        }
+        committing_ = true;
+        auto b = commitQueue_.front();
+        commitQueue_.pop_front();
+        lock.unlock();
+        try {
+            if (b->transactions.size() > 0) {
+                // Since batches are committed one at a time, the file
+                // count records are written in order
+                auto t = db_->beginTransaction();
+                for (auto& ot: b->transactions)
+                    ot->replay(t.get());
+                auto counts = writeFileCounts(t.get(), b->transactions);
+                db_->commit(move(t));
+                for (auto& c: counts)
+                    fileCountDeltas_[c.first] = c.second;
+            }
+            if (b->sync)
+                db_->flush();
+        }
+        catch (...) {
+            b->error = current_exception();
+        }
+        lock.lock();
+        b->done = true;
+        committing_ = false;
+        commitCv_.notify_all();
+    }
+    if (batch->error)
+        rethrow_exception(batch->error);
+}
+
+void
+ObjFilesystem::accessTimeChanged(ObjFile* file)
+{
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    atimeDirty_.insert(file->fileid());
+    if (atimeDirty_.size() >= ATIME_BATCH_SIZE ||
+        clock_->now() - atimeFlushTime_ >= ATIME_FLUSH_INTERVAL) {
+        lock.unlock();
+        flushAccessTimes(file);
+    }
+}
+
+void
+ObjFilesystem::flushAccessTimes(ObjFile* locked)
+{
+    std::unordered_set<std::uint64_t> fileids;
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    fileids.swap(atimeDirty_);
+    atimeFlushTime_ = clock_->now();
+    lock.unlock();
+
+    if (fileids.size() == 0 || !db_->isMaster())
+        return;
+
+    // Files which are no longer cached are found in atimeExpired_.
+    // Files which are locked by some other thread are left for the
+    // next flush - we can't wait for them here since the caller may be
+    // holding a file lock
+    VLOG(1) << "writing access times for " << fileids.size() << " files";
+    auto trans = beginTransaction();
+    int count = 0;
+    std::vector<std::uint64_t> busy;
+    std::vector<std::shared_ptr<ObjFile>> expired;
+    for (auto fileid: fileids) {
+        auto file = cache_.peek(fileid);
+        if (!file) {
+            lock.lock();
+            auto i = atimeExpired_.find(fileid);
+            if (i != atimeExpired_.end()) {
+                file = i->second;
+                expired.push_back(file);
+            }
+            lock.unlock();
+            if (!file)
+                continue;
+        }
+        if (file.get() == locked) {
+            if (file->writeAccessTime(trans.get(), defaultNS_))
+                count++;
+            continue;
+        }
+        auto lk = file->lock(std::try_to_lock);
+        if (!lk) {
+            busy.push_back(fileid);
+            continue;
+        }
+        if (file->writeAccessTime(trans.get(), defaultNS_))
+            count++;
+    }
+    if (count > 0) {
+        try {
+            commit(move(trans), false);
+        }
+        catch (...) {
+            lock.lock();
+            atimeDirty_.insert(fileids.begin(), fileids.end());
+            throw;
+        }
+    }
+
+    // Expired files can be dropped once their access time is written,
+    // unless they were accessed again in the meantime
+    lock.lock();
+    atimeDirty_.insert(busy.begin(), busy.end());
+    for (auto& file: expired) {
+        auto i = atimeExpired_.find(file->fileid());
+        if (i != atimeExpired_.end() && i->second == file &&
+            atimeDirty_.count(file->fileid()) == 0)
+            atimeExpired_.erase(i);
+    }
+}
+
+void
+ObjFilesystem::fileExpired(std::shared_ptr<ObjFile> file)
+{
+    // The cache holds the only reference so nothing else can change
+    // the file's access time
+    if (!file->accessTimeDirty())
+        return;
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    atimeExpired_[file->fileid()] = file;
+    if (atimeExpired_.size() >= ATIME_BATCH_SIZE)
+        atimeCv_.notify_one();
+}
+
+std::shared_ptr<ObjFile>
+ObjFilesystem::takeExpired(FileId fileid)
+{
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    auto i = atimeExpired_.find(fileid);
+    if (i == atimeExpired_.end())
+        return nullptr;
+    auto file = i->second;
+    atimeExpired_.erase(i);
+    return file;
+}
+
+void
+ObjFilesystem::atimeLoop()
+{
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    while (!atimeStopping_) {
+        atimeCv_.wait_for(lock, ATIME_FLUSH_INTERVAL);
+        if (atimeStopping_ || atimeDirty_.empty())
+            continue;
+        lock.unlock();
+        try {
+            flushAccessTimes();
+        }
+        catch (system_error& e) {
+            LOG(ERROR) << "error writing access times: " << e.what();
+        }
+        lock.lock();
+    }
+}
+
 static std::ostream& operator<<(std::ostream& os, const UUID& id)
 {
     const uint8_t* p = reinterpret_cast<const uint8_t*>(&id);
@@ -291,6 +804,32 @@ ObjFilesystem::databaseMasterChanged(bool isMaster)
     LOG(INFO) << "database is " << (isMaster ? "master" : "replica")
               << ": flushing cache";
 
+    // Write any unsaved access times while we still can. If we are no
+    // longer master, they are lost: the new master's metadata wins and
+    // we re-read it for cached files below.
+    if (isMaster) {
+        try {
+            flushAccessTimes();
+        }
+        catch (system_error& e) {
+            LOG(ERROR) << "error writing access times: " << e.what();
+        }
+    }
+    std::unordered_set<std::uint64_t> fileids;
+    std::unique_lock<std::mutex> lock(atimeMutex_);
+    fileids.swap(atimeDirty_);
+    atimeExpired_.clear();
+    lock.unlock();
+    if (fileids.size() > 0) {
+        LOG(WARNING) << "discarding access times for "
+                     << fileids.size() << " files";
+    }
+    for (auto fileid: fileids) {
+        auto file = cache_.peek(fileid);
+        if (file)
+            file->clearAccessTime();
+    }
+
     // Drop any unreferenced entries from the cache and refresh
     // metadata for the rest
     cache_.clear();
@@ -304,13 +843,13 @@ ObjFilesystem::databaseMasterChanged(bool isMaster)
             auto buf = defaultNS_->get(KeyType(FileId(0)));
             oncrpc::XdrMemory xm(buf->data(), buf->size());
             xdr(meta_, static_cast<oncrpc::XdrSource*>(&xm));
-            if (meta_.vers != 1) {
+            if (meta_.vers != FS_VERSION) {
                 LOG(ERROR) << "unexpected filesystem metadata version: "
-                           << meta_.vers << ", expected: " << 1;
+                           << meta_.vers << ", expected: " << FS_VERSION;
                 throw system_error(EACCES, system_category());
             }
-            nextId_ = meta_.nextId;
-            fileCount_ = meta_.fileCount;
+            nextId_ = reservedId_ = meta_.nextId;
+            readFileCount(true);
             LOG(INFO) << "next fileid: " << nextId_;
         }
         catch (oncrpc::XdrError&) {
@@ -323,6 +862,23 @@ ObjFilesystem::databaseMasterChanged(bool isMaster)
     }
 }
 
+DatabaseOptions ObjFilesystem::databaseOptions()
+{
+    // File metadata and directory entries are mostly accessed by
+    // point lookups. Directory entries and data blocks are keyed by
+    // fileid so we use that as a prefix, allowing readdir and block
+    // reads to use the bloom filters.
+    DatabaseOptions opts;
+    opts.namespaces["default"].bloomBitsPerKey = 10;
+    auto& dirs = opts.namespaces["directories"];
+    dirs.bloomBitsPerKey = 10;
+    dirs.prefixLength = sizeof(uint64_t);
+    auto& data = opts.namespaces["data"];
+    data.bloomBitsPerKey = 10;
+    data.prefixLength = sizeof(uint64_t);
+    return opts;
+}
+
 shared_ptr<Filesystem> ObjFilesystemFactory::mount(const std::string& url)
 {
     oncrpc::UrlParser p(url);
@@ -332,16 +888,79 @@ shared_ptr<Filesystem> ObjFilesystemFactory::mount(const std::string& url)
     for (auto it = range.first; it != range.second; ++it)
         replicas.push_back(it->second);
 
+    // The recommended filters are opt-in since a prefix extractor
+    // can't safely be added to an existing filesystem
+    DatabaseOptions dbopts;
+    auto filters = p.query.find("filters");
+    if (filters != p.query.end()) {
+        if (filters->second == "on") {
+            dbopts = ObjFilesystem::databaseOptions();
+        }
+        else if (filters->second != "off") {
+            LOG(ERROR) << "bad value for filters: " << filters->second;
+            throw system_error(EINVAL, system_category());
+        }
+    }
+    for (auto& q: p.query)
+        dbopts.parse(q.first, q.second);
+
     shared_ptr<Database> db;
     if (replicas.size() > 0) {
-        db = make_paxosdb(p.path, replicas);
+        db = make_paxosdb(p.path, replicas, dbopts);
     }
     else {
-        db = make_rocksdb(p.path);
+        db = make_rocksdb(p.path, dbopts);
     }
 
     auto backingFs = make_shared<posix::PosixFilesystem>(p.path);
-    return make_shared<ObjFilesystem>(db, backingFs);
+    auto fs = make_shared<ObjFilesystem>(db, backingFs);
+
+    auto atime = p.query.find("atime");
+    if (atime != p.query.end())
+        fs->setAtimePolicy(parseAtimePolicy(atime->second));
+
+    auto layout = p.query.find("layout");
+    if (layout != p.query.end())
+        fs->setDataLayout(parseDataLayout(layout->second));
+
+    // Inline data larger than a block gains nothing over storing it
+    // in blocks
+    auto inlineSize = p.query.find("inline");
+    if (inlineSize != p.query.end())
+        fs->setInlineThreshold(
+            parseSizeOption("inline", inlineSize->second, fs->blockSize()));
+
+    auto writeBack = p.query.find("writeback");
+    if (writeBack != p.query.end())
+        fs->setWriteBackSize(
+            parseSizeOption(
+                "writeback", writeBack->second, MAX_WRITE_BACK_SIZE));
+
+    return fs;
+}
+
+AtimePolicy filesys::objfs::parseAtimePolicy(const std::string& name)
+{
+    if (name == "strict")
+        return AtimePolicy::STRICT;
+    else if (name == "relatime")
+        return AtimePolicy::RELATIME;
+    else if (name == "lazy")
+        return AtimePolicy::LAZY;
+    else if (name == "noatime")
+        return AtimePolicy::NOATIME;
+    LOG(ERROR) << "unknown atime policy: " << name;
+    throw system_error(EINVAL, system_category());
+}
+
+DataLayout filesys::objfs::parseDataLayout(const std::string& name)
+{
+    if (name == "blocks")
+        return DataLayout::BLOCKS;
+    else if (name == "extents")
+        return DataLayout::EXTENTS;
+    LOG(ERROR) << "unknown data layout: " << name;
+    throw system_error(EINVAL, system_category());
 }
 
 void filesys::objfs::init(FilesystemManager* fsman)
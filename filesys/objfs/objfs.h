@@ -28,6 +28,13 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <filesys/filesys.h>
 #include <keyval/keyval.h>
@@ -39,10 +46,51 @@
 namespace filesys {
 namespace objfs {
 
-constexpr int OBJFS_NAME_MAX = 255;     // consistent with FreeBSD default
-
 class ObjFilesystem;
 
+/// Controls how file access times are maintained
+enum class AtimePolicy {
+    /// Update and write back atime for every access
+    STRICT,
+
+    /// Only update atime if the previous atime is not later than
+    /// mtime or ctime or if it is more than a day old
+    RELATIME,
+
+    /// Update atime in the cached file and write back modified
+    /// access times in batches
+    LAZY,
+
+    /// Never update atime
+    NOATIME
+};
+
+/// Parse an atime policy name from a mount URL, e.g. "relatime"
+AtimePolicy parseAtimePolicy(const std::string& name);
+
+/// Controls how the data for newly created regular files is stored
+enum class DataLayout {
+    /// Fixed size blocks of blockSize bytes, keyed by block offset
+    BLOCKS,
+
+    /// Variable length extents keyed by file offset. Sequential writes
+    /// are merged into larger extents and overwrites split existing
+    /// extents. Files using this layout have metadata version 2.
+    EXTENTS
+};
+
+/// Parse a data layout name from a mount URL, e.g. "extents"
+DataLayout parseDataLayout(const std::string& name);
+
+/// Current filesystem metadata version. Version 1 filesystems used
+/// directory keys without a name hash and are upgraded on mount.
+static constexpr std::uint32_t FS_VERSION = 2;
+
+/// Values of ObjFileMeta::vers, recording how each file's data is
+/// stored
+static constexpr int FILE_VERSION_BLOCKS = 1;
+static constexpr int FILE_VERSION_EXTENTS = 2;
+
 class ObjGetattr: public Getattr
 {
 public:
@@ -126,7 +174,7 @@ struct ObjFileMetaImpl: public ObjFileMeta
 {
     ObjFileMetaImpl()
     {
-        vers = 1;
+        vers = FILE_VERSION_BLOCKS;
         fileid = 0;
         attr.type = PT_REG;
         attr.mode = 0;
@@ -141,7 +189,7 @@ struct ObjFileMetaImpl: public ObjFileMeta
     }
     ObjFileMetaImpl(ObjFileMeta&& other)
     {
-        vers = 1;
+        vers = FILE_VERSION_BLOCKS;
         fileid = other.fileid;
         attr = other.attr;
         extra = std::move(other.extra);
@@ -161,6 +209,12 @@ public:
         return std::unique_lock<std::mutex>(mutex_);
     }
 
+    template <typename TAG>
+    std::unique_lock<std::mutex> lock(TAG tag)
+    {
+        return std::unique_lock<std::mutex>(mutex_, tag);
+    }
+
     // File overrides
     std::shared_ptr<Filesystem> fs() override;
     FileHandle handle() override;
@@ -210,6 +264,8 @@ public:
     void readMeta();
     void writeMeta();
     void writeMeta(keyval::Transaction* trans);
+    void writeMeta(
+        keyval::Transaction* trans, std::shared_ptr<keyval::Namespace> ns);
     void writeDirectoryEntry(
         keyval::Transaction* trans, const std::string& name, FileId id);
     void link(
@@ -231,6 +287,93 @@ public:
     uint64_t getTime();
     void updateAccessTime();
     void updateModifyTime();
+
+    /// Record an access to the file, updating atime according to the
+    /// filesystem's atime policy. Must be called with the file lock
+    /// held
+    void accessed();
+
+    /// If the file has an access time which has not been written to
+    /// the database, add its metadata to the transaction and return
+    /// true. Must be called with the file lock held. The namespace is
+    /// passed in since this may be called while the filesystem is
+    /// being destroyed.
+    bool writeAccessTime(
+        keyval::Transaction* trans, std::shared_ptr<keyval::Namespace> ns);
+
+    /// Forget any unsaved access time, e.g. if the file is deleted
+    void clearAccessTime() { atimeDirty_ = false; }
+
+    /// Return true if the file has an access time which has not been
+    /// written to the database
+    bool accessTimeDirty() const { return atimeDirty_; }
+
+    /// Return true if the contents of this regular file are stored in
+    /// meta_.extra instead of in data blocks. Inline data is always
+    /// exactly meta_.attr.size bytes. Must be called with the file lock
+    /// held
+    bool hasInlineData() const
+    {
+        return meta_.attr.type == PT_REG && meta_.extra.size() > 0;
+    }
+
+    /// Move inline file contents to data blocks, adding the blocks to
+    /// the transaction. Must be called with the file lock held
+    void promoteInlineData(keyval::Transaction* trans);
+
+    /// Return true if the file's data is stored as variable length
+    /// extents instead of fixed size blocks
+    bool hasExtents() const
+    {
+        return meta_.vers == FILE_VERSION_EXTENTS;
+    }
+
+    /// Read from an extent-based file. The range must be within the
+    /// file.
+    std::shared_ptr<oncrpc::Buffer> readExtents(
+        std::uint64_t offset, std::uint32_t len);
+
+    /// Add writes to the transaction which store data at the given
+    /// offset in an extent-based file. The caller must hold the file
+    /// lock until the transaction is committed since neighbouring
+    /// extents may be rewritten.
+    void writeExtents(
+        keyval::Transaction* trans, std::uint64_t offset,
+        std::shared_ptr<oncrpc::Buffer> data);
+
+    /// Discard any extent data after newSize
+    void truncateExtents(keyval::Transaction* trans, std::uint64_t newSize);
+
+    /// Write data to the file, committing the result. Used by
+    /// ObjOpenFile::write and when flushing write-back buffers.
+    std::uint32_t writeData(
+        std::uint64_t offset, std::shared_ptr<oncrpc::Buffer> data);
+
+    /// Write out any data buffered by open files for this file. Must
+    /// be called without the file lock held
+    void flushWriteBack();
+
+    /// Take the buffered data from every open file for this file, in
+    /// the order the buffers were started. Must be called with
+    /// flushMutex_ and the file lock held
+    std::vector<std::pair<std::uint64_t, std::shared_ptr<oncrpc::Buffer>>>
+    takeAllWriteBack();
+
+    /// Write data taken from a write-back buffer. The data may belong
+    /// to writes which have already completed so if this fails, the
+    /// error is also kept in wbError_ for the next flush. Must be called
+    /// with flushMutex_ held and without the file lock
+    void writeBuffered(
+        std::uint64_t offset, std::shared_ptr<oncrpc::Buffer> data);
+
+    /// Recompute wbSize_ from the remaining buffers after the file size
+    /// has been set explicitly. Must be called with the file lock held
+    void resetWriteBackSize();
+
+    /// Remove an open file from the write-back list. Must be called
+    /// with the file lock held
+    void removeWriteBack(ObjOpenFile* of);
+
     virtual void truncate(
         const Credential& cred, keyval::Transaction* trans,
         std::uint64_t oldSize, std::uint64_t newSize);
@@ -239,6 +382,26 @@ protected:
     std::mutex mutex_;
     std::weak_ptr<ObjFilesystem> fs_;
     ObjFileMetaImpl meta_;
+
+    /// True if meta_.attr.atime has changed since we last wrote the
+    /// metadata (only used with AtimePolicy::LAZY)
+    bool atimeDirty_ = false;
+
+    /// Open files which have buffered writes for this file
+    std::vector<ObjOpenFile*> writeBack_;
+
+    /// Serialises writing out buffered data so that buffers reach the
+    /// database in the order they were taken. Acquired before mutex_
+    std::mutex flushMutex_;
+
+    /// File size including buffered writes. This is kept apart from
+    /// meta_.attr.size so that metadata written for other reasons never
+    /// records a size which the stored data doesn't cover
+    std::uint64_t wbSize_ = 0;
+
+    /// Error from writing buffered data which has not yet been
+    /// reported by ObjOpenFile::flush
+    int wbError_ = 0;
 };
 
 class ObjOpenFile: public OpenFile
@@ -263,11 +426,21 @@ public:
     void flush() override;
 
 private:
+    /// Detach the write-back buffer contents, returning nullptr if
+    /// the buffer is empty. Must be called with the file lock held
+    std::shared_ptr<Buffer> takeWriteBack();
+
     Credential cred_;
     std::shared_ptr<ObjFile> file_;
     int flags_;
     bool needFlush_ = false;
     int fd_ = -1;
+
+    /// Contiguous buffered writes starting at wbOffset_, protected by
+    /// the file lock
+    std::uint64_t wbOffset_ = 0;
+    std::size_t wbLen_ = 0;
+    std::vector<std::uint8_t> wbData_;
 };
 
 class ObjDirectoryIterator: public DirectoryIterator
@@ -282,17 +455,86 @@ public:
     std::shared_ptr<File> file() const override;
     uint64_t seek() const override;
     void next() override;
+    void prefetchFiles(int count) override;
 
 private:
     void decodeEntry();
+    void prefetch() const;
 
     std::shared_ptr<ObjFilesystem> fs_;
-    uint64_t seek_;
+    std::uint32_t hash_ = 0;
+    std::uint32_t index_ = 0;
     DirectoryKeyType start_;
     DirectoryKeyType end_;
     std::unique_ptr<keyval::Iterator> iterator_;
     DirectoryEntry entry_;
     mutable std::shared_ptr<File> file_;
+    int prefetchCount_ = 0;
+    mutable std::unordered_map<
+        std::uint64_t, std::shared_ptr<ObjFile>> prefetched_;
+};
+
+/// A transaction which records its operations so that they can be
+/// combined with other transactions in a group commit
+class ObjTransaction: public keyval::Transaction
+{
+public:
+    void put(
+        std::shared_ptr<keyval::Namespace> ns,
+        std::shared_ptr<keyval::Buffer> key,
+        std::shared_ptr<keyval::Buffer> val) override
+    {
+        size_ += key->size() + val->size();
+        ops_.push_back(
+            [=](keyval::Transaction* trans) { trans->put(ns, key, val); });
+    }
+
+    void remove(
+        std::shared_ptr<keyval::Namespace> ns,
+        std::shared_ptr<keyval::Buffer> key) override
+    {
+        size_ += key->size();
+        ops_.push_back(
+            [=](keyval::Transaction* trans) { trans->remove(ns, key); });
+    }
+
+    void removeRange(
+        std::shared_ptr<keyval::Namespace> ns,
+        std::shared_ptr<keyval::Buffer> startKey,
+        std::shared_ptr<keyval::Buffer> endKey) override
+    {
+        size_ += startKey->size() + endKey->size();
+        ops_.push_back(
+            [=](keyval::Transaction* trans) {
+                trans->removeRange(ns, startKey, endKey);
+            });
+    }
+
+    /// Add our operations to trans
+    void replay(keyval::Transaction* trans)
+    {
+        for (auto& op: ops_)
+            op(trans);
+    }
+
+    /// Record a change to the file count counter for a shard. The
+    /// counter record itself is written by ObjFilesystem::commit
+    void fileCountChanged(int shard, int delta)
+    {
+        size_ += 2 * sizeof(std::uint64_t) + sizeof(std::int64_t);
+        fileCounts_.emplace_back(shard, delta);
+    }
+
+    /// Pairs of shard and delta recorded by fileCountChanged
+    const auto& fileCounts() const { return fileCounts_; }
+
+    /// Approximate size of the keys and values in this transaction
+    size_t size() const { return size_; }
+
+private:
+    std::vector<std::function<void(keyval::Transaction*)>> ops_;
+    std::vector<std::pair<int, int>> fileCounts_;
+    size_t size_ = 0;
 };
 
 class ObjFilesystem: public Filesystem,
@@ -322,6 +564,35 @@ public:
     auto dataNS() const { return dataNS_; }
 
     auto clock() const { return clock_; }
+    auto atimePolicy() const { return atimePolicy_; }
+    void setAtimePolicy(AtimePolicy policy);
+
+    auto dataLayout() const { return dataLayout_; }
+    void setDataLayout(DataLayout layout) { dataLayout_ = layout; }
+
+    /// Regular files no larger than this are stored inline in their
+    /// metadata record. A value of zero disables inline data.
+    auto inlineThreshold() const { return inlineThreshold_; }
+    void setInlineThreshold(std::uint32_t threshold)
+    {
+        inlineThreshold_ = threshold;
+    }
+
+    /// Return the recommended database tuning options for objfs
+    /// namespaces. These are used when mounting with filters=on, which
+    /// must be set when the filesystem is created: RocksDB can't add a
+    /// prefix extractor to a column family which already has tables
+    /// built without one.
+    static keyval::DatabaseOptions databaseOptions();
+
+    /// Open files accumulate contiguous writes up to this size before
+    /// writing whole blocks. A value of zero disables write-back
+    /// buffering.
+    auto writeBackSize() const { return writeBackSize_; }
+    void setWriteBackSize(std::uint32_t size) { writeBackSize_ = size; }
+
+    /// Set the maximum number of files kept in the file cache
+    void setCacheSize(int size) { cache_.setCostLimit(size); }
 
     keyval::Database* db() const
     {
@@ -333,12 +604,21 @@ public:
         return blockSize_;
     }
 
-    FileId nextId()
-    {
-        return FileId(nextId_++);
-    }
+    /// Allocate a fileid for a new file. Fileids are reserved in large
+    /// blocks so that the filesystem metadata only needs to be written
+    /// when a block is used up.
+    FileId nextId();
 
     std::shared_ptr<ObjFile> find(FileId fileid);
+
+    /// Return file objects for a set of fileids, reading the metadata
+    /// of any which are not cached with a single multiGet. New objects
+    /// are added to the cold end of the cache so that scanning a large
+    /// directory does not displace more useful entries. Fileids whose
+    /// metadata does not exist are omitted from the result.
+    std::vector<std::shared_ptr<ObjFile>> prefetch(
+        const std::vector<FileId>& fileids);
+
     virtual std::shared_ptr<ObjFile> makeNewFile(FileId fileid);
     virtual std::shared_ptr<ObjFile> makeNewFile(ObjFileMetaImpl&& meta);
     virtual std::shared_ptr<OpenFile> makeNewOpenFile(
@@ -346,21 +626,99 @@ public:
     void remove(FileId fileid);
     void add(std::shared_ptr<ObjFile> file);
     void writeMeta(keyval::Transaction* trans);
+    void writeMeta(
+        std::unique_lock<std::mutex>& lock, keyval::Transaction* trans);
     void setFsid();
 
-    /// Called when a new file is created
-    void fileCreated() {
-        fileCount_++;
+    /// Set fileCount_ from the filesystem metadata and the file count
+    /// deltas. If fold is true, the deltas are added to the metadata
+    /// and removed.
+    void readFileCount(bool fold);
+
+    /// Rewrite directory entries from a version 1 filesystem to
+    /// include the name hash used for readdir cookies
+    void upgradeDirectories();
+
+    /// Called with the file lock held when a file's access time is
+    /// changed with AtimePolicy::LAZY. If enough files have unsaved
+    /// access times or if they have been unsaved for long enough, they
+    /// are written to the database in a single transaction.
+    void accessTimeChanged(ObjFile* file);
+
+    /// Write any unsaved access times to the database. If non-null,
+    /// locked is a file which is already locked by the caller.
+    void flushAccessTimes(ObjFile* locked = nullptr);
+
+    /// Write unsaved access times periodically until the filesystem is
+    /// destroyed
+    void atimeLoop();
+
+    /// Called with the cache locked when a file is about to be expired
+    /// from the cache. If it has an unsaved access time, it is kept in
+    /// atimeExpired_ until flushAccessTimes writes it.
+    void fileExpired(std::shared_ptr<ObjFile> file);
+
+    /// If fileid was expired from the cache with an unsaved access
+    /// time, return the file so that it can be cached again, otherwise
+    /// nullptr
+    std::shared_ptr<ObjFile> takeExpired(FileId fileid);
+
+    /// Called when a new file is created to record the change in file
+    /// count as part of the transaction which creates it
+    void fileCreated(keyval::Transaction* trans, FileId fileid)
+    {
+        fileCountChanged(trans, fileid, 1);
     }
 
-    /// Called when a file is destroyed
-    void fileDestroyed() {
-        fileCount_--;
+    /// Called when a file is destroyed to record the change in file
+    /// count as part of the transaction which destroys it
+    void fileDestroyed(keyval::Transaction* trans, FileId fileid)
+    {
+        fileCountChanged(trans, fileid, -1);
     }
 
+    /// Changes to the file count are recorded as deltas in one of
+    /// several counter records selected by fileid, keyed by
+    /// DoubleKeyType(0, shard), instead of re-writing the filesystem
+    /// metadata for each create and remove. The deltas are folded into
+    /// the metadata when a replica becomes master. The transaction must
+    /// come from beginTransaction and be committed with commit, which
+    /// writes the counter records in commit order.
+    void fileCountChanged(
+        keyval::Transaction* trans, FileId fileid, int delta);
+
+    /// Add the counter records for the file count changes in a batch
+    /// of transactions to trans, returning the new counter values. Only
+    /// called by the thread which is committing the batch
+    std::vector<std::pair<int, std::int64_t>> writeFileCounts(
+        keyval::Transaction* trans,
+        const std::vector<std::unique_ptr<ObjTransaction>>& transactions);
+
+    /// Add the filesystem metadata to trans (or a new transaction if
+    /// trans is null) and commit it. Metadata writes are made one at a
+    /// time so that they commit in order but mutex_ is not held during
+    /// the commit. Must be called with mutex_ held after beginMetaWrite.
+    void commitMeta(
+        std::unique_lock<std::mutex>& lock,
+        std::unique_ptr<keyval::Transaction> trans = nullptr);
+
+    /// Wait for any other metadata write to finish before changing
+    /// meta_. Must be called with mutex_ held
+    void beginMetaWrite(std::unique_lock<std::mutex>& lock);
+
     /// Called when database master state changes
     virtual void databaseMasterChanged(bool isMaster);
 
+    /// Start a transaction which can be committed using commit() as
+    /// part of a group commit
+    std::unique_ptr<keyval::Transaction> beginTransaction();
+
+    /// Commit a transaction returned by beginTransaction, combining it
+    /// with any other transactions which are waiting to be committed.
+    /// If sync is true, the database is flushed after committing. The
+    /// transaction may be null to just wait for a flush.
+    void commit(std::unique_ptr<keyval::Transaction>&& trans, bool sync);
+
 protected:
     std::mutex mutex_;
     std::shared_ptr<util::Clock> clock_;
@@ -372,10 +730,58 @@ protected:
     ObjFilesystemMeta meta_;
     std::uint32_t blockSize_;
     std::atomic<std::uint64_t> nextId_;
+
+    /// Fileids below this have been reserved in the database. The
+    /// value of meta_.nextId may be larger while a reservation is
+    /// being committed
+    std::uint64_t reservedId_;
+    bool metaWriting_ = false;
+    std::condition_variable metaCv_;
     std::atomic<std::uint64_t> fileCount_;
+    static constexpr int FILE_COUNT_SHARDS = 16;
+    /// Committed value of each file count counter record, only changed
+    /// by the thread committing a batch in commit
+    std::atomic<std::int64_t> fileCountDeltas_[FILE_COUNT_SHARDS];
     FilesystemId fsid_;
     std::shared_ptr<ObjFile> root_;
     util::LRUCache<std::uint64_t, ObjFile> cache_;
+
+    /// Access time handling - the fileids of files with unsaved
+    /// access times are kept here. A file which is expired from cache_
+    /// with an unsaved access time moves to atimeExpired_ until it is
+    /// written. With AtimePolicy::LAZY, atimeThread_ writes access
+    /// times every ATIME_FLUSH_INTERVAL in case no further accesses
+    /// trigger a flush. Lock order is cache_ then atimeMutex_.
+    AtimePolicy atimePolicy_ = AtimePolicy::STRICT;
+    std::mutex atimeMutex_;
+    std::unordered_set<std::uint64_t> atimeDirty_;
+    std::unordered_map<std::uint64_t, std::shared_ptr<ObjFile>> atimeExpired_;
+    util::Clock::time_point atimeFlushTime_;
+    std::thread atimeThread_;
+    std::condition_variable atimeCv_;
+    bool atimeStopping_ = false;
+
+    DataLayout dataLayout_ = DataLayout::BLOCKS;
+
+    /// Group commit - transactions are queued in batches and the first
+    /// waiting thread to find no commit in progress commits the oldest
+    /// batch on behalf of all its members
+    struct CommitBatch
+    {
+        std::vector<std::unique_ptr<ObjTransaction>> transactions;
+        size_t size = 0;
+        bool sync = false;
+        bool done = false;
+        std::exception_ptr error;
+    };
+    std::mutex commitMutex_;
+    std::condition_variable commitCv_;
+    std::deque<std::shared_ptr<CommitBatch>> commitQueue_;
+    bool committing_ = false;
+
+    static constexpr std::uint32_t DEFAULT_INLINE_THRESHOLD = 512;
+    std::uint32_t inlineThreshold_ = DEFAULT_INLINE_THRESHOLD;
+    std::uint32_t writeBackSize_ = 0;
 };
 
 class ObjFilesystemFactory: public FilesystemFactory
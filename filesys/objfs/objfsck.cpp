@@ -40,17 +40,25 @@ using namespace std;
 
 void ObjfsCheck::check(bool checkData)
 {
-    auto defaultNS = db_->getNamespace("default");
-    auto directoriesNS = db_->getNamespace("directories");
-    auto dataNS = db_->getNamespace("data");
+    // Check a consistent snapshot so that we can run while the
+    // filesystem is mounted
+    snapshot_ = db_->snapshot();
+    auto defaultNS = snapshot_->getNamespace("default");
+    auto directoriesNS = snapshot_->getNamespace("directories");
+    auto dataNS = snapshot_->getNamespace("data");
     ObjFilesystemMeta fsmeta;
     try {
         auto buf = defaultNS->get(KeyType(0));
         oncrpc::XdrMemory xm(buf->data(), buf->size());
         xdr(fsmeta, static_cast<oncrpc::XdrSource*>(&xm));
-        if (fsmeta.vers != 1) {
+        if (fsmeta.vers == 1) {
+            LOG(ERROR) << "filesystem version 1 must be upgraded by "
+                << "mounting it before checking";
+            throw system_error(EACCES, system_category());
+        }
+        if (fsmeta.vers != FS_VERSION) {
             LOG(ERROR) << "unexpected filesystem metadata version: "
-                << fsmeta.vers << ", expected: " << 1;
+                << fsmeta.vers << ", expected: " << FS_VERSION;
             throw system_error(EACCES, system_category());
         }
     }
@@ -63,79 +71,94 @@ void ObjfsCheck::check(bool checkData)
     }
 
     KeyType start(1), end(~0ul);
-    auto iterator = defaultNS->iterator(start, end);
-    while (iterator->valid()) {
-        KeyType k(iterator->key());
-        auto id = k.id();
-        ObjFileMeta meta;
-        auto val = iterator->value();
-        oncrpc::XdrMemory xm(val->data(), val->size());
-        xdr(meta, static_cast<oncrpc::XdrSource*>(&xm));
-
-        assert(meta.fileid == id);
-        files_[id] = state{
-            meta.blockSize, meta.attr.type, meta.attr.nlink, 0, 0};
-        iterator->next();
-    }
-    iterator.reset();
+    scanRange(
+        defaultNS, start, end,
+        [this](auto& e) {
+            KeyType k(e.key());
+            auto id = k.id();
+            ObjFileMeta meta;
+            auto val = e.value();
+            oncrpc::XdrMemory xm(val->data(), val->size());
+            xdr(meta, static_cast<oncrpc::XdrSource*>(&xm));
 
-    DirectoryKeyType dirstart(1, ""), dirend(~0ul, "");
-    iterator = directoriesNS->iterator(dirstart, dirend);
-    while (iterator->valid()) {
-        DirectoryKeyType k(iterator->key());
+            assert(meta.fileid == id);
+            files_[id] = state{
+                meta.blockSize, meta.vers == FILE_VERSION_EXTENTS,
+                meta.attr.type, meta.attr.nlink, 0, 0};
+            return true;
+        });
 
-        DirectoryEntry entry;
-        DirectoryKeyType key(iterator->key());
-        auto val = iterator->value();
-        oncrpc::XdrMemory xm(val->data(), val->size());
-        xdr(entry, static_cast<oncrpc::XdrSource*>(&xm));
+    auto dirstart = DirectoryKeyType::prefix(1);
+    auto dirend = DirectoryKeyType::prefix(~0ul);
+    scanRange(
+        directoriesNS, dirstart, dirend,
+        [this](auto& e) {
+            DirectoryEntry entry;
+            DirectoryKeyType key(e.key());
+            auto val = e.value();
+            oncrpc::XdrMemory xm(val->data(), val->size());
+            xdr(entry, static_cast<oncrpc::XdrSource*>(&xm));
 
-        if (files_.find(entry.fileid) == files_.end()) {
-            cerr << key.fileid() << ": entry " << key.name()
-                 << " references unknown fileid: " << entry.fileid << endl;
-        }
-
-        auto& f = files_[entry.fileid];
-        f.refs++;
-        auto name = k.name();
-        if (name != "." && name != "..") {
-            f.parent = k.fileid();
-            f.name = name;
-        }
+            if (key.hash() != DirectoryKeyType::hashName(key.name())) {
+                cerr << key.fileid() << ": entry " << key.name()
+                     << " has incorrect name hash" << endl;
+            }
+            if (files_.find(entry.fileid) == files_.end()) {
+                cerr << key.fileid() << ": entry " << key.name()
+                     << " references unknown fileid: " << entry.fileid
+                     << endl;
+            }
 
-        iterator->next();
-    }
-    iterator.reset();
+            auto& f = files_[entry.fileid];
+            f.refs++;
+            auto name = key.name();
+            if (name != "." && name != "..") {
+                f.parent = key.fileid();
+                f.name = name;
+            }
+            return true;
+        });
 
     if (checkData) {
         DataKeyType datastart(1, 0), dataend(~0ul, 0);
-        iterator = dataNS->iterator(datastart, dataend);
         uint64_t lastOffset = 0;
         uint64_t lastFileid = 0;
-        while (iterator->valid()) {
-            DataKeyType key(iterator->key());
-            auto fileid = key.fileid();
-            auto offset = key.offset();
-            auto blockSize = files_[fileid].blockSize;
-            if (lastFileid != fileid) {
-                lastFileid = fileid;
-                lastOffset = 0;
-            }
-            if (files_.find(key.fileid()) == files_.end()) {
-                cerr << "Orphan data block for unknown fileid: "
-                     << key.fileid() << endl;
-            }
-            if (offset % blockSize) {
-                cerr << "fileid: " << fileid
-                     << " unaligned block offset " << offset << endl;
-            }
-            if (offset < lastOffset) {
-                cerr << "fileid: " << fileid
-                     << " disordered offset " << offset << endl;
-            }
-            lastOffset = offset + blockSize;
-            iterator->next();
-        }
+        scanRange(
+            dataNS, datastart, dataend,
+            [&](auto& e) {
+                DataKeyType key(e.key());
+                auto fileid = key.fileid();
+                auto offset = key.offset();
+                auto blockSize = files_[fileid].blockSize;
+                if (lastFileid != fileid) {
+                    lastFileid = fileid;
+                    lastOffset = 0;
+                }
+                if (files_.find(key.fileid()) == files_.end()) {
+                    cerr << "Orphan data block for unknown fileid: "
+                         << key.fileid() << endl;
+                }
+                if (files_[fileid].extents) {
+                    // Extents may have any size but must not overlap
+                    if (offset < lastOffset) {
+                        cerr << "fileid: " << fileid
+                             << " overlapping extent at offset " << offset
+                             << endl;
+                    }
+                    lastOffset = offset + e.valueSize();
+                    return true;
+                }
+                if (offset % blockSize) {
+                    cerr << "fileid: " << fileid
+                         << " unaligned block offset " << offset << endl;
+                }
+                if (offset < lastOffset) {
+                    cerr << "fileid: " << fileid
+                         << " disordered offset " << offset << endl;
+                }
+                lastOffset = offset + blockSize;
+                return true;
+            });
     }
 
     for (auto& i: files_) {
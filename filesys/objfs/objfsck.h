@@ -50,6 +50,7 @@ public:
 protected:
     struct state {
         std::uint32_t blockSize;
+        bool extents;
         PosixType type;
         std::uint32_t nlink;
         std::uint32_t refs;
@@ -67,6 +68,7 @@ protected:
     }
 
     std::shared_ptr<keyval::Database> db_;
+    std::shared_ptr<keyval::Snapshot> snapshot_;
     std::uint32_t blockSize_;
     std::map<std::uint64_t, state> files_;
 };
@@ -27,148 +27,240 @@
 // -*- c++ -*-
 #pragma once
 
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
 #include <filesys/filesys.h>
+#include <keyval/keyval.h>
 
 namespace filesys {
 namespace objfs {
 
+constexpr int OBJFS_NAME_MAX = 255;     // consistent with FreeBSD default
+
+/// Convert a 64bit value between host and big endian byte order
+constexpr std::uint64_t bigEndian64(std::uint64_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(n);
+#else
+    return n;
+#endif
+}
+
+/// Convert a 32bit value between host and big endian byte order
+constexpr std::uint32_t bigEndian32(std::uint32_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(n);
+#else
+    return n;
+#endif
+}
+
+/// Storage for keys which are encoded in place rather than in a
+/// heap-allocated buffer. Keys can be passed directly to the keyval
+/// methods which take a KeySpan - converting to a Buffer copies the
+/// key.
+template <std::size_t N>
+class LocalKey: public keyval::KeySpan
+{
+public:
+    LocalKey(std::size_t size = N)
+        : KeySpan(bytes_, size)
+    {
+        assert(size <= N);
+    }
+
+    LocalKey(std::shared_ptr<oncrpc::Buffer> buf)
+        : KeySpan(bytes_, buf->size())
+    {
+        if (buf->size() > N)
+            throw std::system_error(ENAMETOOLONG, std::system_category());
+        std::copy_n(buf->data(), buf->size(), bytes_);
+    }
+
+    // The span must refer to our own storage, not the source's
+    LocalKey(const LocalKey& other)
+        : KeySpan(bytes_, other.size_)
+    {
+        std::copy_n(other.bytes_, other.size_, bytes_);
+    }
+
+    LocalKey& operator=(const LocalKey& other)
+    {
+        size_ = other.size_;
+        std::copy_n(other.bytes_, other.size_, bytes_);
+        return *this;
+    }
+
+    operator std::shared_ptr<oncrpc::Buffer>() const
+    {
+        return std::make_shared<oncrpc::Buffer>(size_, bytes_);
+    }
+
+protected:
+    void put64(std::size_t off, std::uint64_t n)
+    {
+        n = bigEndian64(n);
+        std::memcpy(bytes_ + off, &n, sizeof(n));
+    }
+
+    std::uint64_t get64(std::size_t off) const
+    {
+        std::uint64_t n;
+        std::memcpy(&n, bytes_ + off, sizeof(n));
+        return bigEndian64(n);
+    }
+
+    void put32(std::size_t off, std::uint32_t n)
+    {
+        n = bigEndian32(n);
+        std::memcpy(bytes_ + off, &n, sizeof(n));
+    }
+
+    std::uint32_t get32(std::size_t off) const
+    {
+        std::uint32_t n;
+        std::memcpy(&n, bytes_ + off, sizeof(n));
+        return bigEndian32(n);
+    }
+
+    std::uint8_t bytes_[N];
+};
+
 /// Key type for our DB - indexing by 64bit integer id. For file
 /// metadata, we use the fileid as index with fileid zero referencing
 /// filesystem metadata. The id is encoded big endian to group
 /// consecutive entries
-struct KeyType {
+struct KeyType: public LocalKey<sizeof(std::uint64_t)> {
     KeyType(std::uint64_t id)
-        : buf_(std::make_shared<oncrpc::Buffer>(sizeof(std::uint64_t)))
     {
-        std::uint64_t n = id;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            buf_->data()[i] = (n >> 56) & 0xff;
-            n <<= 8;
-        }
+        put64(0, id);
     }
 
     KeyType(std::shared_ptr<oncrpc::Buffer> buf)
-        : buf_(buf)
+        : LocalKey(buf)
     {
         assert(buf->size() == sizeof(std::uint64_t));
     }
 
-    operator std::shared_ptr<oncrpc::Buffer>() const
-    {
-        return buf_;
-    }
-
     std::uint64_t id() const
     {
-        std::uint64_t n = 0;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            n = (n << 8) + buf_->data()[i];
-        }
-        return n;
+        return get64(0);
     }
-
-private:
-    std::shared_ptr<oncrpc::Buffer> buf_;
 };
 
 
 /// Key type containing two 64bit fields
-struct DoubleKeyType {
+struct DoubleKeyType: public LocalKey<2*sizeof(std::uint64_t)> {
     DoubleKeyType(std::uint64_t id0, std::uint64_t id1)
-        : buf_(std::make_shared<oncrpc::Buffer>(2*sizeof(std::uint64_t)))
     {
-        std::uint64_t n = id0;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            buf_->data()[i] = (n >> 56) & 0xff;
-            n <<= 8;
-        }
-        n = id1;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            buf_->data()[8+i] = (n >> 56) & 0xff;
-            n <<= 8;
-        }
+        put64(0, id0);
+        put64(sizeof(std::uint64_t), id1);
     }
 
     DoubleKeyType(std::shared_ptr<oncrpc::Buffer> buf)
-        : buf_(buf)
+        : LocalKey(buf)
     {
         assert(buf->size() == 2*sizeof(std::uint64_t));
-        std::copy_n(buf->data(), buf->size(), buf_->data());
-    }
-
-    operator std::shared_ptr<oncrpc::Buffer>() const
-    {
-        return buf_;
     }
 
     std::uint64_t id0() const
     {
-        std::uint64_t n = 0;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            n = (n << 8) + buf_->data()[i];
-        }
-        return n;
+        return get64(0);
     }
 
     std::uint64_t id1() const
     {
-        std::uint64_t n = 0;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            n = (n << 8) + buf_->data()[8+i];
-        }
-        return n;
+        return get64(sizeof(std::uint64_t));
     }
-
-private:
-    std::shared_ptr<oncrpc::Buffer> buf_;
 };
 
-/// Key type for directory entries - we append the name to the fileid
-/// which groups the keys for efficient lookup. We use big endian for
-/// the fileid so we can iterate over the directory easily
-struct DirectoryKeyType
+/// Key type for directory entries - we append a 32bit hash of the name
+/// and then the name itself to the fileid which groups the keys for
+/// efficient lookup. We use big endian for the fileid so we can iterate
+/// over the directory easily. Within a directory, entries are ordered by
+/// name hash which allows a readdir cookie made from the hash and an
+/// index within the set of colliding names to be resolved with a single
+/// seek
+struct DirectoryKeyType: public LocalKey<
+    sizeof(std::uint64_t) + sizeof(std::uint32_t) + OBJFS_NAME_MAX>
 {
-    DirectoryKeyType(std::uint64_t id, std::string name)
-        : buf_(std::make_shared<oncrpc::Buffer>(sizeof(std::uint64_t) + name.size()))
+    static constexpr size_t HEADER_SIZE =
+        sizeof(std::uint64_t) + sizeof(std::uint32_t);
+
+    DirectoryKeyType(std::uint64_t id, const std::string& name)
+        : LocalKey(HEADER_SIZE + checkName(name))
     {
-        std::uint64_t n = id;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            buf_->data()[i] = (n >> 56) & 0xff;
-            n <<= 8;
-        }
+        encodeHeader(id, hashName(name));
         std::copy_n(
             reinterpret_cast<const uint8_t*>(name.data()), name.size(),
-            buf_->data() + sizeof(uint64_t));
+            bytes_ + HEADER_SIZE);
     }
 
     DirectoryKeyType(std::shared_ptr<oncrpc::Buffer> buf)
-        : buf_(buf)
+        : LocalKey(buf)
     {
     }
 
-    operator std::shared_ptr<oncrpc::Buffer>() const
+    /// Return a key which sorts before all entries in directory id
+    /// whose name hash is greater than or equal to hash
+    static DirectoryKeyType prefix(std::uint64_t id, std::uint32_t hash = 0)
     {
-        return buf_;
+        DirectoryKeyType key;
+        key.encodeHeader(id, hash);
+        return key;
     }
 
-    std::uint64_t fileid() const
+    /// FNV-1a hash of an entry name
+    static std::uint32_t hashName(const std::string& name)
     {
-        std::uint64_t n = 0;
-        for (size_t i = 0; i < sizeof(n); i++) {
-            n = (n << 8) + buf_->data()[i];
+        std::uint32_t h = 2166136261u;
+        for (auto c: name) {
+            h ^= std::uint8_t(c);
+            h *= 16777619u;
         }
-        return n;
+        return h;
+    }
+
+    std::uint64_t fileid() const
+    {
+        return get64(0);
+    }
+
+    std::uint32_t hash() const
+    {
+        return get32(sizeof(std::uint64_t));
     }
 
     std::string name() const
     {
         return std::string(
-            reinterpret_cast<const char*>(buf_->data() + sizeof(uint64_t)),
-            buf_->size() - sizeof(uint64_t));
+            reinterpret_cast<const char*>(bytes_ + HEADER_SIZE),
+            size_ - HEADER_SIZE);
     }
 
 private:
-    std::shared_ptr<oncrpc::Buffer> buf_;
+    DirectoryKeyType()
+        : LocalKey(HEADER_SIZE)
+    {
+    }
+
+    static std::size_t checkName(const std::string& name)
+    {
+        if (name.size() > OBJFS_NAME_MAX)
+            throw std::system_error(ENAMETOOLONG, std::system_category());
+        return name.size();
+    }
+
+    void encodeHeader(std::uint64_t id, std::uint32_t hash)
+    {
+        put64(0, id);
+        put32(sizeof(std::uint64_t), hash);
+    }
 };
 
 /// Key type for file data and block map - we index by fileid and byte offset,
@@ -8,7 +8,7 @@ struct UUID
 
 struct ObjFilesystemMeta
 {
-    int vers;               /* = 1 */
+    int vers;               /* = 2 */
     UUID fsid;              /* unique identifier for this filesystem */
     unsigned hyper nextId;  /* next fileid to use */
     unsigned hyper fileCount; /* number of files in this filesystem */
@@ -45,7 +45,7 @@ struct PosixAttr {
  */
 struct ObjFileMeta
 {
-    int vers;			/* = 1 */
+    int vers;			/* = 1 (block data) or 2 (extent data) */
     unsigned hyper fileid;	/* unique file identifier */
     unsigned blockSize;		/* file block size */
     PosixAttr attr;		/* posix-style file attributes */
@@ -24,6 +24,7 @@
  * SUCH DAMAGE.
  */
 
+#include <set>
 #include <thread>
 #include <unordered_set>
 
@@ -40,11 +41,11 @@ using namespace std;
 class ObjfsTest
 {
 public:
-    ObjfsTest()
+    ObjfsTest(shared_ptr<Database> db = make_memdb())
     {
         Credential cred(0, 0, {}, true);
         clock_ = make_shared<util::MockClock>();
-        fs_ = make_shared<ObjFilesystem>(make_memdb(), nullptr, clock_);
+        fs_ = make_shared<ObjFilesystem>(db, nullptr, clock_);
         blockSize_ = fs_->blockSize();
         fs_->root()->setattr(cred, setMode777);
     }
@@ -58,14 +59,60 @@ public:
 
 INSTANTIATE_TYPED_TEST_CASE_P(ObjfsTest, FilesystemTest, ObjfsTest);
 
+class ObjfsExtentTest: public ObjfsTest
+{
+public:
+    ObjfsExtentTest()
+    {
+        fs_->setDataLayout(DataLayout::EXTENTS);
+    }
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P(
+    ObjfsExtentTest, FilesystemTest, ObjfsExtentTest);
+
+class ObjfsWriteBackTest: public ObjfsTest
+{
+public:
+    ObjfsWriteBackTest()
+    {
+        fs_->setWriteBackSize(4 * blockSize_);
+    }
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P(
+    ObjfsWriteBackTest, FilesystemTest, ObjfsWriteBackTest);
+
+static MemoryOptions shardedOptions()
+{
+    MemoryOptions opts;
+    opts.shards = 8;
+    return opts;
+}
+
+class ObjfsShardedTest: public ObjfsTest
+{
+public:
+    ObjfsShardedTest()
+        : ObjfsTest(make_memdb(shardedOptions()))
+    {
+    }
+};
+
+INSTANTIATE_TYPED_TEST_CASE_P(
+    ObjfsShardedTest, FilesystemTest, ObjfsShardedTest);
+
 class ObjfsTestExtra: public ObjfsTest, public ::testing::Test
 {
 };
 
-TEST_F(ObjfsTestExtra, MultiThread)
+class ObjfsShardedTestExtra: public ObjfsShardedTest, public ::testing::Test
 {
-    auto root = fs_->root();
+};
 
+// Create and write files from many threads at once
+static void multiThread(shared_ptr<File> root)
+{
     vector<thread> threads;
     for (int i = 0; i < 32; i++) {
         threads.emplace_back(
@@ -96,6 +143,637 @@ TEST_F(ObjfsTestExtra, MultiThread)
         t.join();
 }
 
+TEST_F(ObjfsTestExtra, MultiThread)
+{
+    multiThread(fs_->root());
+}
+
+TEST_F(ObjfsShardedTestExtra, MultiThread)
+{
+    multiThread(fs_->root());
+}
+
+// Verify that a database snapshot is not affected by later writes
+static void snapshot(shared_ptr<ObjFilesystem> fs)
+{
+    Credential cred(0, 0, {}, true);
+    auto root = fs->root();
+    auto foo = root->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto fooid = foo->file()->getattr()->fileid();
+    auto snap = fs->db()->snapshot();
+    auto bar = root->open(
+        cred, "bar", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto barid = bar->file()->getattr()->fileid();
+    root->remove(cred, "foo");
+
+    auto ns = snap->getNamespace("default");
+    EXPECT_NO_THROW(ns->get(KeyType(fooid)));
+    EXPECT_THROW(ns->get(KeyType(barid)), system_error);
+    int count = 0;
+    for (auto it = snap->getNamespace("directories")->iterator(
+             DirectoryKeyType::prefix(1), DirectoryKeyType::prefix(2));
+         it->valid(); it->next()) {
+        DirectoryKeyType key(it->key());
+        EXPECT_NE("bar", key.name());
+        if (key.name() == "foo")
+            count++;
+    }
+    EXPECT_EQ(1, count);
+    EXPECT_THROW(
+        fs->directoriesNS()->get(DirectoryKeyType(1, "foo")), system_error);
+}
+
+TEST_F(ObjfsTestExtra, Snapshot)
+{
+    snapshot(fs_);
+}
+
+TEST_F(ObjfsShardedTestExtra, Snapshot)
+{
+    snapshot(fs_);
+}
+
+// Scan a directory with a batch size small enough to need several
+// batches and check that every entry is seen exactly once
+static void scan(shared_ptr<ObjFilesystem> fs)
+{
+    Credential cred(0, 0, {}, true);
+    auto root = fs->root();
+    for (int i = 0; i < 100; i++) {
+        root->open(
+            cred, "file" + to_string(i),
+            OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    }
+
+    set<string> names;
+    scanPrefix(
+        fs->directoriesNS(), KeyType(1),
+        [&](auto& e) {
+            DirectoryKeyType key(e.key());
+            EXPECT_EQ(1, key.fileid());
+            EXPECT_TRUE(names.insert(key.name()).second);
+            return true;
+        },
+        128);
+    EXPECT_EQ(102u, names.size());
+
+    int count = 0;
+    scanPrefix(
+        fs->directoriesNS(), KeyType(1),
+        [&](auto& e) { return ++count < 10; },
+        128);
+    EXPECT_EQ(10, count);
+}
+
+TEST_F(ObjfsTestExtra, Scan)
+{
+    scan(fs_);
+}
+
+TEST_F(ObjfsShardedTestExtra, Scan)
+{
+    scan(fs_);
+}
+
+TEST_F(ObjfsTestExtra, GroupCommit)
+{
+    Credential cred(0, 0, {}, true);
+    auto root = fs_->root();
+
+    // Many concurrent writers share commits but all their data arrives
+    vector<shared_ptr<OpenFile>> files;
+    for (int i = 0; i < 16; i++) {
+        files.push_back(root->open(
+            cred, "f" + to_string(i), OpenFlags::RDWR+OpenFlags::CREATE,
+            setMode666));
+    }
+    vector<thread> threads;
+    for (int i = 0; i < 16; i++) {
+        threads.emplace_back(
+            [i, &files, this]() {
+                for (int j = 0; j < 16; j++) {
+                    auto buf = make_shared<Buffer>(blockSize_);
+                    fill_n(buf->data(), blockSize_, i + j);
+                    files[i]->write(j * blockSize_, buf);
+                }
+                files[i]->flush();
+            });
+    }
+    for (auto& t: threads)
+        t.join();
+    for (int i = 0; i < 16; i++) {
+        bool eof;
+        for (int j = 0; j < 16; j++) {
+            auto buf = files[i]->read(j * blockSize_, blockSize_, eof);
+            EXPECT_EQ(i + j, buf->data()[0]);
+        }
+    }
+}
+
+// Read the stored metadata for a file directly from the database
+static ObjFileMeta storedMeta(shared_ptr<ObjFilesystem> fs, FileId fileid)
+{
+    auto buf = fs->defaultNS()->get(KeyType(fileid));
+    ObjFileMeta meta;
+    oncrpc::XdrMemory xm(buf->data(), buf->size());
+    xdr(meta, static_cast<oncrpc::XdrSource*>(&xm));
+    return meta;
+}
+
+static uint64_t storedAtime(shared_ptr<ObjFilesystem> fs, FileId fileid)
+{
+    return storedMeta(fs, fileid).attr.atime;
+}
+
+TEST_F(ObjfsTestExtra, NoAtime)
+{
+    using namespace std::literals;
+    Credential cred(0, 0, {}, true);
+    fs_->setAtimePolicy(AtimePolicy::NOATIME);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto file = of->file();
+    of->write(0, make_shared<Buffer>(blockSize_));
+    auto atime = file->getattr()->atime();
+    *clock_ += 1s;
+    bool eof;
+    of->read(0, blockSize_, eof);
+    EXPECT_EQ(atime, file->getattr()->atime());
+}
+
+TEST_F(ObjfsTestExtra, RelAtime)
+{
+    using namespace std::literals;
+    Credential cred(0, 0, {}, true);
+    fs_->setAtimePolicy(AtimePolicy::RELATIME);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto file = of->file();
+    of->write(0, make_shared<Buffer>(blockSize_));
+    bool eof;
+
+    // The first read after a write updates atime
+    auto atime = file->getattr()->atime();
+    *clock_ += 1s;
+    of->read(0, blockSize_, eof);
+    EXPECT_LT(atime, file->getattr()->atime());
+
+    // Subsequent reads don't
+    atime = file->getattr()->atime();
+    *clock_ += 1s;
+    of->read(0, blockSize_, eof);
+    EXPECT_EQ(atime, file->getattr()->atime());
+
+    // Unless atime is more than a day old
+    *clock_ += 25h;
+    of->read(0, blockSize_, eof);
+    EXPECT_LT(atime, file->getattr()->atime());
+}
+
+TEST_F(ObjfsTestExtra, LazyAtime)
+{
+    using namespace std::literals;
+    Credential cred(0, 0, {}, true);
+    fs_->setAtimePolicy(AtimePolicy::LAZY);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto file = of->file();
+    auto fileid = file->getattr()->fileid();
+    of->write(0, make_shared<Buffer>(blockSize_));
+    auto atime = storedAtime(fs_, fileid);
+    auto cachedAtime = file->getattr()->atime();
+    *clock_ += 1s;
+    bool eof;
+    of->read(0, blockSize_, eof);
+
+    // The new atime is visible but not yet written
+    EXPECT_LT(cachedAtime, file->getattr()->atime());
+    EXPECT_EQ(atime, storedAtime(fs_, fileid));
+    fs_->flushAccessTimes();
+    EXPECT_LT(atime, storedAtime(fs_, fileid));
+
+    // Access times are written automatically after a while
+    atime = storedAtime(fs_, fileid);
+    *clock_ += 1min;
+    of->read(0, blockSize_, eof);
+    EXPECT_LT(atime, storedAtime(fs_, fileid));
+}
+
+TEST(ObjfsAtimeTest, LazyAtimeUnmount)
+{
+    using namespace std::literals;
+    Credential cred(0, 0, {}, true);
+    auto db = make_memdb();
+    auto clock = make_shared<util::MockClock>();
+    auto fs = make_shared<ObjFilesystem>(db, nullptr, clock);
+    fs->setAtimePolicy(AtimePolicy::LAZY);
+    auto of = fs->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto fileid = of->file()->getattr()->fileid();
+    of->write(0, make_shared<Buffer>(100));
+    auto atime = storedAtime(fs, fileid);
+    *clock += 1s;
+    bool eof;
+    of->read(0, 100, eof);
+    EXPECT_EQ(atime, storedAtime(fs, fileid));
+
+    // Destroying the filesystem writes unsaved access times
+    of.reset();
+    fs.reset();
+    fs = make_shared<ObjFilesystem>(db, nullptr, clock);
+    EXPECT_LT(atime, storedAtime(fs, fileid));
+}
+
+TEST_F(ObjfsTestExtra, LazyAtimeExpire)
+{
+    using namespace std::literals;
+    Credential cred(0, 0, {}, true);
+    fs_->setAtimePolicy(AtimePolicy::LAZY);
+    fs_->setCacheSize(2);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto fileid = of->file()->getattr()->fileid();
+    of->write(0, make_shared<Buffer>(100));
+    auto atime = storedAtime(fs_, fileid);
+    *clock_ += 1s;
+    bool eof;
+    of->read(0, 100, eof);
+    of.reset();
+
+    // Creating more files expires foo from the cache without writing
+    // its access time
+    for (int i = 0; i < 4; i++) {
+        fs_->root()->open(
+            cred, "bar" + to_string(i),
+            OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    }
+    EXPECT_EQ(atime, storedAtime(fs_, fileid));
+
+    // The next flush writes it
+    fs_->flushAccessTimes();
+    EXPECT_LT(atime, storedAtime(fs_, fileid));
+}
+
+TEST_F(ObjfsTestExtra, InlineData)
+{
+    Credential cred(0, 0, {}, true);
+    fs_->setInlineThreshold(100);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto fileid = of->file()->getattr()->fileid();
+    auto hasBlocks = [this, fileid]() {
+        try {
+            fs_->dataNS()->get(DataKeyType(fileid, 0));
+            return true;
+        }
+        catch (system_error&) {
+            return false;
+        }
+    };
+
+    // Small writes are stored in the metadata record
+    auto buf = make_shared<Buffer>(50);
+    fill_n(buf->data(), 50, 1);
+    of->write(0, buf);
+    EXPECT_FALSE(hasBlocks());
+    bool eof;
+    auto data = of->read(0, 100, eof);
+    EXPECT_TRUE(eof);
+    EXPECT_EQ(50, data->size());
+    EXPECT_EQ(1, data->data()[49]);
+
+    // Growing past the threshold moves the data to blocks
+    of->write(60, buf);
+    EXPECT_TRUE(hasBlocks());
+    EXPECT_EQ(110, of->file()->getattr()->size());
+    data = of->read(0, 110, eof);
+    EXPECT_EQ(110, data->size());
+    EXPECT_EQ(1, data->data()[0]);
+    EXPECT_EQ(0, data->data()[55]);
+    EXPECT_EQ(1, data->data()[109]);
+}
+
+TEST_F(ObjfsTestExtra, WriteBack)
+{
+    Credential cred(0, 0, {}, true);
+    fs_->setWriteBackSize(4 * blockSize_);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto fileid = of->file()->getattr()->fileid();
+    auto hasBlock = [this, fileid](uint64_t off) {
+        try {
+            fs_->dataNS()->get(DataKeyType(fileid, off));
+            return true;
+        }
+        catch (system_error&) {
+            return false;
+        }
+    };
+
+    // Small sequential writes are buffered but visible in the
+    // file attributes
+    auto chunk = blockSize_ / 4;
+    auto buf = make_shared<Buffer>(chunk);
+    for (int i = 0; i < 6; i++) {
+        fill_n(buf->data(), chunk, i + 1);
+        of->write(i * chunk, buf);
+    }
+    EXPECT_FALSE(hasBlock(0));
+    EXPECT_EQ(6 * chunk, of->file()->getattr()->size());
+
+    // Filling the buffer writes whole blocks and keeps the tail
+    for (int i = 6; i < 17; i++) {
+        fill_n(buf->data(), chunk, i + 1);
+        of->write(i * chunk, buf);
+    }
+    EXPECT_TRUE(hasBlock(3 * blockSize_));
+    EXPECT_FALSE(hasBlock(4 * blockSize_));
+
+    // Reads see buffered data
+    bool eof;
+    auto data = of->read(4 * blockSize_, chunk, eof);
+    EXPECT_TRUE(eof);
+    EXPECT_EQ(17, data->data()[0]);
+    EXPECT_TRUE(hasBlock(4 * blockSize_));
+
+    // A non-contiguous write is buffered separately and written on flush
+    of->write(8 * blockSize_, buf);
+    EXPECT_FALSE(hasBlock(8 * blockSize_));
+    of->flush();
+    EXPECT_TRUE(hasBlock(8 * blockSize_));
+    EXPECT_EQ(8 * blockSize_ + chunk, of->file()->getattr()->size());
+
+    // Closing the file writes any remaining buffered data
+    of->write(9 * blockSize_, buf);
+    of.reset();
+    EXPECT_TRUE(hasBlock(9 * blockSize_));
+}
+
+TEST_F(ObjfsTestExtra, WriteBackStoredSize)
+{
+    Credential cred(0, 0, {}, true);
+    fs_->setInlineThreshold(100);
+    fs_->setWriteBackSize(4 * blockSize_);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto file = of->file();
+    auto fileid = file->getattr()->fileid();
+    auto buf = make_shared<Buffer>(50);
+    fill_n(buf->data(), 50, 1);
+    of->write(0, buf);
+
+    // Growing the file past the inline threshold is buffered. Writing
+    // the metadata for some other reason must not store the new size
+    // with the old inline data.
+    auto big = make_shared<Buffer>(200);
+    fill_n(big->data(), 200, 2);
+    of->write(50, big);
+    EXPECT_EQ(250, file->getattr()->size());
+    fs_->root()->link(cred, "bar", file);
+    auto meta = storedMeta(fs_, fileid);
+    EXPECT_EQ(50, meta.attr.size);
+    EXPECT_EQ(50, meta.extra.size());
+
+    of->flush();
+    meta = storedMeta(fs_, fileid);
+    EXPECT_EQ(250, meta.attr.size);
+    EXPECT_EQ(0, meta.extra.size());
+    EXPECT_EQ(250, file->getattr()->size());
+
+    // Truncating discards the buffered size
+    of->write(250, buf);
+    EXPECT_EQ(300, file->getattr()->size());
+    file->setattr(cred, [](auto attr){ attr->setSize(10); });
+    EXPECT_EQ(10, file->getattr()->size());
+}
+
+TEST_F(ObjfsTestExtra, WriteBackTwoOpens)
+{
+    // A large write which bypasses the write-back buffer must not be
+    // overwritten later by older data buffered by another open file
+    Credential cred(0, 0, {}, true);
+    fs_->setInlineThreshold(0);
+    fs_->setWriteBackSize(4 * blockSize_);
+    auto of1 = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto of2 = fs_->root()->open(cred, "foo", OpenFlags::RDWR);
+    auto small = make_shared<Buffer>(blockSize_);
+    fill_n(small->data(), blockSize_, 1);
+    of1->write(0, small);
+    auto big = make_shared<Buffer>(4 * blockSize_);
+    fill_n(big->data(), 4 * blockSize_, 2);
+    of2->write(0, big);
+    of1->flush();
+    of2->flush();
+
+    bool eof;
+    auto buf = of1->read(0, 4 * blockSize_, eof);
+    ASSERT_EQ(4 * blockSize_, buf->size());
+    EXPECT_EQ(
+        4 * blockSize_, count(buf->data(), buf->data() + buf->size(), 2));
+}
+
+TEST_F(ObjfsTestExtra, Extents)
+{
+    Credential cred(0, 0, {}, true);
+    fs_->setDataLayout(DataLayout::EXTENTS);
+    fs_->setInlineThreshold(0);
+    auto of = fs_->root()->open(
+        cred, "foo", OpenFlags::RDWR+OpenFlags::CREATE, setMode666);
+    auto file = of->file();
+    auto fileid = file->getattr()->fileid();
+    auto extents = [this, fileid]() {
+        vector<pair<uint64_t, size_t>> res;
+        auto iter = fs_->dataNS()->iterator(
+            DataKeyType(fileid, 0), DataKeyType(fileid, ~0ull));
+        for (; iter->valid(); iter->next()) {
+            DataKeyType key(iter->key());
+            res.emplace_back(key.offset(), iter->value()->size());
+        }
+        return res;
+    };
+
+    // Sequential writes are merged into a single extent
+    for (int i = 0; i < 8; i++) {
+        auto buf = make_shared<Buffer>(4096);
+        fill_n(buf->data(), 4096, i + 1);
+        of->write(i * 4096, buf);
+    }
+    EXPECT_EQ((vector<pair<uint64_t, size_t>>{{0, 32768}}), extents());
+
+    // Overwrites split the extent, preserving the surrounding data
+    // without re-writing it
+    auto buf = make_shared<Buffer>(100);
+    fill_n(buf->data(), 100, 0xff);
+    of->write(5000, buf);
+    EXPECT_EQ((vector<pair<uint64_t, size_t>>{
+                {0, 5000}, {5000, 100}, {5100, 27668}}),
+              extents());
+    bool eof;
+    auto data = of->read(0, 32768, eof);
+    EXPECT_EQ(2, data->data()[4999]);
+    EXPECT_EQ(0xff, data->data()[5000]);
+    EXPECT_EQ(0xff, data->data()[5099]);
+    EXPECT_EQ(2, data->data()[5100]);
+    EXPECT_EQ(8, data->data()[32767]);
+
+    // Truncating trims the last extent
+    file->setattr(cred, [](auto attr){ attr->setSize(6000); });
+    EXPECT_EQ((vector<pair<uint64_t, size_t>>{
+                {0, 5000}, {5000, 100}, {5100, 900}}),
+              extents());
+
+    // Writing after a hole starts a new extent
+    of->write(100000, buf);
+    EXPECT_EQ((vector<pair<uint64_t, size_t>>{
+                {0, 5000}, {5000, 100}, {5100, 900}, {100000, 100}}),
+              extents());
+    data = of->read(5990, 20, eof);
+    EXPECT_EQ(2, data->data()[9]);
+    EXPECT_EQ(0, data->data()[10]);
+}
+
+TEST_F(ObjfsTestExtra, FileCount)
+{
+    Credential cred(0, 0, {}, true);
+    auto root = fs_->root();
+    EXPECT_EQ(1, fs_->fileCount());
+    for (int i = 0; i < 10; i++)
+        root->mkfifo(cred, "f" + to_string(i), setMode666);
+    root->remove(cred, "f0");
+    EXPECT_EQ(10, fs_->fileCount());
+
+    // The count survives a remount which also folds the deltas into
+    // the filesystem metadata and fileids are not re-used
+    auto fileid = root->lookup(cred, "f9")->getattr()->fileid();
+    auto fs = make_shared<ObjFilesystem>(fs_->database(), nullptr, clock_);
+    EXPECT_EQ(10, fs->fileCount());
+    auto file = fs->root()->mkfifo(cred, "foo", setMode666);
+    EXPECT_LT(fileid, file->getattr()->fileid());
+    EXPECT_EQ(11, fs->fileCount());
+}
+
+TEST_F(ObjfsShardedTestExtra, FileCountConcurrent)
+{
+    // Creates and removes in separate directories commit concurrently
+    // but the stored count must still be exact
+    vector<thread> threads;
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back(
+            [this, i]() {
+                Credential cred(0, 0, {}, true);
+                auto dir = fs_->root()->mkdir(
+                    cred, "dir" + to_string(i), setMode777);
+                for (int j = 0; j < 50; j++)
+                    dir->mkfifo(cred, "f" + to_string(j), setMode666);
+                for (int j = 0; j < 50; j += 2)
+                    dir->remove(cred, "f" + to_string(j));
+            });
+    }
+    for (auto& t: threads)
+        t.join();
+    EXPECT_EQ(1 + 8 * 26, fs_->fileCount());
+    auto fs = make_shared<ObjFilesystem>(fs_->database(), nullptr, clock_);
+    EXPECT_EQ(1 + 8 * 26, fs->fileCount());
+}
+
+TEST_F(ObjfsTestExtra, ReaddirCookies)
+{
+    Credential cred(0, 0, {}, true);
+    auto root = fs_->root();
+    for (int i = 0; i < 500; i++)
+        root->mkfifo(cred, "f" + to_string(i), setMode666);
+
+    // Read the directory in small pages, restarting from the cookie
+    // of the last entry each time
+    unordered_set<string> names;
+    uint64_t cookie = 0;
+    bool eof = false;
+    while (!eof) {
+        auto iter = root->readdir(cred, cookie);
+        for (int i = 0; i < 17 && iter->valid(); i++) {
+            EXPECT_TRUE(names.insert(iter->name()).second);
+            cookie = iter->seek();
+            EXPECT_GT(cookie, 2);
+            iter->next();
+        }
+        eof = !iter->valid();
+    }
+    EXPECT_EQ(502, names.size());
+}
+
+TEST_F(ObjfsTestExtra, ReaddirPrefetch)
+{
+    Credential cred(0, 0, {}, true);
+    auto root = fs_->root();
+    auto foo = root->mkfifo(cred, "foo", setMode666);
+    for (int i = 0; i < 100; i++)
+        root->mkfifo(cred, "f" + to_string(i), setMode666);
+
+    // Prefetched files have the right attributes and cached files are
+    // shared with the cache
+    auto iter = root->readdir(cred, 0);
+    iter->prefetchFiles(16);
+    int count = 0;
+    for (; iter->valid(); iter->next()) {
+        auto file = iter->file();
+        EXPECT_EQ(iter->fileid(), file->getattr()->fileid());
+        if (iter->name() == "foo")
+            EXPECT_EQ(foo, file);
+        count++;
+    }
+    EXPECT_EQ(103, count);
+}
+
+TEST_F(ObjfsTestExtra, UpgradeDirectories)
+{
+    Credential cred(0, 0, {}, true);
+    auto db = fs_->database();
+    fs_->root()->mkfifo(cred, "foo", setMode666);
+    fs_->root()->mkdir(cred, "bar", setMode777);
+
+    // Rewrite the directory keys and filesystem metadata in the
+    // version 1 format
+    auto ns = fs_->directoriesNS();
+    auto trans = db->beginTransaction();
+    for (auto iter = ns->iterator(); iter->valid(); iter->next()) {
+        DirectoryKeyType key(iter->key());
+        auto name = key.name();
+        auto oldKey = make_shared<Buffer>(sizeof(uint64_t) + name.size());
+        KeyType id(key.fileid());
+        copy_n(
+            static_cast<shared_ptr<Buffer>>(id)->data(), sizeof(uint64_t),
+            oldKey->data());
+        copy_n(name.data(), name.size(), oldKey->data() + sizeof(uint64_t));
+        trans->remove(ns, iter->key());
+        trans->put(ns, oldKey, iter->value());
+    }
+    auto buf = fs_->defaultNS()->get(KeyType(0));
+    ObjFilesystemMeta meta;
+    {
+        oncrpc::XdrMemory xm(buf->data(), buf->size());
+        xdr(meta, static_cast<oncrpc::XdrSource*>(&xm));
+    }
+    meta.vers = 1;
+    oncrpc::XdrMemory xm(512);
+    xdr(meta, static_cast<oncrpc::XdrSink*>(&xm));
+    trans->put(
+        fs_->defaultNS(), KeyType(0),
+        make_shared<Buffer>(xm.writePos(), xm.buf()));
+    db->commit(move(trans));
+
+    auto fs = make_shared<ObjFilesystem>(db, nullptr, clock_);
+    auto root = fs->root();
+    root->lookup(cred, "foo");
+    auto dir = root->lookup(cred, "bar");
+    dir->lookup(cred, "..");
+    int count = 0;
+    for (auto iter = root->readdir(cred, 0); iter->valid(); iter->next())
+        count++;
+    EXPECT_EQ(4, count);
+}
+
 int main(int argc, char **argv) {
     gflags::AllowCommandLineReparsing();
     gflags::ParseCommandLineFlags(&argc, &argv, false);
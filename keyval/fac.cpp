@@ -24,33 +24,151 @@
  * SUCH DAMAGE.
  */
 
+#include <cctype>
+#include <stdexcept>
+#include <system_error>
+
 #include <keyval/keyval.h>
 
 #include "keyval/mem/mem.h"
 #include "keyval/rocks/rocks.h"
 #include "keyval/paxos/paxos.h"
 
+#include <glog/logging.h>
 #include <rpc++/sockman.h>
 
 using namespace keyval;
 
-std::shared_ptr<Database> keyval::make_memdb()
+[[noreturn]] static void badOption(
+    const std::string& name, const std::string& value)
+{
+    LOG(ERROR) << "bad value for option " << name << ": " << value;
+    throw std::system_error(EINVAL, std::system_category());
+}
+
+std::size_t keyval::parseSizeOption(
+    const std::string& name, const std::string& value, std::size_t max)
+{
+    std::size_t pos = 0;
+    unsigned long long res = 0;
+    if (value.size() > 0 && std::isdigit(value[0])) {
+        try {
+            res = std::stoull(value, &pos);
+        }
+        catch (std::logic_error&) {
+            badOption(name, value);
+        }
+    }
+    int shift = 0;
+    if (pos > 0 && pos + 1 == value.size()) {
+        switch (value[pos]) {
+        case 'K': case 'k':
+            shift = 10;
+            break;
+        case 'M': case 'm':
+            shift = 20;
+            break;
+        case 'G': case 'g':
+            shift = 30;
+            break;
+        }
+        if (shift > 0)
+            pos++;
+    }
+    if (pos == 0 || pos != value.size() || res > (~0ull >> shift)
+        || (res << shift) > max)
+        badOption(name, value);
+    return res << shift;
+}
+
+int keyval::parseIntOption(
+    const std::string& name, const std::string& value, int min, int max)
+{
+    std::size_t pos = 0;
+    long res = 0;
+    try {
+        res = std::stol(value, &pos);
+    }
+    catch (std::logic_error&) {
+        badOption(name, value);
+    }
+    if (pos != value.size() || res < min || res > max)
+        badOption(name, value);
+    return int(res);
+}
+
+bool DatabaseOptions::parse(const std::string& name, const std::string& value)
+{
+    if (name == "cache") {
+        blockCacheSize = parseSizeOption(name, value);
+        return true;
+    }
+    if (name == "durability") {
+        if (value == "async")
+            durability = Durability::ASYNC;
+        else if (value == "flush")
+            durability = Durability::FLUSH;
+        else if (value == "commit")
+            durability = Durability::COMMIT;
+        else
+            badOption(name, value);
+        return true;
+    }
+    if (name == "window") {
+        paxosWindow = parseIntOption(name, value, 1, paxos::MAX_WINDOW);
+        return true;
+    }
+    auto dot = name.find('.');
+    if (dot == std::string::npos)
+        return false;
+    auto option = name.substr(0, dot);
+    auto nsname = name.substr(dot + 1);
+    if (option == "bloom") {
+        namespaces[nsname].bloomBitsPerKey =
+            parseIntOption(name, value, 0, 64);
+    }
+    else if (option == "prefix") {
+        namespaces[nsname].prefixLength =
+            parseIntOption(name, value, 0, 256);
+    }
+    else if (option == "compression") {
+        if (value != "none" && value != "snappy" && value != "zlib"
+            && value != "bzip2" && value != "lz4" && value != "lz4hc")
+            badOption(name, value);
+        namespaces[nsname].compression = value;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<Database> keyval::make_memdb(const MemoryOptions& options)
 {
+    if (options.shards > 0) {
+        return std::make_shared<keyval::memory::ShardedMemoryDatabase>(
+            options.shards);
+    }
     return std::make_shared<keyval::memory::MemoryDatabase>();
 }
 
-std::shared_ptr<Database> keyval::make_rocksdb(const std::string& filename)
+std::shared_ptr<Database> keyval::make_rocksdb(
+    const std::string& filename, const DatabaseOptions& options)
 {
-    return std::make_shared<keyval::rocks::RocksDatabase>(filename);
+    return std::make_shared<keyval::rocks::RocksDatabase>(filename, options);
 }
 
 std::shared_ptr<Database> keyval::make_paxosdb(
     const std::string& filename,
-    const std::vector<std::string>& replicas)
+    const std::vector<std::string>& replicas,
+    const DatabaseOptions& options)
 {
     auto clock = std::make_shared<util::SystemClock>();
-    auto db = std::make_shared<keyval::rocks::RocksDatabase>(filename);
+    auto db = std::make_shared<keyval::rocks::RocksDatabase>(
+        filename, options);
     auto sockman = std::make_shared<oncrpc::SocketManager>();
-    return std::make_shared<keyval::paxos::KVReplica>(
+    auto replica = std::make_shared<keyval::paxos::KVReplica>(
         replicas, clock, sockman, db);
+    replica->setWindow(options.paxosWindow);
+    return replica;
 }
@@ -26,8 +26,12 @@
 
 #pragma once
 
+#include <exception>
+#include <functional>
+#include <limits>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <rpc++/xdr.h>      // for Buffer
@@ -46,10 +50,33 @@ namespace keyval {
 
 using oncrpc::Buffer;
 
+class DatabaseStats;
 class Iterator;
 class Namespace;
+class Snapshot;
 class Transaction;
 
+/// A non-owning reference to a key. This allows callers to look up
+/// or write keys encoded in local storage without allocating a
+/// Buffer. The referenced bytes must remain valid for the duration
+/// of the call.
+class KeySpan
+{
+public:
+    KeySpan(const std::uint8_t* data, std::size_t size)
+        : data_(data),
+          size_(size)
+    {
+    }
+
+    const std::uint8_t* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+protected:
+    const std::uint8_t* data_;
+    std::size_t size_;
+};
+
 /// Current state of a database replica
 struct ReplicaInfo
 {
@@ -67,6 +94,75 @@ struct ReplicaInfo
     std::vector<uint8_t> appdata;
 };
 
+/// Tuning options for one namespace of a persistent database
+struct NamespaceOptions
+{
+    /// If non-zero, build a bloom filter with this many bits per key
+    /// to speed up point lookups
+    int bloomBitsPerKey = 0;
+
+    /// If non-zero, keys are grouped by a fixed length prefix of this
+    /// many bytes, allowing bloom filters to be used for iterators
+    /// which stay within a single prefix
+    int prefixLength = 0;
+
+    /// Compression algorithm - one of "none", "snappy", "zlib",
+    /// "bzip2", "lz4" or "lz4hc". If empty, the database default is
+    /// used.
+    std::string compression;
+};
+
+/// Tuning options for persistent databases
+struct DatabaseOptions
+{
+    /// Size in bytes of a block cache shared by all namespaces. If
+    /// zero, the database default is used.
+    std::size_t blockCacheSize = 0;
+
+    /// Per-namespace options, indexed by namespace name
+    std::unordered_map<std::string, NamespaceOptions> namespaces;
+
+    /// Controls when writes are synced to stable storage
+    enum class Durability {
+        /// Never explicitly sync - flush returns without waiting
+        ASYNC,
+
+        /// Commits are not synced but flush waits until all earlier
+        /// commits are on stable storage
+        FLUSH,
+
+        /// Each commit completes only when it is on stable storage
+        COMMIT,
+    };
+    Durability durability = Durability::FLUSH;
+
+    /// For replicated databases, the number of Paxos instances the
+    /// leader may have in flight at once
+    int paxosWindow = 8;
+
+    /// Set an option from a name and value, typically taken from a
+    /// URL query. Recognised names are "cache", "durability",
+    /// "window", "bloom.<ns>", "prefix.<ns>" and
+    /// "compression.<ns>". Sizes may have a K, M or G suffix and
+    /// durability is one of "async", "flush" or "commit". Returns
+    /// false if the name is not a database option and throws
+    /// std::system_error with EINVAL if the value is not valid.
+    bool parse(const std::string& name, const std::string& value);
+};
+
+/// Parse a size from an option value, e.g. a URL query. The value may
+/// have a K, M or G suffix. Throws std::system_error with EINVAL if the
+/// value is not a valid size or is larger than max. The option name is
+/// only used to log the error.
+std::size_t parseSizeOption(
+    const std::string& name, const std::string& value,
+    std::size_t max = std::numeric_limits<std::size_t>::max());
+
+/// Parse an integer from an option value, throwing std::system_error
+/// with EINVAL if it is not in the range [min, max]
+int parseIntOption(
+    const std::string& name, const std::string& value, int min, int max);
+
 /// An interface to a key-value database
 class Database
 {
@@ -83,9 +179,26 @@ public:
     /// Commit the transaction to the database
     virtual void commit(std::unique_ptr<Transaction>&& transaction) = 0;
 
+    /// Commit the transaction to the database without waiting for it
+    /// to complete. The callback is called when the transaction has
+    /// committed, with a null exception_ptr on success or the error
+    /// otherwise. The callback may be called before commitAsync
+    /// returns and for replicated databases may be called from an
+    /// internal thread so it should not block. Concurrent
+    /// transactions are not guaranteed to be applied in the order
+    /// they were submitted.
+    virtual void commitAsync(
+        std::unique_ptr<Transaction>&& transaction,
+        std::function<void(std::exception_ptr)> cb) = 0;
+
     /// Flush any commit transactions to stable storage
     virtual void flush() = 0;
 
+    /// Return a consistent point-in-time view of the database. Reads
+    /// from the snapshot are not affected by later commits. The
+    /// snapshot must not outlive the database.
+    virtual std::shared_ptr<Snapshot> snapshot() = 0;
+
     /// Return true if this database is replicated
     virtual bool isReplicated() = 0;
 
@@ -112,6 +225,11 @@ public:
     // Return the state for each replica with the state for the
     // current master listed first
     virtual std::vector<ReplicaInfo> getReplicas() = 0;
+
+    /// Return per-namespace operation counts and latencies for
+    /// databases which collect them. These are also included in the
+    /// metrics returned by get.
+    virtual std::shared_ptr<DatabaseStats> stats() { return nullptr; }
 };
 
 /// Key/value pairs are grouped by namespace
@@ -132,11 +250,127 @@ public:
     /// Get the value for a given key in this namespace
     virtual std::shared_ptr<Buffer> get(std::shared_ptr<Buffer> key) = 0;
 
+    /// Get the value for a key which is not held in a Buffer. The
+    /// default implementation copies the key.
+    virtual std::shared_ptr<Buffer> get(const KeySpan& key)
+    {
+        return get(std::make_shared<Buffer>(key.size(), key.data()));
+    }
+
+    /// Get the values for a set of keys in this namespace. The result
+    /// has one entry for each key which is nullptr if the key is not
+    /// present
+    virtual std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys) = 0;
+
     /// Return an approximate indication of the space used by this namespace
     virtual std::uint64_t spaceUsed(
         std::shared_ptr<Buffer> start, std::shared_ptr<Buffer> end) = 0;
 };
 
+/// A read-only view of a database at some point in time
+class Snapshot
+{
+public:
+    virtual ~Snapshot() {}
+
+    /// Get a pointer to the given namespace as it was when the
+    /// snapshot was taken. The namespace may only be used for reading
+    /// and must not be used in transactions.
+    virtual std::shared_ptr<Namespace> getNamespace(
+        const std::string& name) = 0;
+
+    /// Return the names of the namespaces in the snapshot, in sorted
+    /// order
+    virtual std::vector<std::string> namespaces() = 0;
+};
+
+/// A set of key/value pairs read from an iterator. The keys and
+/// values are packed into a single buffer to avoid allocating for
+/// each entry.
+class IteratorBatch
+{
+    struct Range
+    {
+        std::uint32_t keyOffset;
+        std::uint32_t keySize;
+        std::uint32_t valueOffset;
+        std::uint32_t valueSize;
+    };
+
+public:
+    /// A reference to one entry in a batch, valid while the batch
+    /// exists
+    class Entry
+    {
+    public:
+        Entry(const IteratorBatch& batch, const Range& range)
+            : batch_(batch),
+              range_(range)
+        {
+        }
+
+        const std::uint8_t* keyData() const
+        {
+            return batch_.arena_->data() + range_.keyOffset;
+        }
+        std::size_t keySize() const { return range_.keySize; }
+
+        const std::uint8_t* valueData() const
+        {
+            return batch_.arena_->data() + range_.valueOffset;
+        }
+        std::size_t valueSize() const { return range_.valueSize; }
+
+        /// Return the key as a buffer which shares storage with the
+        /// batch
+        std::shared_ptr<Buffer> key() const
+        {
+            return std::make_shared<Buffer>(
+                batch_.arena_, range_.keyOffset,
+                range_.keyOffset + range_.keySize);
+        }
+
+        /// Return the value as a buffer which shares storage with the
+        /// batch
+        std::shared_ptr<Buffer> value() const
+        {
+            return std::make_shared<Buffer>(
+                batch_.arena_, range_.valueOffset,
+                range_.valueOffset + range_.valueSize);
+        }
+
+    private:
+        const IteratorBatch& batch_;
+        Range range_;
+    };
+
+    /// Create an empty batch which can hold up to capacity bytes of
+    /// keys and values
+    IteratorBatch(std::size_t capacity);
+
+    std::size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+    std::size_t bytes() const { return used_; }
+
+    Entry operator[](std::size_t i) const
+    {
+        return Entry(*this, entries_[i]);
+    }
+
+    /// Add an entry to the batch, returning false if there is no
+    /// room. An entry larger than the capacity can be added to an
+    /// empty batch.
+    bool add(
+        const std::uint8_t* key, std::size_t keySize,
+        const std::uint8_t* value, std::size_t valueSize);
+
+private:
+    std::shared_ptr<Buffer> arena_;
+    std::size_t used_ = 0;
+    std::vector<Range> entries_;
+};
+
 /// Iterator objects are used to iterate through the key/value pairs
 /// in a namespace
 class Iterator
@@ -167,8 +401,35 @@ public:
 
     /// Return the current entry's value
     virtual std::shared_ptr<Buffer> value() const = 0;
+
+    /// Read up to maxEntries entries or maxBytes of keys and values,
+    /// starting at the current entry, and advance the iterator past
+    /// them. The result is empty when the iterator is no longer
+    /// valid.
+    virtual IteratorBatch nextBatch(
+        std::size_t maxEntries, std::size_t maxBytes);
 };
 
+/// Default batch size for scanRange and scanPrefix
+static constexpr std::size_t SCAN_BATCH_BYTES = 256*1024;
+
+/// Call cb for each entry in the namespace from startKey up to but
+/// not including endKey, reading entries in batches. If endKey is
+/// null, the scan continues to the end of the namespace. If cb
+/// returns false, the scan stops.
+void scanRange(
+    std::shared_ptr<Namespace> ns,
+    std::shared_ptr<Buffer> startKey, std::shared_ptr<Buffer> endKey,
+    std::function<bool(const IteratorBatch::Entry&)> cb,
+    std::size_t batchBytes = SCAN_BATCH_BYTES);
+
+/// Call cb for each entry in the namespace whose key starts with the
+/// given prefix
+void scanPrefix(
+    std::shared_ptr<Namespace> ns, std::shared_ptr<Buffer> prefix,
+    std::function<bool(const IteratorBatch::Entry&)> cb,
+    std::size_t batchBytes = SCAN_BATCH_BYTES);
+
 /// A set of write operations to a database which must all be executed
 /// together atomically
 class Transaction
@@ -186,23 +447,62 @@ public:
     virtual void remove(
         std::shared_ptr<Namespace> ns,
         std::shared_ptr<Buffer> key) = 0;
+
+    /// Variants of put and remove for keys which are not held in a
+    /// Buffer. The default implementations copy the key.
+    virtual void put(
+        std::shared_ptr<Namespace> ns,
+        const KeySpan& key,
+        std::shared_ptr<Buffer> val)
+    {
+        put(ns, std::make_shared<Buffer>(key.size(), key.data()), val);
+    }
+
+    virtual void remove(
+        std::shared_ptr<Namespace> ns,
+        const KeySpan& key)
+    {
+        remove(ns, std::make_shared<Buffer>(key.size(), key.data()));
+    }
+
+    /// Remove all key/value pairs in the given namespace from the
+    /// start key up to but not including the end key, including keys
+    /// written earlier in the same transaction.
+    virtual void removeRange(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey) = 0;
+};
+
+/// Options for in-memory databases
+struct MemoryOptions
+{
+    /// If non-zero, each namespace is split into this many shards
+    /// which can be read and committed concurrently. Otherwise, a
+    /// single lock serialises all access to the database.
+    int shards = 0;
 };
 
 /// Create an in-memory database - typically used for unit tests
-std::shared_ptr<Database> make_memdb();
+std::shared_ptr<Database> make_memdb(
+    const MemoryOptions& options = MemoryOptions());
 
 /// Create a database backed by RocksDB
-std::shared_ptr<Database> make_rocksdb(const std::string& filename);
+std::shared_ptr<Database> make_rocksdb(
+    const std::string& filename,
+    const DatabaseOptions& options = DatabaseOptions());
 
 /// Create a Paxos replicated database
 ///
 /// - filename is the path to the underlying RocksDB
+/// - options are used to tune the underlying RocksDB
 /// - addr is a URL to bind to for replica updates
 /// - replicas is a set of target URLs for replica updates
 /// - sockman is used to register sockets and timeouts
 ///
 std::shared_ptr<Database> make_paxosdb(
     const std::string& filename,
-    const std::vector<std::string>& replicas);
+    const std::vector<std::string>& replicas,
+    const DatabaseOptions& options = DatabaseOptions());
 
 }
@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+// -*- c++ -*-
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace keyval {
+
+/// A histogram of operation latencies using power of two buckets. It
+/// can be updated concurrently without locking.
+class LatencyHistogram
+{
+public:
+    /// Bucket i counts latencies less than 2^i nanoseconds
+    static constexpr int BUCKETS = 40;
+
+    void add(std::chrono::nanoseconds d)
+    {
+        auto ns = std::uint64_t(d.count() > 0 ? d.count() : 0);
+        int i = ns ? 64 - __builtin_clzll(ns) : 0;
+        if (i >= BUCKETS)
+            i = BUCKETS - 1;
+        buckets_[i].fetch_add(1, std::memory_order_relaxed);
+        auto max = max_.load(std::memory_order_relaxed);
+        while (ns > max && !max_.compare_exchange_weak(
+                   max, ns, std::memory_order_relaxed))
+            ;
+    }
+
+    /// Return an estimate of the latency at the given percentile,
+    /// which is the upper bound of the bucket containing it
+    std::chrono::nanoseconds percentile(double p) const
+    {
+        std::uint64_t total = 0;
+        for (auto& b: buckets_)
+            total += b.load(std::memory_order_relaxed);
+        if (total == 0)
+            return std::chrono::nanoseconds(0);
+        auto target = std::uint64_t(p * total);
+        std::uint64_t n = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            n += buckets_[i].load(std::memory_order_relaxed);
+            if (n > target)
+                return std::chrono::nanoseconds(
+                    std::min(std::uint64_t(1) << i, max()));
+        }
+        return std::chrono::nanoseconds(max());
+    }
+
+    std::uint64_t max() const
+    {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, BUCKETS> buckets_{};
+    std::atomic<std::uint64_t> max_{0};
+};
+
+/// Operation count, byte count and latency for one kind of operation
+class OpStats
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    /// Record a single operation
+    void add(clock::duration d, std::size_t bytes = 0)
+    {
+        ops_.fetch_add(1, std::memory_order_relaxed);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        latency_.add(d);
+    }
+
+    /// Record operations without timing them
+    void count(std::uint64_t ops, std::size_t bytes)
+    {
+        ops_.fetch_add(ops, std::memory_order_relaxed);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /// Add fields for this operation to a REST object encoder.
+    /// Latencies are in nanoseconds.
+    template <typename ENC>
+    void report(ENC& obj) const
+    {
+        obj->field("ops")->number(long(ops_.load()));
+        obj->field("bytes")->number(long(bytes_.load()));
+        obj->field("p50")->number(long(latency_.percentile(0.5).count()));
+        obj->field("p99")->number(long(latency_.percentile(0.99).count()));
+        obj->field("max")->number(long(latency_.max()));
+    }
+
+private:
+    std::atomic<std::uint64_t> ops_{0};
+    std::atomic<std::uint64_t> bytes_{0};
+    LatencyHistogram latency_;
+};
+
+/// Times an operation from construction to destruction, so that
+/// operations which throw, e.g. a get for a missing key, are counted
+class OpTimer
+{
+public:
+    OpTimer(OpStats& stats)
+        : stats_(stats),
+          start_(OpStats::clock::now())
+    {
+    }
+
+    ~OpTimer()
+    {
+        stats_.add(OpStats::clock::now() - start_, bytes_);
+    }
+
+    void setBytes(std::size_t bytes) { bytes_ = bytes; }
+
+private:
+    OpStats& stats_;
+    OpStats::clock::time_point start_;
+    std::size_t bytes_ = 0;
+};
+
+/// Operation statistics for a namespace
+struct NamespaceStats
+{
+    OpStats get;        ///< point lookups, bytes of values read
+    OpStats seek;       ///< iterator seeks
+    OpStats next;       ///< iterator steps, bytes of keys and values read
+    OpStats write;      ///< puts and removes, bytes of keys and values
+
+    template <typename ENC>
+    void report(ENC& obj) const
+    {
+        reportOp(obj, "get", get);
+        reportOp(obj, "seek", seek);
+        reportOp(obj, "next", next);
+        reportOp(obj, "write", write);
+    }
+
+    template <typename ENC>
+    static void reportOp(ENC& obj, const char* name, const OpStats& op)
+    {
+        auto child = obj->field(name)->object();
+        op.report(child);
+    }
+};
+
+/// Operation statistics for a database and its namespaces
+class DatabaseStats
+{
+public:
+    OpStats commit;     ///< local commits
+    OpStats sync;       ///< write-ahead log syncs
+    OpStats replicate;  ///< commits replicated by consensus
+
+    /// Return the statistics for a namespace, creating them if
+    /// necessary
+    std::shared_ptr<NamespaceStats> getNamespace(const std::string& name)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        auto& p = namespaces_[name];
+        if (!p)
+            p = std::make_shared<NamespaceStats>();
+        return p;
+    }
+
+    /// Add fields for the database and each namespace to a REST
+    /// object encoder
+    template <typename ENC>
+    void report(ENC& obj)
+    {
+        NamespaceStats::reportOp(obj, "commit", commit);
+        NamespaceStats::reportOp(obj, "sync", sync);
+        NamespaceStats::reportOp(obj, "replicate", replicate);
+        auto namespaces = obj->field("namespaces")->object();
+        std::unique_lock<std::mutex> lk(mutex_);
+        for (auto& entry: namespaces_) {
+            auto ns = namespaces->field(entry.first.c_str())->object();
+            entry.second->report(ns);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<NamespaceStats>> namespaces_;
+};
+
+}
@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <limits>
+
+#include <keyval/keyval.h>
+
+using namespace keyval;
+using namespace std;
+
+IteratorBatch::IteratorBatch(size_t capacity)
+    : arena_(make_shared<Buffer>(capacity))
+{
+}
+
+bool IteratorBatch::add(
+    const uint8_t* key, size_t keySize,
+    const uint8_t* value, size_t valueSize)
+{
+    auto sz = keySize + valueSize;
+    if (used_ + sz > arena_->size()) {
+        if (entries_.size() > 0)
+            return false;
+        arena_ = make_shared<Buffer>(sz);
+    }
+    Range r;
+    r.keyOffset = used_;
+    r.keySize = keySize;
+    copy_n(key, keySize, arena_->data() + used_);
+    used_ += keySize;
+    r.valueOffset = used_;
+    r.valueSize = valueSize;
+    copy_n(value, valueSize, arena_->data() + used_);
+    used_ += valueSize;
+    entries_.push_back(r);
+    return true;
+}
+
+IteratorBatch Iterator::nextBatch(size_t maxEntries, size_t maxBytes)
+{
+    IteratorBatch batch(maxBytes);
+    while (batch.size() < maxEntries && valid()) {
+        auto k = key();
+        auto v = value();
+        if (!batch.add(k->data(), k->size(), v->data(), v->size()))
+            break;
+        next();
+    }
+    return batch;
+}
+
+void keyval::scanRange(
+    shared_ptr<Namespace> ns,
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey,
+    function<bool(const IteratorBatch::Entry&)> cb,
+    size_t batchBytes)
+{
+    auto iterator = ns->iterator(startKey, endKey);
+    for (;;) {
+        auto batch = iterator->nextBatch(
+            numeric_limits<size_t>::max(), batchBytes);
+        if (batch.empty())
+            break;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (!cb(batch[i]))
+                return;
+        }
+    }
+}
+
+void keyval::scanPrefix(
+    shared_ptr<Namespace> ns, shared_ptr<Buffer> prefix,
+    function<bool(const IteratorBatch::Entry&)> cb,
+    size_t batchBytes)
+{
+    // The end of the range is the smallest key greater than every key
+    // with the prefix. If the prefix is all 0xff, there is no such
+    // key and we scan to the end of the namespace.
+    shared_ptr<Buffer> endKey;
+    auto n = prefix->size();
+    while (n > 0 && prefix->data()[n - 1] == 0xff)
+        n--;
+    if (n > 0) {
+        endKey = make_shared<Buffer>(n, prefix->data());
+        endKey->data()[n - 1]++;
+    }
+    scanRange(ns, prefix, endKey, cb, batchBytes);
+}
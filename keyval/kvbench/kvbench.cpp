@@ -0,0 +1,616 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <system_error>
+#include <thread>
+
+#include <keyval/keyval.h>
+#include <rpc++/socket.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "keyval/paxos/paxos.h"
+
+using namespace keyval;
+using namespace keyval::paxos;
+
+DEFINE_string(backend, "mem",
+              "Database backend: mem, sharded, rocks or paxos");
+DEFINE_string(path, "",
+              "Database directory for the rocks backend or for paxos "
+              "replicas (in-memory replicas are used if empty)");
+DEFINE_string(options, "",
+              "Comma-separated database options, e.g. cache=64M,bloom.data=10");
+DEFINE_string(workloads, "get,scan,smalltxn,largetxn,mixed",
+              "Comma-separated list of workloads to run");
+DEFINE_int32(threads, 1, "Number of client threads");
+DEFINE_int32(seconds, 10, "Duration of each workload in seconds");
+DEFINE_int32(files, 10000, "Number of files in the initial data set");
+DEFINE_int32(blocks, 4, "Number of data blocks for each file");
+DEFINE_int32(block_size, 4096,
+             "Size of each data block (the paxos backend needs 1024 or "
+             "less)");
+DEFINE_int32(meta_size, 128, "Size of each file metadata value");
+DEFINE_int32(scan_length, 100, "Number of entries read by each scan");
+DEFINE_int32(small_txn_ops, 4, "Number of writes in a small transaction");
+DEFINE_int32(large_txn_blocks, 64,
+             "Number of data blocks written by a large transaction");
+DEFINE_int32(read_percent, 90,
+             "Percentage of reads in the mixed workload");
+DEFINE_int32(shards, 16, "Number of shards for the sharded backend");
+DEFINE_int32(replicas, 3, "Number of replicas for the paxos backend");
+
+namespace {
+
+/// Keys are shaped like objfs keys - file metadata is indexed by a
+/// 64bit fileid, directory entries by directory fileid, name hash and
+/// name and data blocks by fileid and byte offset. All integers are
+/// big endian.
+void encode64(std::uint8_t* p, std::uint64_t n)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = (n >> 56) & 0xff;
+        n <<= 8;
+    }
+}
+
+std::array<std::uint8_t, 8> metaKey(std::uint64_t fileid)
+{
+    std::array<std::uint8_t, 8> key;
+    encode64(key.data(), fileid);
+    return key;
+}
+
+std::array<std::uint8_t, 16> dataKey(std::uint64_t fileid, std::uint64_t off)
+{
+    std::array<std::uint8_t, 16> key;
+    encode64(key.data(), fileid);
+    encode64(key.data() + 8, off);
+    return key;
+}
+
+std::shared_ptr<Buffer> directoryKey(std::uint64_t dir, const std::string& name)
+{
+    std::uint32_t h = 2166136261u;
+    for (auto c: name) {
+        h ^= std::uint8_t(c);
+        h *= 16777619u;
+    }
+    auto key = std::make_shared<Buffer>(12 + name.size());
+    encode64(key->data(), dir);
+    for (int i = 0; i < 4; i++)
+        key->data()[8 + i] = (h >> (24 - 8*i)) & 0xff;
+    std::copy_n(name.data(), name.size(), key->data() + 12);
+    return key;
+}
+
+template <std::size_t N>
+KeySpan span(const std::array<std::uint8_t, N>& key)
+{
+    return KeySpan(key.data(), key.size());
+}
+
+template <std::size_t N>
+std::shared_ptr<Buffer> buffer(const std::array<std::uint8_t, N>& key)
+{
+    return std::make_shared<Buffer>(key.size(), key.data());
+}
+
+std::shared_ptr<Buffer> makeValue(std::size_t size)
+{
+    auto val = std::make_shared<Buffer>(size);
+    for (std::size_t i = 0; i < size; i++)
+        val->data()[i] = std::uint8_t(i);
+    return val;
+}
+
+std::vector<std::string> split(const std::string& s, char sep)
+{
+    std::vector<std::string> res;
+    std::istringstream ss(s);
+    std::string word;
+    while (std::getline(ss, word, sep)) {
+        if (word.size() > 0)
+            res.push_back(word);
+    }
+    return res;
+}
+
+/// An implementation of IPaxos1 which delivers each message to a set
+/// of in-process replicas. Messages are delivered asynchronously
+/// using the timeout manager, much as they would be by a network
+/// transport.
+class LocalTransport: public IPaxos1
+{
+public:
+    LocalTransport(
+        std::shared_ptr<util::Clock> clock,
+        std::shared_ptr<oncrpc::TimeoutManager> tman)
+        : clock_(clock),
+          tman_(tman)
+    {
+    }
+
+    // IPaxos1 overrides
+    void null() override
+    {
+    }
+    void identity(const IDENTITYargs& args) override
+    {
+        send([args](auto replica) { replica->identity(args); });
+    }
+    void prepare(const PREPAREargs& args) override
+    {
+        send([args](auto replica) { replica->prepare(args); });
+    }
+    void promise(const PROMISEargs& args) override
+    {
+        send([args](auto replica) { replica->promise(args); });
+    }
+    void accept(const ACCEPTargs& args) override
+    {
+        send([args](auto replica) { replica->accept(args); });
+    }
+    void accepted(const ACCEPTargs& args) override
+    {
+        send([args](auto replica) { replica->accepted(args); });
+    }
+    void nack(const NACKargs& args) override
+    {
+        send([args](auto replica) { replica->nack(args); });
+    }
+    void truncated(const TRUNCATEDargs& args) override
+    {
+        send([args](auto replica) { replica->truncated(args); });
+    }
+    void fetch(const FETCHargs& args) override
+    {
+        send([args](auto replica) { replica->fetch(args); });
+    }
+    void chunk(const CHUNKargs& args) override
+    {
+        send([args](auto replica) { replica->chunk(args); });
+    }
+    void catchup(const CATCHUPargs& args) override
+    {
+        send([args](auto replica) { replica->catchup(args); });
+    }
+    void chosen(const CHOSENargs& args) override
+    {
+        send([args](auto replica) { replica->chosen(args); });
+    }
+
+    void add(std::weak_ptr<IPaxos1> replica)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        replicas_.push_back(replica);
+    }
+
+private:
+    void send(std::function<void(std::shared_ptr<IPaxos1>)> msg)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        auto now = clock_->now();
+        for (auto& replica: replicas_) {
+            tman_->add(
+                now, [replica, msg]() {
+                    auto p = replica.lock();
+                    if (p)
+                        msg(p);
+                });
+        }
+    }
+
+    std::shared_ptr<util::Clock> clock_;
+    std::shared_ptr<oncrpc::TimeoutManager> tman_;
+    std::mutex mutex_;
+    std::vector<std::weak_ptr<IPaxos1>> replicas_;
+};
+
+/// A set of in-process paxos replicas sharing a socket manager thread
+class LocalCluster
+{
+public:
+    LocalCluster(int count, const DatabaseOptions& options)
+        : clock_(std::make_shared<util::SystemClock>()),
+          sockman_(std::make_shared<oncrpc::SocketManager>()),
+          transport_(std::make_shared<LocalTransport>(clock_, sockman_))
+    {
+        for (int i = 0; i < count; i++) {
+            std::shared_ptr<Database> db;
+            if (FLAGS_path.size() > 0) {
+                db = make_rocksdb(
+                    FLAGS_path + "/replica" + std::to_string(i), options);
+            }
+            else {
+                db = make_memdb();
+            }
+            auto replica = std::make_shared<KVReplica>(
+                transport_, clock_, sockman_, db);
+            replica->setWindow(options.paxosWindow);
+            transport_->add(replica);
+            replicas_.push_back(replica);
+        }
+        thread_ = std::thread([this]() { sockman_->run(); });
+    }
+
+    ~LocalCluster()
+    {
+        sockman_->stop();
+        thread_.join();
+        replicas_.clear();
+    }
+
+    /// Wait for the replicas to elect a leader and return it
+    std::shared_ptr<Database> leader()
+    {
+        using namespace std::chrono;
+        auto deadline = steady_clock::now() + seconds(30);
+        while (steady_clock::now() < deadline) {
+            for (auto& replica: replicas_) {
+                if (replica->isMaster())
+                    return replica;
+            }
+            std::this_thread::sleep_for(milliseconds(100));
+        }
+        throw std::system_error(ETIMEDOUT, std::system_category());
+    }
+
+private:
+    std::shared_ptr<util::Clock> clock_;
+    std::shared_ptr<oncrpc::SocketManager> sockman_;
+    std::shared_ptr<LocalTransport> transport_;
+    std::vector<std::shared_ptr<KVReplica>> replicas_;
+    std::thread thread_;
+};
+
+class Bench
+{
+public:
+    /// If maxTransactionSize is non-zero, transactions are split so
+    /// that none is larger than that when encoded
+    Bench(std::shared_ptr<Database> db, std::size_t maxTransactionSize = 0)
+        : db_(db),
+          maxTransactionSize_(maxTransactionSize),
+          defaultNS_(db->getNamespace("default")),
+          directoriesNS_(db->getNamespace("directories")),
+          dataNS_(db->getNamespace("data")),
+          metaValue_(makeValue(FLAGS_meta_size)),
+          entryValue_(makeValue(16)),
+          blockValue_(makeValue(FLAGS_block_size))
+    {
+    }
+
+    /// Populate the database with a set of files in a single
+    /// directory
+    void load()
+    {
+        auto start = std::chrono::steady_clock::now();
+        constexpr int FILES_PER_TRANSACTION = 100;
+        for (int i = 0; i < FLAGS_files; i += FILES_PER_TRANSACTION) {
+            auto trans = db_->beginTransaction();
+            std::size_t size = 0;
+            auto n = std::min(i + FILES_PER_TRANSACTION, FLAGS_files);
+            for (int j = i; j < n; j++) {
+                std::uint64_t fileid = j + 2;
+                put(trans, size, defaultNS_, buffer(metaKey(fileid)),
+                    metaValue_);
+                put(trans, size, directoriesNS_,
+                    directoryKey(1, "f" + std::to_string(j)), entryValue_);
+                for (int k = 0; k < FLAGS_blocks; k++) {
+                    auto off = std::uint64_t(k) * FLAGS_block_size;
+                    put(trans, size, dataNS_, buffer(dataKey(fileid, off)),
+                        blockValue_);
+                }
+            }
+            db_->commit(std::move(trans));
+        }
+        db_->flush();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << "loaded " << FLAGS_files << " files in "
+                  << std::fixed << std::setprecision(2) << elapsed.count()
+                  << "s" << std::endl;
+    }
+
+    /// Run a workload on FLAGS_threads threads for FLAGS_seconds and
+    /// report throughput and latency percentiles
+    void run(const std::string& workload)
+    {
+        std::function<void(std::mt19937_64&)> op;
+        if (workload == "get")
+            op = [this](auto& rng) { get(rng); };
+        else if (workload == "scan")
+            op = [this](auto& rng) { scan(rng); };
+        else if (workload == "smalltxn")
+            op = [this](auto& rng) {
+                smallTransaction(rng, FLAGS_small_txn_ops);
+            };
+        else if (workload == "largetxn")
+            op = [this](auto& rng) { largeTransaction(rng); };
+        else if (workload == "mixed")
+            op = [this](auto& rng) { mixed(rng); };
+        else {
+            std::cerr << workload << ": unknown workload" << std::endl;
+            return;
+        }
+
+        std::vector<std::vector<std::uint64_t>> latencies(FLAGS_threads);
+        std::vector<int> errors(FLAGS_threads);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::seconds(FLAGS_seconds);
+        for (int i = 0; i < FLAGS_threads; i++) {
+            threads.emplace_back(
+                [&, i]() {
+                    std::mt19937_64 rng(i);
+                    auto& lat = latencies[i];
+                    for (;;) {
+                        auto t0 = std::chrono::steady_clock::now();
+                        if (t0 >= deadline)
+                            break;
+                        try {
+                            op(rng);
+                        }
+                        catch (std::system_error&) {
+                            errors[i]++;
+                            continue;
+                        }
+                        auto t1 = std::chrono::steady_clock::now();
+                        lat.push_back(
+                            std::chrono::duration_cast<
+                                std::chrono::nanoseconds>(t1 - t0).count());
+                    }
+                });
+        }
+        for (auto& t: threads)
+            t.join();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::vector<std::uint64_t> all;
+        for (auto& lat: latencies)
+            all.insert(all.end(), lat.begin(), lat.end());
+        std::sort(all.begin(), all.end());
+        int errorCount = 0;
+        for (auto n: errors)
+            errorCount += n;
+
+        auto percentile = [&all](double p) {
+            if (all.size() == 0)
+                return 0.0;
+            auto i = std::min(all.size() - 1, std::size_t(p * all.size()));
+            return all[i] / 1000.0;
+        };
+        std::cout << std::left << std::setw(10) << workload << std::right
+                  << std::fixed << std::setprecision(0)
+                  << std::setw(10) << all.size()
+                  << std::setw(12) << all.size() / elapsed.count()
+                  << std::setprecision(1)
+                  << std::setw(10) << percentile(0.5)
+                  << std::setw(10) << percentile(0.9)
+                  << std::setw(10) << percentile(0.99)
+                  << std::setw(10) << percentile(0.999)
+                  << std::setw(10) << percentile(1.0)
+                  << std::setw(8) << errorCount << std::endl;
+    }
+
+    /// An upper bound for the encoded size of a put in a paxos
+    /// transaction: the operation type, a namespace name of up to 12
+    /// bytes and the padded key and value with their lengths
+    static std::size_t putSize(std::size_t keySize, std::size_t valSize)
+    {
+        auto pad = [](std::size_t n) { return (n + 3) & ~3; };
+        return 4 + 16 + 4 + pad(keySize) + 4 + pad(valSize);
+    }
+
+    static void header()
+    {
+        std::cout << std::left << std::setw(10) << "workload" << std::right
+                  << std::setw(10) << "ops"
+                  << std::setw(12) << "ops/s"
+                  << std::setw(10) << "p50us"
+                  << std::setw(10) << "p90us"
+                  << std::setw(10) << "p99us"
+                  << std::setw(10) << "p99.9us"
+                  << std::setw(10) << "maxus"
+                  << std::setw(8) << "errors" << std::endl;
+    }
+
+private:
+    std::uint64_t randomFile(std::mt19937_64& rng)
+    {
+        std::uniform_int_distribution<std::uint64_t> dist(2, FLAGS_files + 1);
+        return dist(rng);
+    }
+
+    /// Point lookup of a file's metadata
+    void get(std::mt19937_64& rng)
+    {
+        auto key = metaKey(randomFile(rng));
+        defaultNS_->get(span(key));
+    }
+
+    /// Read a range of data blocks starting at some file
+    void scan(std::mt19937_64& rng)
+    {
+        auto iterator = dataNS_->iterator(
+            buffer(dataKey(randomFile(rng), 0)), nullptr);
+        iterator->nextBatch(
+            FLAGS_scan_length,
+            FLAGS_scan_length * (FLAGS_block_size + 16));
+    }
+
+    /// Update the metadata for a few files, e.g. setattr or create
+    void smallTransaction(std::mt19937_64& rng, int ops)
+    {
+        auto trans = db_->beginTransaction();
+        for (int i = 0; i < ops; i++) {
+            auto key = metaKey(randomFile(rng));
+            trans->put(defaultNS_, span(key), metaValue_);
+        }
+        db_->commit(std::move(trans));
+    }
+
+    /// Write a run of data blocks and update metadata, e.g. flushing a
+    /// large write. If the backend limits transaction size, this is
+    /// split into as many transactions as needed.
+    void largeTransaction(std::mt19937_64& rng)
+    {
+        auto fileid = randomFile(rng);
+        auto trans = db_->beginTransaction();
+        std::size_t size = 0;
+        for (int i = 0; i < FLAGS_large_txn_blocks; i++) {
+            auto key = dataKey(fileid, std::uint64_t(i) * FLAGS_block_size);
+            put(trans, size, dataNS_, buffer(key), blockValue_);
+        }
+        put(trans, size, defaultNS_, buffer(metaKey(fileid)), metaValue_);
+        db_->commit(std::move(trans));
+    }
+
+    /// Add a put to trans, first committing trans and starting a new
+    /// one if the put would take it over maxTransactionSize_. The
+    /// current encoded size of trans is tracked in size.
+    void put(
+        std::unique_ptr<Transaction>& trans, std::size_t& size,
+        std::shared_ptr<Namespace> ns, std::shared_ptr<Buffer> key,
+        std::shared_ptr<Buffer> val)
+    {
+        if (maxTransactionSize_ > 0) {
+            // Allow four bytes for the operation count
+            auto bytes = putSize(key->size(), val->size());
+            if (size > 0 && 4 + size + bytes > maxTransactionSize_) {
+                db_->commit(std::move(trans));
+                trans = db_->beginTransaction();
+                size = 0;
+            }
+            size += bytes;
+        }
+        trans->put(ns, key, val);
+    }
+
+    void mixed(std::mt19937_64& rng)
+    {
+        std::uniform_int_distribution<int> dist(0, 99);
+        if (dist(rng) < FLAGS_read_percent)
+            get(rng);
+        else
+            smallTransaction(rng, 1);
+    }
+
+    std::shared_ptr<Database> db_;
+    std::size_t maxTransactionSize_;
+    std::shared_ptr<Namespace> defaultNS_;
+    std::shared_ptr<Namespace> directoriesNS_;
+    std::shared_ptr<Namespace> dataNS_;
+    std::shared_ptr<Buffer> metaValue_;
+    std::shared_ptr<Buffer> entryValue_;
+    std::shared_ptr<Buffer> blockValue_;
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    gflags::SetUsageMessage("usage: kvbench [options]");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc != 1) {
+        gflags::ShowUsageWithFlagsRestrict(argv[0], "kvbench.cpp");
+        return 1;
+    }
+
+    google::InitGoogleLogging(argv[0]);
+
+    DatabaseOptions options;
+    for (auto& opt: split(FLAGS_options, ',')) {
+        auto i = opt.find('=');
+        try {
+            if (i == std::string::npos
+                || !options.parse(opt.substr(0, i), opt.substr(i + 1))) {
+                std::cerr << opt << ": unrecognised database option"
+                          << std::endl;
+                return 1;
+            }
+        }
+        catch (std::system_error&) {
+            std::cerr << opt << ": bad database option value" << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<LocalCluster> cluster;
+    std::shared_ptr<Database> db;
+    std::size_t maxTransactionSize = 0;
+    if (FLAGS_backend == "mem") {
+        db = make_memdb();
+    }
+    else if (FLAGS_backend == "sharded") {
+        MemoryOptions memopts;
+        memopts.shards = FLAGS_shards;
+        db = make_memdb(memopts);
+    }
+    else if (FLAGS_backend == "rocks") {
+        if (FLAGS_path.size() == 0) {
+            std::cerr << "the rocks backend needs a database path" << std::endl;
+            return 1;
+        }
+        db = make_rocksdb(FLAGS_path, options);
+    }
+    else if (FLAGS_backend == "paxos") {
+        // Each paxos transaction must fit in a single command
+        maxTransactionSize = MAX_COMMAND_SIZE;
+        auto largest = std::max<std::size_t>(
+            {Bench::putSize(8, FLAGS_meta_size),
+             Bench::putSize(16, FLAGS_block_size)});
+        if (4 + largest > maxTransactionSize) {
+            std::cerr << "the paxos backend limits transactions to "
+                      << maxTransactionSize << " bytes, use smaller "
+                      << "--block_size and --meta_size values" << std::endl;
+            return 1;
+        }
+        cluster = std::make_unique<LocalCluster>(FLAGS_replicas, options);
+        db = cluster->leader();
+    }
+    else {
+        std::cerr << FLAGS_backend << ": unknown backend" << std::endl;
+        return 1;
+    }
+
+    Bench bench(db, maxTransactionSize);
+    bench.load();
+    Bench::header();
+    for (auto& workload: split(FLAGS_workloads, ','))
+        bench.run(workload);
+}
@@ -27,6 +27,8 @@
 #include <cstring>
 #include <system_error>
 
+#include <rpc++/rest.h>
+
 #include "mem.h"
 
 using namespace keyval;
@@ -46,7 +48,8 @@ shared_ptr<Namespace> MemoryDatabase::getNamespace(const string& name)
     if (it != namespaces_.end())
         return it->second;
 
-    auto ns = make_shared<MemoryNamespace>(mutex_);
+    auto ns = make_shared<MemoryNamespace>(
+        mutex_, stats_->getNamespace(name));
     namespaces_[name] = ns;
 
     return ns;
@@ -59,12 +62,66 @@ unique_ptr<Transaction> MemoryDatabase::beginTransaction()
 
 void MemoryDatabase::commit(unique_ptr<Transaction>&& transaction)
 {
+    OpTimer timer(stats_->commit);
     unique_lock<mutex> lock(mutex_);
     auto t = reinterpret_cast<MemoryTransaction*>(transaction.get());
     t->commit();
     transaction.reset();
 }
 
+void MemoryDatabase::commitAsync(
+    unique_ptr<Transaction>&& transaction,
+    function<void(exception_ptr)> cb)
+{
+    // Memory commits never block so we just complete the transaction
+    // immediately
+    try {
+        commit(move(transaction));
+    }
+    catch (...) {
+        cb(current_exception());
+        return;
+    }
+    cb(nullptr);
+}
+
+shared_ptr<Snapshot> MemoryDatabase::snapshot()
+{
+    unique_lock<mutex> lock(mutex_);
+    map<string, shared_ptr<namespaceT>> maps;
+    for (auto& entry: namespaces_)
+        maps[entry.first] = entry.second->share();
+    return make_shared<MemorySnapshot>(move(maps), stats_);
+}
+
+bool MemoryDatabase::get(
+    shared_ptr<oncrpc::RestRequest> req,
+    unique_ptr<oncrpc::RestEncoder>&& res)
+{
+    auto obj = res->object();
+    stats_->report(obj);
+    return true;
+}
+
+shared_ptr<Namespace> MemorySnapshot::getNamespace(const string& name)
+{
+    unique_lock<mutex> lock(mutex_);
+    auto& map = maps_[name];
+    if (!map)
+        map = make_shared<namespaceT>();
+    return make_shared<MemoryNamespace>(
+        mutex_, map, shared_from_this(), stats_->getNamespace(name));
+}
+
+vector<string> MemorySnapshot::namespaces()
+{
+    unique_lock<mutex> lock(mutex_);
+    vector<string> res;
+    for (auto& entry: maps_)
+        res.push_back(entry.first);
+    return res;
+}
+
 unique_ptr<Iterator> MemoryNamespace::iterator()
 {
     return make_unique<MemoryIterator>(*this);
@@ -78,13 +135,42 @@ unique_ptr<Iterator> MemoryNamespace::iterator(
 
 shared_ptr<Buffer> MemoryNamespace::get(shared_ptr<Buffer> key)
 {
+    return get(KeySpan(key->data(), key->size()));
+}
+
+shared_ptr<Buffer> MemoryNamespace::get(const KeySpan& key)
+{
+    OpTimer timer(stats_->get);
     auto lk = lock();
-    auto it = map_.find(key);
-    if (it == map_.end())
+    auto it = map_->find(key);
+    if (it == map_->end())
         throw system_error(ENOENT, system_category());
+    timer.setBytes(it->second->size());
     return it->second;
 }
 
+vector<shared_ptr<Buffer>> MemoryNamespace::multiGet(
+    const vector<shared_ptr<Buffer>>& keys)
+{
+    OpTimer timer(stats_->get);
+    vector<shared_ptr<Buffer>> res;
+    res.reserve(keys.size());
+    size_t bytes = 0;
+    auto lk = lock();
+    for (auto& key: keys) {
+        auto it = map_->find(key);
+        if (it != map_->end()) {
+            bytes += it->second->size();
+            res.push_back(it->second);
+        }
+        else {
+            res.push_back(nullptr);
+        }
+    }
+    timer.setBytes(bytes);
+    return res;
+}
+
 uint64_t MemoryNamespace::spaceUsed(
     shared_ptr<Buffer> start, shared_ptr<Buffer> end)
 {
@@ -93,18 +179,30 @@ uint64_t MemoryNamespace::spaceUsed(
 
 void MemoryNamespace::put(shared_ptr<Buffer> key, shared_ptr<Buffer> value)
 {
+    stats_->write.count(1, key->size() + value->size());
     gen_++;
-    map_[key] = value;
+    mutableMap()[key] = value;
 }
 
 void MemoryNamespace::remove(shared_ptr<Buffer> key)
 {
+    stats_->write.count(1, key->size());
+    gen_++;
+    mutableMap().erase(key);
+}
+
+void MemoryNamespace::removeRange(
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey)
+{
+    stats_->write.count(1, startKey->size() + endKey->size());
     gen_++;
-    map_.erase(key);
+    auto& map = mutableMap();
+    map.erase(map.lower_bound(startKey), map.lower_bound(endKey));
 }
 
 void MemoryIterator::seek(shared_ptr<Buffer> key)
 {
+    OpTimer timer(ns_.stats().seek);
     auto lk = ns_.lock();
     gen_ = ns_.gen();
     it_ = ns_.map().lower_bound(key);
@@ -113,6 +211,7 @@ void MemoryIterator::seek(shared_ptr<Buffer> key)
 
 void MemoryIterator::seekToFirst()
 {
+    OpTimer timer(ns_.stats().seek);
     auto lk = ns_.lock();
     gen_ = ns_.gen();
     it_ = ns_.map().begin();
@@ -130,6 +229,7 @@ void MemoryIterator::seekToLast()
 
 void MemoryIterator::next()
 {
+    OpTimer timer(ns_.stats().next);
     auto lk = ns_.lock();
     if (gen_ != ns_.gen()) {
         gen_ = ns_.gen();
@@ -137,10 +237,13 @@ void MemoryIterator::next()
     }
     ++it_;
     read();
+    if (valid_)
+        timer.setBytes(key_->size() + value_->size());
 }
 
 void MemoryIterator::prev()
 {
+    OpTimer timer(ns_.stats().next);
     auto lk = ns_.lock();
     if (gen_ != ns_.gen()) {
         gen_ = ns_.gen();
@@ -148,6 +251,8 @@ void MemoryIterator::prev()
     }
     --it_;
     read();
+    if (valid_)
+        timer.setBytes(key_->size() + value_->size());
 }
 
 bool MemoryIterator::valid() const
@@ -171,6 +276,34 @@ shared_ptr<Buffer> MemoryIterator::value() const
     return value_;
 }
 
+IteratorBatch MemoryIterator::nextBatch(size_t maxEntries, size_t maxBytes)
+{
+    // Hold the lock for the whole batch rather than once per entry
+    IteratorBatch batch(maxBytes);
+    if (!valid_)
+        return batch;
+    OpTimer timer(ns_.stats().next);
+    auto lk = ns_.lock();
+    if (gen_ != ns_.gen()) {
+        gen_ = ns_.gen();
+        it_ = ns_.map().lower_bound(key_);
+    }
+    namespaceT::key_compare comp;
+    auto end = ns_.map().end();
+    while (batch.size() < maxEntries && it_ != end) {
+        auto& k = it_->first;
+        auto& v = it_->second;
+        if (endKey_ && !comp(k, endKey_))
+            break;
+        if (!batch.add(k->data(), k->size(), v->data(), v->size()))
+            break;
+        ++it_;
+    }
+    read();
+    timer.setBytes(batch.bytes());
+    return batch;
+}
+
 void MemoryTransaction::put(
     shared_ptr<Namespace> ns, shared_ptr<Buffer> key, shared_ptr<Buffer> val)
 {
@@ -191,6 +324,17 @@ void MemoryTransaction::remove(
         });
 }
 
+void MemoryTransaction::removeRange(
+    shared_ptr<Namespace> ns,
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey)
+{
+    auto mns = dynamic_pointer_cast<MemoryNamespace>(ns);
+    ops_.emplace_back(
+        [=]() {
+            mns->removeRange(startKey, endKey);
+        });
+}
+
 void MemoryTransaction::commit()
 {
     for (auto& op: ops_)
@@ -27,10 +27,13 @@
 // -*- c++ -*-
 #pragma once
 
+#include <atomic>
 #include <cstring>
 #include <map>
 #include <mutex>
+#include <shared_mutex>
 #include <keyval/keyval.h>
+#include <keyval/stats.h>
 
 namespace keyval {
 namespace memory {
@@ -38,12 +41,34 @@ namespace memory {
 class BufferCompare
 {
 public:
-    int operator()(const std::shared_ptr<Buffer>& x,
-                   const std::shared_ptr<Buffer>& y) const
+    // Allow lookups using KeySpan without allocating a Buffer
+    typedef void is_transparent;
+
+    bool operator()(const std::shared_ptr<Buffer>& x,
+                    const std::shared_ptr<Buffer>& y) const
+    {
+        return less(x->data(), x->size(), y->data(), y->size());
+    }
+
+    bool operator()(const std::shared_ptr<Buffer>& x,
+                    const KeySpan& y) const
+    {
+        return less(x->data(), x->size(), y.data(), y.size());
+    }
+
+    bool operator()(const KeySpan& x,
+                    const std::shared_ptr<Buffer>& y) const
+    {
+        return less(x.data(), x.size(), y->data(), y->size());
+    }
+
+private:
+    static bool less(
+        const std::uint8_t* x, std::size_t xsz,
+        const std::uint8_t* y, std::size_t ysz)
     {
-        auto xsz = x->size(), ysz = y->size();
         auto sz = std::min(xsz, ysz);
-        auto cmp = ::memcmp(x->data(), y->data(), sz);
+        auto cmp = ::memcmp(x, y, sz);
         if (cmp) return cmp < 0;
         return xsz < ysz;
     }
@@ -64,12 +89,17 @@ public:
     std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
     std::unique_ptr<Transaction> beginTransaction() override;
     void commit(std::unique_ptr<Transaction>&& transaction) override;
+    void commitAsync(
+        std::unique_ptr<Transaction>&& transaction,
+        std::function<void(std::exception_ptr)> cb) override;
     void flush() override {}
+    std::shared_ptr<Snapshot> snapshot() override;
     bool isReplicated() override { return false; }
     bool isMaster() override { return true; }
     bool get(
         std::shared_ptr<oncrpc::RestRequest> req,
-        std::unique_ptr<oncrpc::RestEncoder>&& res) override { return false; }
+        std::unique_ptr<oncrpc::RestEncoder>&& res) override;
+    std::shared_ptr<DatabaseStats> stats() override { return stats_; }
     void onMasterChange(std::function<void(bool)> cb) override {}
     void setAppData(const std::vector<uint8_t>& data) override {}
     std::vector<ReplicaInfo> getReplicas() override { return {}; }
@@ -77,13 +107,53 @@ public:
 private:
     std::mutex mutex_;
     std::map<std::string, std::shared_ptr<MemoryNamespace>> namespaces_;
+    std::shared_ptr<DatabaseStats> stats_ = std::make_shared<DatabaseStats>();
+};
+
+/// A snapshot of a memory database. Namespace maps are shared with
+/// the database which copies them before modifying them.
+class MemorySnapshot: public Snapshot,
+                      public std::enable_shared_from_this<MemorySnapshot>
+{
+public:
+    MemorySnapshot(
+        std::map<std::string, std::shared_ptr<namespaceT>>&& maps,
+        std::shared_ptr<DatabaseStats> stats)
+        : maps_(std::move(maps)),
+          stats_(stats)
+    {
+    }
+
+    // Snapshot overrides
+    std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
+    std::vector<std::string> namespaces() override;
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<namespaceT>> maps_;
+    std::shared_ptr<DatabaseStats> stats_;
 };
 
 class MemoryNamespace: public Namespace
 {
 public:
-    MemoryNamespace(std::mutex& mutex)
-        : mutex_(mutex)
+    MemoryNamespace(std::mutex& mutex, std::shared_ptr<NamespaceStats> stats)
+        : mutex_(mutex),
+          map_(std::make_shared<namespaceT>()),
+          stats_(stats)
+    {
+    }
+
+    /// Create a read-only namespace which shares a map with some
+    /// snapshot
+    MemoryNamespace(
+        std::mutex& mutex, std::shared_ptr<namespaceT> map,
+        std::shared_ptr<Snapshot> snapshot,
+        std::shared_ptr<NamespaceStats> stats)
+        : mutex_(mutex),
+          map_(map),
+          snapshot_(snapshot),
+          stats_(stats)
     {
     }
 
@@ -96,21 +166,42 @@ public:
     std::unique_ptr<Iterator> iterator(
         std::shared_ptr<Buffer> startKey, std::shared_ptr<Buffer> endKey) override;
     std::shared_ptr<Buffer> get(std::shared_ptr<Buffer> key) override;
+    std::shared_ptr<Buffer> get(const KeySpan& key) override;
+    std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys) override;
     std::uint64_t spaceUsed(
         std::shared_ptr<Buffer> start, std::shared_ptr<Buffer> end) override;
 
-    auto& map() { return map_; }
+    auto& map() { return *map_; }
     auto gen() const { return gen_; }
+    NamespaceStats& stats() { return *stats_; }
+
+    /// Return the current map for use in a snapshot. Must be called
+    /// with the mutex locked.
+    auto share() { return map_; }
 
     // These are only called from MemoryTransaction::commit with the
     // mutex locked
     void put(std::shared_ptr<Buffer> key, std::shared_ptr<Buffer> value);
     void remove(std::shared_ptr<Buffer> key);
+    void removeRange(
+        std::shared_ptr<Buffer> startKey, std::shared_ptr<Buffer> endKey);
 
 private:
+    /// Prepare to modify the map, copying it if it is shared with a
+    /// snapshot
+    namespaceT& mutableMap()
+    {
+        if (map_.use_count() > 1)
+            map_ = std::make_shared<namespaceT>(*map_);
+        return *map_;
+    }
+
     std::mutex& mutex_;
     std::uint64_t gen_ = 1;
-    namespaceT map_;
+    std::shared_ptr<namespaceT> map_;
+    std::shared_ptr<Snapshot> snapshot_;
+    std::shared_ptr<NamespaceStats> stats_;
 };
 
 class MemoryIterator: public Iterator
@@ -161,6 +252,8 @@ public:
     bool valid() const override;
     std::shared_ptr<Buffer> key() const override;
     std::shared_ptr<Buffer> value() const override;
+    IteratorBatch nextBatch(
+        std::size_t maxEntries, std::size_t maxBytes) override;
 
 private:
     MemoryNamespace& ns_;
@@ -172,6 +265,231 @@ private:
     std::shared_ptr<Buffer> value_;
 };
 
+class ShardedNamespace;
+
+/// A variant of MemoryDatabase which splits each namespace into
+/// shards by key hash, each protected by a reader/writer lock. Reads
+/// only lock the shard containing the key and commits only lock the
+/// shards they modify, allowing reads and commits to proceed in
+/// parallel.
+class ShardedMemoryDatabase: public Database
+{
+public:
+    ShardedMemoryDatabase(int shards);
+
+    // Database overrides
+    std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
+    std::unique_ptr<Transaction> beginTransaction() override;
+    void commit(std::unique_ptr<Transaction>&& transaction) override;
+    void commitAsync(
+        std::unique_ptr<Transaction>&& transaction,
+        std::function<void(std::exception_ptr)> cb) override;
+    void flush() override {}
+    std::shared_ptr<Snapshot> snapshot() override;
+    bool isReplicated() override { return false; }
+    bool isMaster() override { return true; }
+    bool get(
+        std::shared_ptr<oncrpc::RestRequest> req,
+        std::unique_ptr<oncrpc::RestEncoder>&& res) override;
+    std::shared_ptr<DatabaseStats> stats() override { return stats_; }
+    void onMasterChange(std::function<void(bool)> cb) override {}
+    void setAppData(const std::vector<uint8_t>& data) override {}
+    std::vector<ReplicaInfo> getReplicas() override { return {}; }
+
+private:
+    int shards_;
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<ShardedNamespace>> namespaces_;
+    std::shared_ptr<DatabaseStats> stats_ = std::make_shared<DatabaseStats>();
+};
+
+class ShardedNamespace: public Namespace
+{
+public:
+    struct Shard
+    {
+        /// Prepare to modify the map, copying it if it is shared
+        /// with a snapshot. Must be called with the mutex locked for
+        /// writing
+        namespaceT& mutableMap()
+        {
+            if (map.use_count() > 1)
+                map = std::make_shared<namespaceT>(*map);
+            return *map;
+        }
+
+        std::shared_timed_mutex mutex;
+
+        /// Incremented by each commit which modifies the shard. This
+        /// may be read without the mutex to check whether an
+        /// iterator's cached entry is still current.
+        std::atomic<std::uint64_t> gen{1};
+        std::shared_ptr<namespaceT> map = std::make_shared<namespaceT>();
+    };
+
+    ShardedNamespace(
+        int index, int shards, std::shared_ptr<NamespaceStats> stats)
+        : index_(index),
+          shards_(shards),
+          stats_(stats)
+    {
+    }
+
+    /// Create a read-only namespace which shares its shard maps with
+    /// some snapshot
+    ShardedNamespace(
+        const std::vector<std::shared_ptr<namespaceT>>& maps,
+        std::shared_ptr<Snapshot> snapshot,
+        std::shared_ptr<NamespaceStats> stats)
+        : index_(-1),
+          shards_(maps.size()),
+          snapshot_(snapshot),
+          stats_(stats)
+    {
+        for (size_t i = 0; i < maps.size(); i++)
+            shards_[i].map = maps[i];
+    }
+
+    std::unique_ptr<Iterator> iterator() override;
+    std::unique_ptr<Iterator> iterator(
+        std::shared_ptr<Buffer> startKey, std::shared_ptr<Buffer> endKey) override;
+    std::shared_ptr<Buffer> get(std::shared_ptr<Buffer> key) override;
+    std::shared_ptr<Buffer> get(const KeySpan& key) override;
+    std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys) override;
+    std::uint64_t spaceUsed(
+        std::shared_ptr<Buffer> start, std::shared_ptr<Buffer> end) override;
+
+    /// Namespaces are numbered in creation order - commits lock
+    /// shards ordered by namespace index then shard index
+    int index() const { return index_; }
+    int shardCount() const { return int(shards_.size()); }
+    Shard& shard(int i) { return shards_[i]; }
+    NamespaceStats& stats() { return *stats_; }
+
+    /// Return the index of the shard which contains the given key
+    int shardOf(const std::shared_ptr<Buffer>& key) const
+    {
+        return shardOf(KeySpan(key->data(), key->size()));
+    }
+    int shardOf(const KeySpan& key) const;
+
+private:
+    int index_;
+    std::vector<Shard> shards_;
+    std::shared_ptr<Snapshot> snapshot_;
+    std::shared_ptr<NamespaceStats> stats_;
+};
+
+/// A snapshot of a sharded memory database
+class ShardedSnapshot: public Snapshot,
+                       public std::enable_shared_from_this<ShardedSnapshot>
+{
+public:
+    ShardedSnapshot(
+        int shards,
+        std::map<std::string, std::vector<std::shared_ptr<namespaceT>>>&& maps,
+        std::shared_ptr<DatabaseStats> stats)
+        : shards_(shards),
+          maps_(std::move(maps)),
+          stats_(stats)
+    {
+    }
+
+    // Snapshot overrides
+    std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
+    std::vector<std::string> namespaces() override;
+
+private:
+    int shards_;
+    std::mutex mutex_;
+    std::map<std::string, std::vector<std::shared_ptr<namespaceT>>> maps_;
+    std::shared_ptr<DatabaseStats> stats_;
+};
+
+/// Iterate over a sharded namespace by merging the shards. The
+/// iterator caches the next entry from each shard and each step only
+/// locks the shard it advances, re-reading any other cached entry
+/// whose shard has changed. Like MemoryIterator, this does not give a
+/// point-in-time view: every entry returned was present when it was
+/// read but entries written after the iterator was created may or may
+/// not be seen. Use a snapshot for a consistent view.
+class ShardedIterator: public Iterator
+{
+public:
+    ShardedIterator(
+        ShardedNamespace& ns,
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey);
+
+    void seek(std::shared_ptr<Buffer> key) override;
+    void seekToFirst() override;
+    void seekToLast() override;
+    void next() override;
+    void prev() override;
+    bool valid() const override;
+    std::shared_ptr<Buffer> key() const override;
+    std::shared_ptr<Buffer> value() const override;
+
+private:
+    // Position each shard cursor at the first entry at or after key
+    // (or the first entry if key is null) and select the smallest
+    void seekInternal(std::shared_ptr<Buffer> key);
+
+    // Read the first entry of shard i at or after key, or strictly
+    // after key if after is set
+    void fill(int i, std::shared_ptr<Buffer> key, bool after);
+
+    // Select the cursor with the smallest key, re-reading it first if
+    // its shard has changed since it was read
+    void read();
+
+    struct Cursor
+    {
+        std::uint64_t gen;
+        std::shared_ptr<Buffer> key;    // null at the end of the shard
+        std::shared_ptr<Buffer> value;
+    };
+
+    ShardedNamespace& ns_;
+    std::vector<Cursor> cursors_;
+    int current_ = -1;
+    std::shared_ptr<Buffer> endKey_;
+    std::shared_ptr<Buffer> key_;
+    std::shared_ptr<Buffer> value_;
+};
+
+class ShardedTransaction: public Transaction
+{
+public:
+    void put(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> key,
+        std::shared_ptr<Buffer> val) override;
+    void remove(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> key) override;
+    void removeRange(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey) override;
+
+    void commit();
+
+private:
+    struct Op
+    {
+        enum Type { PUT, REMOVE, REMOVE_RANGE };
+        Type type;
+        std::shared_ptr<ShardedNamespace> ns;
+        int shard;              // -1 for all shards
+        std::shared_ptr<Buffer> key;
+        std::shared_ptr<Buffer> val;    // value or end key
+    };
+
+    std::vector<Op> ops_;
+};
+
 class MemoryTransaction: public Transaction
 {
 public:
@@ -182,6 +500,10 @@ public:
     void remove(
         std::shared_ptr<Namespace> ns,
         std::shared_ptr<Buffer> key) override;
+    void removeRange(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey) override;
 
     void commit();
 
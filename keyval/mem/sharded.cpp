@@ -0,0 +1,444 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <system_error>
+#include <tuple>
+
+#include <rpc++/rest.h>
+
+#include "mem.h"
+
+using namespace keyval;
+using namespace keyval::memory;
+using namespace std;
+
+ShardedMemoryDatabase::ShardedMemoryDatabase(int shards)
+    : shards_(shards)
+{
+}
+
+// Database overrides
+shared_ptr<Namespace> ShardedMemoryDatabase::getNamespace(const string& name)
+{
+    unique_lock<mutex> lock(mutex_);
+
+    auto it = namespaces_.find(name);
+    if (it != namespaces_.end())
+        return it->second;
+
+    auto ns = make_shared<ShardedNamespace>(
+        namespaces_.size(), shards_, stats_->getNamespace(name));
+    namespaces_[name] = ns;
+
+    return ns;
+}
+
+unique_ptr<Transaction> ShardedMemoryDatabase::beginTransaction()
+{
+    return make_unique<ShardedTransaction>();
+}
+
+void ShardedMemoryDatabase::commit(unique_ptr<Transaction>&& transaction)
+{
+    OpTimer timer(stats_->commit);
+    auto t = reinterpret_cast<ShardedTransaction*>(transaction.get());
+    t->commit();
+    transaction.reset();
+}
+
+void ShardedMemoryDatabase::commitAsync(
+    unique_ptr<Transaction>&& transaction,
+    function<void(exception_ptr)> cb)
+{
+    try {
+        commit(move(transaction));
+    }
+    catch (...) {
+        cb(current_exception());
+        return;
+    }
+    cb(nullptr);
+}
+
+shared_ptr<Snapshot> ShardedMemoryDatabase::snapshot()
+{
+    unique_lock<mutex> lock(mutex_);
+
+    // Read-lock every shard, in the same order as commits lock them,
+    // so that we capture a consistent set of maps
+    vector<pair<string, shared_ptr<ShardedNamespace>>> namespaces(
+        namespaces_.begin(), namespaces_.end());
+    sort(namespaces.begin(), namespaces.end(),
+         [](auto& x, auto& y) {
+             return x.second->index() < y.second->index();
+         });
+    vector<shared_lock<shared_timed_mutex>> locks;
+    map<string, vector<shared_ptr<namespaceT>>> maps;
+    for (auto& entry: namespaces) {
+        auto ns = entry.second;
+        auto& nsmaps = maps[entry.first];
+        for (int i = 0; i < ns->shardCount(); i++) {
+            locks.emplace_back(ns->shard(i).mutex);
+            nsmaps.push_back(ns->shard(i).map);
+        }
+    }
+    return make_shared<ShardedSnapshot>(shards_, move(maps), stats_);
+}
+
+bool ShardedMemoryDatabase::get(
+    shared_ptr<oncrpc::RestRequest> req,
+    unique_ptr<oncrpc::RestEncoder>&& res)
+{
+    auto obj = res->object();
+    stats_->report(obj);
+    return true;
+}
+
+shared_ptr<Namespace> ShardedSnapshot::getNamespace(const string& name)
+{
+    unique_lock<mutex> lock(mutex_);
+    auto& maps = maps_[name];
+    if (maps.empty()) {
+        for (int i = 0; i < shards_; i++)
+            maps.push_back(make_shared<namespaceT>());
+    }
+    return make_shared<ShardedNamespace>(
+        maps, shared_from_this(), stats_->getNamespace(name));
+}
+
+vector<string> ShardedSnapshot::namespaces()
+{
+    unique_lock<mutex> lock(mutex_);
+    vector<string> res;
+    for (auto& entry: maps_)
+        res.push_back(entry.first);
+    return res;
+}
+
+unique_ptr<Iterator> ShardedNamespace::iterator()
+{
+    return make_unique<ShardedIterator>(*this, nullptr, nullptr);
+}
+
+unique_ptr<Iterator> ShardedNamespace::iterator(
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey)
+{
+    return make_unique<ShardedIterator>(*this, startKey, endKey);
+}
+
+shared_ptr<Buffer> ShardedNamespace::get(shared_ptr<Buffer> key)
+{
+    return get(KeySpan(key->data(), key->size()));
+}
+
+shared_ptr<Buffer> ShardedNamespace::get(const KeySpan& key)
+{
+    OpTimer timer(stats_->get);
+    auto& s = shards_[shardOf(key)];
+    shared_lock<shared_timed_mutex> lk(s.mutex);
+    auto it = s.map->find(key);
+    if (it == s.map->end())
+        throw system_error(ENOENT, system_category());
+    timer.setBytes(it->second->size());
+    return it->second;
+}
+
+vector<shared_ptr<Buffer>> ShardedNamespace::multiGet(
+    const vector<shared_ptr<Buffer>>& keys)
+{
+    OpTimer timer(stats_->get);
+    vector<shared_ptr<Buffer>> res;
+    res.reserve(keys.size());
+    size_t bytes = 0;
+    for (auto& key: keys) {
+        auto& s = shards_[shardOf(key)];
+        shared_lock<shared_timed_mutex> lk(s.mutex);
+        auto it = s.map->find(key);
+        if (it != s.map->end()) {
+            bytes += it->second->size();
+            res.push_back(it->second);
+        }
+        else {
+            res.push_back(nullptr);
+        }
+    }
+    timer.setBytes(bytes);
+    return res;
+}
+
+uint64_t ShardedNamespace::spaceUsed(
+    shared_ptr<Buffer> start, shared_ptr<Buffer> end)
+{
+    return 0;
+}
+
+int ShardedNamespace::shardOf(const KeySpan& key) const
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    auto p = key.data();
+    for (size_t i = 0; i < key.size(); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h % shards_.size();
+}
+
+ShardedIterator::ShardedIterator(
+    ShardedNamespace& ns,
+    shared_ptr<Buffer> startKey,
+    shared_ptr<Buffer> endKey)
+    : ns_(ns),
+      cursors_(ns.shardCount()),
+      endKey_(endKey)
+{
+    seekInternal(startKey);
+}
+
+void ShardedIterator::seekInternal(shared_ptr<Buffer> key)
+{
+    for (int i = 0; i < int(cursors_.size()); i++)
+        fill(i, key, false);
+    read();
+}
+
+void ShardedIterator::fill(int i, shared_ptr<Buffer> key, bool after)
+{
+    auto& s = ns_.shard(i);
+    auto& c = cursors_[i];
+    shared_lock<shared_timed_mutex> lk(s.mutex);
+    c.gen = s.gen;
+    auto& map = *s.map;
+    auto it = !key ? map.begin()
+        : after ? map.upper_bound(key) : map.lower_bound(key);
+    if (it != map.end()) {
+        c.key = it->first;
+        c.value = it->second;
+    }
+    else {
+        c.key.reset();
+        c.value.reset();
+    }
+}
+
+void ShardedIterator::read()
+{
+    namespaceT::key_compare comp;
+    for (;;) {
+        current_ = -1;
+        for (int i = 0; i < int(cursors_.size()); i++) {
+            auto& c = cursors_[i];
+            if (!c.key)
+                continue;
+            if (current_ < 0 || comp(c.key, cursors_[current_].key))
+                current_ = i;
+        }
+        if (current_ < 0) {
+            key_.reset();
+            value_.reset();
+            return;
+        }
+
+        // If the shard has changed since we read this entry, it may
+        // have been removed or replaced
+        auto& c = cursors_[current_];
+        if (c.gen == ns_.shard(current_).gen) {
+            key_ = c.key;
+            value_ = c.value;
+            return;
+        }
+        fill(current_, c.key, false);
+    }
+}
+
+void ShardedIterator::seek(shared_ptr<Buffer> key)
+{
+    OpTimer timer(ns_.stats().seek);
+    seekInternal(key);
+}
+
+void ShardedIterator::seekToFirst()
+{
+    OpTimer timer(ns_.stats().seek);
+    seekInternal(nullptr);
+}
+
+void ShardedIterator::seekToLast()
+{
+    OpTimer timer(ns_.stats().seek);
+    namespaceT::key_compare comp;
+    shared_ptr<Buffer> last;
+    for (int i = 0; i < ns_.shardCount(); i++) {
+        auto& s = ns_.shard(i);
+        shared_lock<shared_timed_mutex> lk(s.mutex);
+        if (s.map->empty())
+            continue;
+        auto& key = s.map->rbegin()->first;
+        if (!last || comp(last, key))
+            last = key;
+    }
+    if (last) {
+        seekInternal(last);
+    }
+    else {
+        current_ = -1;
+        key_.reset();
+        value_.reset();
+    }
+}
+
+void ShardedIterator::next()
+{
+    if (current_ < 0)
+        return;
+    OpTimer timer(ns_.stats().next);
+    fill(current_, key_, true);
+    read();
+    if (current_ >= 0)
+        timer.setBytes(key_->size() + value_->size());
+}
+
+void ShardedIterator::prev()
+{
+    if (current_ < 0)
+        return;
+    OpTimer timer(ns_.stats().next);
+    namespaceT::key_compare comp;
+
+    // Find the largest key before the current key in any shard and
+    // re-position all the cursors from there
+    shared_ptr<Buffer> prevKey;
+    for (int i = 0; i < ns_.shardCount(); i++) {
+        auto& s = ns_.shard(i);
+        shared_lock<shared_timed_mutex> lk(s.mutex);
+        auto it = s.map->lower_bound(key_);
+        if (it == s.map->begin())
+            continue;
+        --it;
+        if (!prevKey || comp(prevKey, it->first))
+            prevKey = it->first;
+    }
+    if (prevKey) {
+        seekInternal(prevKey);
+    }
+    else {
+        current_ = -1;
+        key_.reset();
+        value_.reset();
+    }
+}
+
+bool ShardedIterator::valid() const
+{
+    if (current_ < 0)
+        return false;
+    if (endKey_) {
+        namespaceT::key_compare comp;
+        return comp(key_, endKey_);
+    }
+    return true;
+}
+
+shared_ptr<Buffer> ShardedIterator::key() const
+{
+    return key_;
+}
+
+shared_ptr<Buffer> ShardedIterator::value() const
+{
+    return value_;
+}
+
+void ShardedTransaction::put(
+    shared_ptr<Namespace> ns, shared_ptr<Buffer> key, shared_ptr<Buffer> val)
+{
+    auto sns = dynamic_pointer_cast<ShardedNamespace>(ns);
+    ops_.push_back(Op{Op::PUT, sns, sns->shardOf(key), key, val});
+}
+
+void ShardedTransaction::remove(
+    shared_ptr<Namespace> ns, shared_ptr<Buffer> key)
+{
+    auto sns = dynamic_pointer_cast<ShardedNamespace>(ns);
+    ops_.push_back(Op{Op::REMOVE, sns, sns->shardOf(key), key, nullptr});
+}
+
+void ShardedTransaction::removeRange(
+    shared_ptr<Namespace> ns,
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey)
+{
+    auto sns = dynamic_pointer_cast<ShardedNamespace>(ns);
+    ops_.push_back(Op{Op::REMOVE_RANGE, sns, -1, startKey, endKey});
+}
+
+void ShardedTransaction::commit()
+{
+    // Lock every shard we modify, in a consistent order to avoid
+    // deadlocks with concurrent commits
+    vector<tuple<int, int, ShardedNamespace::Shard*>> shards;
+    for (auto& op: ops_) {
+        auto ns = op.ns.get();
+        if (op.shard >= 0) {
+            shards.emplace_back(ns->index(), op.shard, &ns->shard(op.shard));
+        }
+        else {
+            for (int i = 0; i < ns->shardCount(); i++)
+                shards.emplace_back(ns->index(), i, &ns->shard(i));
+        }
+    }
+    sort(shards.begin(), shards.end());
+    shards.erase(unique(shards.begin(), shards.end()), shards.end());
+    vector<unique_lock<shared_timed_mutex>> locks;
+    locks.reserve(shards.size());
+    for (auto& s: shards) {
+        auto shard = get<2>(s);
+        locks.emplace_back(shard->mutex);
+        shard->gen++;
+    }
+
+    for (auto& op: ops_) {
+        auto ns = op.ns.get();
+        switch (op.type) {
+        case Op::PUT:
+            ns->stats().write.count(1, op.key->size() + op.val->size());
+            ns->shard(op.shard).mutableMap()[op.key] = op.val;
+            break;
+        case Op::REMOVE:
+            ns->stats().write.count(1, op.key->size());
+            ns->shard(op.shard).mutableMap().erase(op.key);
+            break;
+        case Op::REMOVE_RANGE:
+            ns->stats().write.count(1, op.key->size() + op.val->size());
+            for (int i = 0; i < ns->shardCount(); i++) {
+                auto& map = ns->shard(i).mutableMap();
+                map.erase(map.lower_bound(op.key), map.lower_bound(op.val));
+            }
+            break;
+        }
+    }
+    ops_.clear();
+}
@@ -0,0 +1,323 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <glog/logging.h>
+
+#include "paxos.h"
+
+using namespace keyval;
+using namespace keyval::paxos;
+
+void Replica::catchup(const CATCHUPargs& args)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+
+    if (args.peer != uuid_ || receiver_)
+        return;
+
+    VLOG(1) << "catchup request from " << args.uuid
+            << " for [" << args.start << ", " << args.end << ")";
+    if (args.start <= truncatedInstance_) {
+        proto_->truncated({uuid_, truncatedInstance_});
+        return;
+    }
+
+    // We can only send values for instances we have applied since
+    // chosenFrom_ - their log entries hold the chosen values. For
+    // older instances, an empty reply makes the peer fall back to the
+    // full protocol. Read the entries in order directly from the log
+    // rather than through the acceptor cache.
+    auto end = std::min(args.end, appliedInstance_ + 1);
+    if (args.start < chosenFrom_)
+        end = args.start;
+    auto instance = args.start;
+    std::vector<CHOSENargs> msgs;
+    auto it = log_->iterator();
+    it->seek(instanceKey(instance));
+    while (instance < end && int(msgs.size()) < CATCHUP_WINDOW) {
+        CHOSENargs msg{uuid_, args.uuid, instance, {}, false};
+        std::size_t size = 0;
+        while (instance < end && it->valid()) {
+            auto key = it->key();
+            std::int64_t i;
+            oncrpc::XdrMemory xmk(key->data(), key->size());
+            xdr(i, static_cast<oncrpc::XdrSource*>(&xmk));
+            if (i != instance)
+                break;
+            auto val = it->value();
+            AcceptorState as(i);
+            oncrpc::XdrMemory xmv(val->data(), val->size());
+            xdr(as, static_cast<oncrpc::XdrSource*>(&xmv));
+            if (as.vrnd == PaxosRound{0})
+                break;
+            if (msg.values.size() > 0 &&
+                size + as.vval.size() > CATCHUP_BATCH_SIZE)
+                break;
+            size += as.vval.size();
+            msg.values.push_back(std::move(as.vval));
+            instance++;
+            it->next();
+        }
+        if (msg.values.size() == 0)
+            break;
+        msgs.push_back(std::move(msg));
+    }
+    it.reset();
+
+    // Always reply so that the peer knows how far we can take it
+    if (msgs.size() == 0)
+        msgs.push_back(CHOSENargs{uuid_, args.uuid, args.start, {}, false});
+    msgs.back().last = true;
+    lk.unlock();
+    for (auto& msg: msgs)
+        proto_->chosen(msg);
+}
+
+void Replica::chosen(const CHOSENargs& args)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+
+    auto cp = catchup_.get();
+    if (args.peer != uuid_ || !cp || args.uuid != cp->peer)
+        return;
+
+    // Batches may arrive out of order - if we have missed one, the
+    // next request will ask for it again
+    std::vector<std::shared_ptr<PendingTransaction>> completed;
+    if (args.start <= appliedInstance_ + 1) {
+        auto skip = appliedInstance_ + 1 - args.start;
+        if (skip < std::int64_t(args.values.size())) {
+            cp->timeouts = 0;
+            std::vector<PaxosCommand> values(
+                args.values.begin() + skip, args.values.end());
+            auto start = appliedInstance_ + 1;
+
+            // If any of these instances are our own proposals, we
+            // know whether our transactions were chosen
+            for (int i = 0; i < int(values.size()); i++) {
+                auto pp = findProposerState(lk, start + i, false);
+                if (!pp || pp->transactions.size() == 0)
+                    continue;
+                if (pp->cval == values[i]) {
+                    chosen_[pp->instance] = std::move(pp->transactions);
+                }
+                else {
+                    pendingCommands_.insert(
+                        pendingCommands_.begin(),
+                        pp->transactions.begin(), pp->transactions.end());
+                }
+                pp->transactions.clear();
+            }
+
+            applyChosen(lk, values);
+            completed = completeThrough(lk, appliedInstance_);
+        }
+    }
+
+    // Stop once we reach an instance we have already learned through
+    // the protocol
+    auto lp = findLearnerState(lk, appliedInstance_ + 1, false);
+    if (appliedInstance_ + 1 >= cp->end || (lp && lp->value)) {
+        LOG(INFO) << "caught up to " << appliedInstance_
+                  << " from " << cp->peer;
+        if (cp->timer)
+            tman_->cancel(cp->timer);
+        catchup_.reset();
+    }
+    else if (args.last) {
+        if (appliedInstance_ + 1 == cp->start) {
+            // The peer can't give us anything more
+            abandonCatchup(lk);
+        }
+        else {
+            cp->start = appliedInstance_ + 1;
+            sendCatchup(lk);
+        }
+    }
+
+    if (!catchup_) {
+        // Carry on with the normal protocol for any later instances
+        if (applyCommands(lk) && status_ == STATUS_RECOVERING) {
+            LOG(INFO) << "recovered to " << maxInstance_;
+            status_ = STATUS_HEALTHY;
+            sendIdentity(lk);
+        }
+        if (!lk.owns_lock())
+            lk.lock();
+    }
+    progress_.notify_all();
+
+    if (completed.size() > 0) {
+        lk.unlock();
+        for (auto& trans: completed)
+            trans->complete();
+    }
+}
+
+bool Replica::startCatchup(std::unique_lock<std::mutex>& lk)
+{
+    auto start = appliedInstance_ + 1;
+    if (catchup_ || receiver_ || start == catchupFailed_ ||
+        maxInstance_ - appliedInstance_ < MIN_CATCHUP_INSTANCES)
+        return false;
+
+    // Prefer a healthy follower so that we don't add to the leader's
+    // load
+    UUID peer = UUID::null;
+    for (auto& entry: peers_) {
+        auto& p = entry.second;
+        if (p.id == uuid_ || p.status != STATUS_HEALTHY)
+            continue;
+        if (peer == UUID::null || peer == leader_)
+            peer = p.id;
+    }
+    if (peer == UUID::null)
+        return false;
+
+    LOG(INFO) << "catching up [" << start << ", " << maxInstance_ + 1
+              << ") from " << peer;
+    catchup_ = std::make_unique<CatchupState>();
+    catchup_->peer = peer;
+    catchup_->start = start;
+    catchup_->end = maxInstance_ + 1;
+    sendCatchup(lk);
+    return true;
+}
+
+void Replica::sendCatchup(std::unique_lock<std::mutex>& lk)
+{
+    auto cp = catchup_.get();
+    if (cp->timer)
+        tman_->cancel(cp->timer);
+    cp->timer = tman_->add(
+        clock_->now() + rtt_,
+        [this]() {
+            std::unique_lock<std::mutex> lk2(mutex_);
+            if (!catchup_)
+                return;
+            catchup_->timer = 0;
+            LOG(INFO) << "catchup timeout";
+            auto it = peers_.find(catchup_->peer);
+            if (++catchup_->timeouts == CATCHUP_MAX_TIMEOUTS ||
+                it == peers_.end() || it->second.status == STATUS_DEAD) {
+                abandonCatchup(lk2);
+                applyCommands(lk2);
+                return;
+            }
+            catchup_->start = appliedInstance_ + 1;
+            sendCatchup(lk2);
+        });
+    proto_->catchup({uuid_, cp->peer, cp->start, cp->end});
+}
+
+void Replica::abandonCatchup(std::unique_lock<std::mutex>& lk)
+{
+    LOG(INFO) << "abandoning catchup from " << catchup_->peer
+              << " at " << appliedInstance_ + 1;
+    if (catchup_->timer)
+        tman_->cancel(catchup_->timer);
+    catchup_.reset();
+    catchupFailed_ = appliedInstance_ + 1;
+}
+
+void Replica::applyChosen(
+    std::unique_lock<std::mutex>& lk, const std::vector<PaxosCommand>& values)
+{
+    auto start = appliedInstance_ + 1;
+    auto last = start + std::int64_t(values.size()) - 1;
+
+    // Try to apply the whole batch in one transaction, along with the
+    // log entries recording the chosen values
+    auto trans = db_->beginTransaction();
+    bool batched = true;
+    for (int i = 0; i < int(values.size()); i++) {
+        if (values[i].size() > 0 && !applyTo(values[i], trans.get())) {
+            batched = false;
+            break;
+        }
+    }
+    if (batched) {
+        VLOG(1) << "applying [" << start << ", " << last << "]";
+        for (int i = 0; i < int(values.size()); i++)
+            recordChosen(lk, start + i, values[i], trans.get());
+        saveInstance(last, trans.get());
+        db_->commit(std::move(trans));
+    }
+    else {
+        trans.reset();
+        for (int i = 0; i < int(values.size()); i++)
+            applyValue(lk, start + i, values[i]);
+    }
+    appliedInstance_ = last;
+    if (maxInstance_ < last)
+        maxInstance_ = last;
+}
+
+std::vector<std::shared_ptr<PendingTransaction>> Replica::completeThrough(
+    std::unique_lock<std::mutex>& lk, std::int64_t instance)
+{
+    // Any of our own proposals for these instances are finished. If
+    // we know the chosen value was ours, the transactions are
+    // complete, otherwise they must be retried.
+    std::vector<std::shared_ptr<PendingTransaction>> completed;
+    std::deque<std::shared_ptr<PendingTransaction>> retry;
+    for (auto it = proposerState_.begin(); it != proposerState_.end(); ) {
+        auto pp = it->second.get();
+        if (pp->instance > instance) {
+            ++it;
+            continue;
+        }
+        if (pp->prepareTimer)
+            tman_->cancel(pp->prepareTimer);
+        if (pp->acceptTimer)
+            tman_->cancel(pp->acceptTimer);
+        auto lp = findLearnerState(lk, pp->instance, false);
+        if (lp && lp->value && *lp->value == pp->cval)
+            completed.insert(
+                completed.end(),
+                pp->transactions.begin(), pp->transactions.end());
+        else
+            retry.insert(
+                retry.end(),
+                pp->transactions.begin(), pp->transactions.end());
+        it = proposerState_.erase(it);
+    }
+    pendingCommands_.insert(
+        pendingCommands_.begin(), retry.begin(), retry.end());
+    while (chosen_.size() > 0 && chosen_.begin()->first <= instance) {
+        auto& trans = chosen_.begin()->second;
+        completed.insert(completed.end(), trans.begin(), trans.end());
+        chosen_.erase(chosen_.begin());
+    }
+    for (auto it = learnerState_.begin(); it != learnerState_.end(); ) {
+        if (it->first <= instance)
+            it = learnerState_.erase(it);
+        else
+            ++it;
+    }
+    return completed;
+}
@@ -10,6 +10,7 @@
 enum OpType {
     OP_PUT = 0,
     OP_REMOVE = 1,
+    OP_REMOVE_RANGE = 2,
 };
 
 struct PutOp {
@@ -23,11 +24,22 @@ struct RemoveOp {
     opaque key<>;
 };
 
+/*
+ * Remove all keys from start up to but not including end
+ */
+struct RemoveRangeOp {
+    string ns<>;
+    opaque start<>;
+    opaque end<>;
+};
+
 union Operation switch (OpType op) {
 case OP_PUT:
     PutOp put;
 case OP_REMOVE:
     RemoveOp remove;
+case OP_REMOVE_RANGE:
+    RemoveRangeOp removeRange;
 };
 
 struct Transaction {
@@ -66,6 +66,17 @@ public:
         return ns_->get(key);
     }
 
+    std::shared_ptr<Buffer> get(const KeySpan& key) override
+    {
+        return ns_->get(key);
+    }
+
+    std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys) override
+    {
+        return ns_->multiGet(keys);
+    }
+
     std::uint64_t spaceUsed(
         std::shared_ptr<Buffer> start, std::shared_ptr<Buffer> end) override
     {
@@ -103,6 +114,40 @@ public:
                 RemoveOp{kvns->name(), toVector(key)}));
     }
 
+    void put(
+        std::shared_ptr<Namespace> ns,
+        const KeySpan& key, std::shared_ptr<Buffer> val) override
+    {
+        auto kvns = reinterpret_cast<KVNamespace*>(ns.get());
+        trans_.ops.emplace_back(
+            Operation(
+                OP_PUT,
+                PutOp{kvns->name(), toVector(key), toVector(val)}));
+    }
+
+    void remove(
+        std::shared_ptr<Namespace> ns, const KeySpan& key) override
+    {
+        auto kvns = reinterpret_cast<KVNamespace*>(ns.get());
+        trans_.ops.emplace_back(
+            Operation(
+                OP_REMOVE,
+                RemoveOp{kvns->name(), toVector(key)}));
+    }
+
+    void removeRange(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey) override
+    {
+        auto kvns = reinterpret_cast<KVNamespace*>(ns.get());
+        trans_.ops.emplace_back(
+            Operation(
+                OP_REMOVE_RANGE,
+                RemoveRangeOp{
+                    kvns->name(), toVector(startKey), toVector(endKey)}));
+    }
+
     std::vector<uint8_t> toVector(std::shared_ptr<Buffer> buf)
     {
         std::vector<uint8_t> res(buf->size());
@@ -110,6 +155,11 @@ public:
         return res;
     }
 
+    std::vector<uint8_t> toVector(const KeySpan& key)
+    {
+        return std::vector<uint8_t>(key.data(), key.data() + key.size());
+    }
+
     std::vector<uint8_t> encode() const
     {
         std::vector<uint8_t> res(oncrpc::XdrSizeof(trans_));
@@ -134,6 +184,11 @@ public:
                 LOG(INFO) << "remove " << op.remove().ns << ", "
                           << op.remove().key;
                 break;
+            case OP_REMOVE_RANGE:
+                LOG(INFO) << "remove range " << op.removeRange().ns << ", "
+                          << op.removeRange().start << ", "
+                          << op.removeRange().end;
+                break;
             }
         }
     }
@@ -182,12 +237,23 @@ KVReplica::~KVReplica()
 
 void KVReplica::apply(
     std::int64_t instance, const std::vector<uint8_t>& command)
+{
+    auto trans = db()->beginTransaction();
+    applyTo(command, trans.get());
+
+    // Write the instance number in the same transaction
+    saveInstance(instance, trans.get());
+
+    db()->commit(std::move(trans));
+}
+
+bool KVReplica::applyTo(
+    const std::vector<uint8_t>& command, keyval::Transaction* trans)
 {
     keyval::paxos::Transaction kvtrans;
     oncrpc::XdrMemory xm(command.data(), command.size());
     xdr(kvtrans, static_cast<oncrpc::XdrSource*>(&xm));
 
-    auto trans = db()->beginTransaction();
     for (auto& op: kvtrans.ops) {
         switch (op.op) {
         case OP_PUT:
@@ -208,13 +274,44 @@ void KVReplica::apply(
                 db()->getNamespace(op.remove().ns),
                 toBuffer(op.remove().key));
             break;
+        case OP_REMOVE_RANGE:
+            VLOG(2) << "remove range "
+                    << op.removeRange().ns
+                    << ", " << op.removeRange().start
+                    << ", " << op.removeRange().end;
+            trans->removeRange(
+                db()->getNamespace(op.removeRange().ns),
+                toBuffer(op.removeRange().start),
+                toBuffer(op.removeRange().end));
+            break;
         }
     }
+    return true;
+}
 
-    // Write the instance number in the same transaction
-    saveInstance(instance, trans.get());
-
-    db()->commit(std::move(trans));
+bool KVReplica::merge(
+    std::vector<uint8_t>& batch, const std::vector<uint8_t>& command)
+{
+    // Each command is an encoded keyval::paxos::Transaction which is
+    // just a counted array of operations. Applying the operations of
+    // both in a single transaction has the same effect as applying
+    // them in turn so we merge by adding the counts and appending the
+    // encoded operations.
+    std::uint32_t batchCount, commandCount;
+    if (batch.size() < sizeof(batchCount) ||
+        command.size() < sizeof(commandCount))
+        return false;
+    oncrpc::XdrMemory xb(batch.data(), sizeof(batchCount));
+    xdr(batchCount, static_cast<oncrpc::XdrSource*>(&xb));
+    oncrpc::XdrMemory xc(command.data(), sizeof(commandCount));
+    xdr(commandCount, static_cast<oncrpc::XdrSource*>(&xc));
+
+    batchCount += commandCount;
+    oncrpc::XdrMemory xm(batch.data(), sizeof(batchCount));
+    xdr(batchCount, static_cast<oncrpc::XdrSink*>(&xm));
+    batch.insert(
+        batch.end(), command.begin() + sizeof(commandCount), command.end());
+    return true;
 }
 
 void KVReplica::leaderChanged()
@@ -235,30 +332,63 @@ std::unique_ptr<keyval::Transaction> KVReplica::beginTransaction()
 }
 
 void KVReplica::commit(std::unique_ptr<keyval::Transaction>&& transaction)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::exception_ptr error;
+
+    VLOG(2) << "committing transaction";
+    commitAsync(
+        std::move(transaction),
+        [&](std::exception_ptr e) {
+            std::unique_lock<std::mutex> lk(mutex);
+            error = e;
+            done = true;
+            cv.notify_one();
+        });
+    VLOG(2) << "waiting for completion";
+    std::unique_lock<std::mutex> lk(mutex);
+    while (!done)
+        cv.wait(lk);
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void KVReplica::commitAsync(
+    std::unique_ptr<keyval::Transaction>&& transaction,
+    std::function<void(std::exception_ptr)> cb)
 {
     if (!isMaster())
         LOG(WARNING) << "writing to database when not master:"
                      << " this will start a master election";
 
     auto startTime = clock_->now();
-
-
-    VLOG(2) << "committing transaction";
     auto p = reinterpret_cast<KVTransaction*>(transaction.get());
-    auto pt = execute(p->encode());
-    VLOG(2) << "waiting for completion";
-    pt->wait();
-
-    auto deltaTime = std::chrono::duration_cast<std::chrono::milliseconds>(
-        clock_->now() - startTime);
-
-    if (deltaTime > 500ms) {
-        LOG(INFO) << "slow transaction: " << deltaTime.count() << "ms";
-        //p->log();
-        //abort();
-    }
-
+    auto command = p->encode();
+    auto bytes = command.size();
+    auto pt = execute(command);
     transaction.reset();
+
+    pt->onComplete(
+        [this, startTime, bytes, cb]() {
+            auto elapsed = clock_->now() - startTime;
+            auto stats = db_->stats();
+            if (stats) {
+                stats->replicate.add(
+                    std::chrono::duration_cast<OpStats::clock::duration>(
+                        elapsed),
+                    bytes);
+            }
+            auto deltaTime =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    elapsed);
+            if (deltaTime > 500ms) {
+                LOG(INFO) << "slow transaction: "
+                          << deltaTime.count() << "ms";
+            }
+            cb(nullptr);
+        });
 }
 
 void KVReplica::flush()
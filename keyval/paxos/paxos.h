@@ -26,10 +26,14 @@
 
 #include <array>
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include <keyval/keyval.h>
+#include <keyval/stats.h>
 #include <rpc++/timeout.h>
 #include <util/lrucache.h>
 #include <util/util.h>
@@ -109,6 +113,54 @@ static inline int operator>=(const PaxosRound& i, const PaxosRound& j)
 static constexpr util::Clock::duration LEADER_WAIT_TIME =
     std::chrono::seconds(2);
 
+/// Commands must be small enough for a single UDP packet. This also
+/// limits the size of a batch of merged commands.
+static constexpr std::size_t MAX_COMMAND_SIZE = 1400;
+
+/// The maximum number of commands merged into a single instance
+static constexpr int MAX_BATCH_COMMANDS = 64;
+
+/// The longest time a command waits for an instance in flight to
+/// complete before we start a new instance for it
+static constexpr util::Clock::duration MAX_BATCH_DELAY =
+    std::chrono::milliseconds(5);
+
+/// The largest number of instances a leader may have in flight at
+/// once. This is also the largest gap in the instance sequence which
+/// we assume is caused by message reordering rather than message loss.
+static constexpr int MAX_WINDOW = 64;
+
+/// Replicas discard log entries for instances older than
+/// LOG_RETAIN_INSTANCES behind the last applied instance, checking
+/// every LOG_TRUNCATE_INTERVAL instances
+static constexpr std::int64_t LOG_RETAIN_INSTANCES = 10000;
+static constexpr std::int64_t LOG_TRUNCATE_INTERVAL = 10000;
+
+/// Snapshots are sent in chunks of this many bytes with at most
+/// SNAPSHOT_WINDOW unacknowledged chunks in flight
+static constexpr std::size_t SNAPSHOT_CHUNK_SIZE = 1024;
+static constexpr int SNAPSHOT_WINDOW = 16;
+
+/// Received snapshot entries are committed in transactions of about
+/// this many bytes rather than once per chunk
+static constexpr std::size_t SNAPSHOT_COMMIT_SIZE = 64*1024;
+
+/// After this many fetch timeouts in a row, restart the snapshot
+/// transfer from the beginning
+static constexpr int SNAPSHOT_MAX_TIMEOUTS = 3;
+
+/// A replica which is missing at least MIN_CATCHUP_INSTANCES asks a
+/// peer to stream the chosen values instead of recovering each
+/// instance with the full protocol. Each reply carries at most
+/// CATCHUP_WINDOW batches of up to CATCHUP_BATCH_SIZE bytes of values.
+static constexpr std::int64_t MIN_CATCHUP_INSTANCES = 8;
+static constexpr std::size_t CATCHUP_BATCH_SIZE = MAX_COMMAND_SIZE;
+static constexpr int CATCHUP_WINDOW = 16;
+
+/// After this many catchup timeouts in a row, give up and recover
+/// using the full protocol
+static constexpr int CATCHUP_MAX_TIMEOUTS = 3;
+
 /// Track the status of a transaction which is being executed on a set
 /// of replicas
 class PendingTransaction
@@ -126,7 +178,7 @@ public:
     void wait()
     {
         std::unique_lock<std::mutex> lk(mutex_);
-        if (!completed_)
+        while (!completed_)
             cv_.wait(lk);
     }
 
@@ -141,12 +193,33 @@ public:
             return std::cv_status::no_timeout;
     }
 
-    /// Set the completed flag and wake up any sleepers
+    /// Arrange for a callback to be called when the transaction
+    /// completes. If the transaction has already completed, the
+    /// callback is called immediately.
+    void onComplete(std::function<void()> cb)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        if (!completed_) {
+            callbacks_.push_back(cb);
+            return;
+        }
+        lk.unlock();
+        cb();
+    }
+
+    /// Set the completed flag, wake up any sleepers and call any
+    /// completion callbacks. Must be called without the replica lock
+    /// held since callbacks may start new transactions.
     void complete()
     {
         std::unique_lock<std::mutex> lk(mutex_);
         completed_ = true;
         cv_.notify_all();
+        auto callbacks = std::move(callbacks_);
+        callbacks_.clear();
+        lk.unlock();
+        for (auto& cb: callbacks)
+            cb();
     }
 
 private:
@@ -154,6 +227,7 @@ private:
     std::condition_variable cv_;
     std::vector<uint8_t> value_;
     bool completed_;
+    std::vector<std::function<void()>> callbacks_;
 };
 
 /// The proposer state for a single Paxos instance
@@ -205,6 +279,11 @@ struct ProposerState
     ///
     std::unordered_set<UUID> promisers;
 
+    /// The subset of promisers which also promised crnd for all
+    /// later instances
+    ///
+    std::unordered_set<UUID> allPromisers;
+
     /// Number of nack replies received so far
     ///
     int nackCount = 0;
@@ -219,9 +298,10 @@ struct ProposerState
     ///
     oncrpc::TimeoutManager::task_type acceptTimer = 0;
 
-    /// If this instance executed one of our own transactions, this
-    /// points at the pending transaction object
-    std::shared_ptr<PendingTransaction> transaction;
+    /// If this instance executed some of our own transactions, this
+    /// lists the pending transaction objects, in the order they were
+    /// merged into cval
+    std::vector<std::shared_ptr<PendingTransaction>> transactions;
 
     /// True if we should log messages for this acceptor
     ///
@@ -310,6 +390,112 @@ struct LearnerState
     /// True if the value has been applied to the state machine
     ///
     bool applied = false;
+
+    /// True if we created this entry because we saw a later instance
+    /// first. With a pipelined leader this is usually just message
+    /// reordering so we allow the missing instance a short time to
+    /// arrive before trying to recover it.
+    ///
+    bool gap = false;
+};
+
+/// State for sending a snapshot of our database to a peer
+///
+struct SnapshotSender
+{
+    /// The replica which requested the snapshot
+    ///
+    UUID peer;
+
+    /// The database snapshot and the instance it was taken at
+    ///
+    std::shared_ptr<Snapshot> snapshot;
+    std::int64_t instance = 0;
+
+    /// The namespaces still to send and an iterator for the current
+    /// one
+    ///
+    std::deque<std::string> namespaces;
+    std::unique_ptr<Iterator> iterator;
+
+    /// Encoded entries which have not yet been split into chunks
+    ///
+    std::vector<uint8_t> pending;
+
+    /// Chunks which have not yet been acknowledged, starting with
+    /// sequence number base
+    ///
+    std::deque<std::vector<uint8_t>> chunks;
+    std::int64_t base = 0;
+
+    /// The next chunk to send
+    ///
+    std::int64_t sent = 0;
+
+    /// True when all entries have been encoded
+    ///
+    bool exhausted = false;
+};
+
+/// State for receiving a snapshot from a peer
+///
+struct SnapshotReceiver
+{
+    /// The replica sending the snapshot
+    ///
+    UUID peer;
+
+    /// The instance the snapshot was taken at, known once we receive
+    /// the first chunk
+    ///
+    std::int64_t instance = 0;
+
+    /// The next chunk we expect
+    ///
+    std::int64_t seq = 0;
+
+    /// Part of the entry stream which does not yet contain a complete
+    /// entry
+    ///
+    std::vector<uint8_t> buffer;
+
+    /// Entries which have been decoded but not yet committed and
+    /// their approximate size
+    ///
+    std::unique_ptr<Transaction> trans;
+    std::size_t transBytes = 0;
+
+    /// Re-send our fetch request if we don't receive the next chunk
+    ///
+    oncrpc::TimeoutManager::task_type timer = 0;
+
+    /// The number of times in a row we have timed out. If the peer
+    /// has lost its state for the transfer, we start again.
+    ///
+    int timeouts = 0;
+};
+
+/// State for streaming chosen values from a peer
+///
+struct CatchupState
+{
+    /// The replica sending the values
+    ///
+    UUID peer;
+
+    /// The first instance of our current request and the instance
+    /// after the last one we need
+    ///
+    std::int64_t start = 0;
+    std::int64_t end = 0;
+
+    /// Re-send our request if we stop receiving values
+    ///
+    oncrpc::TimeoutManager::task_type timer = 0;
+
+    /// The number of times in a row we have timed out
+    ///
+    int timeouts = 0;
 };
 
 /// An implementation of a replicated log using the Paxos algorithm
@@ -339,6 +525,11 @@ public:
     void accept(const ACCEPTargs& args) override;
     void accepted(const ACCEPTargs& args) override;
     void nack(const NACKargs& args) override;
+    void truncated(const TRUNCATEDargs& args) override;
+    void fetch(const FETCHargs& args) override;
+    void chunk(const CHUNKargs& args) override;
+    void catchup(const CATCHUPargs& args) override;
+    void chosen(const CHOSENargs& args) override;
 
     /// Execute a state machine command using the Paxos protocol
     std::shared_ptr<PendingTransaction> execute(
@@ -353,6 +544,27 @@ public:
     /// Called when the value of isLeader_ changes
     virtual void leaderChanged() = 0;
 
+    /// Append a command to a batch of commands so that applying the
+    /// batch has the same effect as applying each command in
+    /// turn. Return false without changing the batch if the commands
+    /// can't be merged. The default does not support batching.
+    virtual bool merge(
+        std::vector<uint8_t>& batch, const std::vector<uint8_t>& command)
+    {
+        return false;
+    }
+
+    /// Add the effect of applying a command to a database transaction
+    /// so that a run of instances can be applied at once when
+    /// catching up. Return false if this is not supported, in which
+    /// case each command is applied in turn. The default does not
+    /// support this.
+    virtual bool applyTo(
+        const std::vector<uint8_t>& command, Transaction* trans)
+    {
+        return false;
+    }
+
     auto& uuid() const { return uuid_; }
     auto db() const { return db_.get(); }
 
@@ -376,6 +588,18 @@ public:
     }
     auto isLeader() const { return isLeader_; }
     auto activeInstances() const { return proposerState_.size(); }
+    auto window() const { return window_; }
+
+    /// Set the number of instances we may have in flight at once when
+    /// we are leader. Defaults to one.
+    void setWindow(int window);
+
+    /// Set how many applied instances we keep in the log and how
+    /// often we discard older entries
+    void setLogRetention(std::int64_t retain, std::int64_t interval);
+
+    /// Return the last instance we have discarded from the log
+    auto truncatedInstance() const { return truncatedInstance_; }
     auto disableLeaderElections() { leaderElections_ = false; }
 
     /// Force this replica to believe it is leader - used in unit
@@ -402,6 +626,17 @@ protected:
     ProposerState* startNewInstance(
         std::unique_lock<std::mutex>& lk, std::int64_t instance);
 
+    /// Return the next instance number to use for a new proposal
+    std::int64_t nextInstance(std::unique_lock<std::mutex>& lk);
+
+    /// Return the number of instances we may have in flight. This is
+    /// window_ if we can skip phase 1 and one otherwise.
+    int pipelineWindow(std::unique_lock<std::mutex>& lk);
+
+    /// Take as many pending commands as will fit into a single
+    /// instance and merge them to form the value we propose
+    void takeCommands(std::unique_lock<std::mutex>& lk, ProposerState* pp);
+
     /// Send an identity message and queue a timeout for the next
     /// one. The lock will be unlocked on exit
     void sendIdentity(std::unique_lock<std::mutex>& lk);
@@ -434,13 +669,103 @@ protected:
     /// successfully applied all commands up to maxInstance_
     bool applyCommands(std::unique_lock<std::mutex>& lk);
 
+    /// Return the highest round the acceptor has promised for an
+    /// instance, including any promise which covers all instances
+    /// from promisedInstance_ onwards
+    PaxosRound promisedRound(
+        std::unique_lock<std::mutex>& lk, const AcceptorState* ap);
+
     /// Write an acceptor state entry to the db
     void saveAcceptorState(
         std::unique_lock<std::mutex>& lk, std::shared_ptr<AcceptorState> ap);
 
+    /// Add an acceptor state entry to a transaction
+    void putAcceptorState(AcceptorState* ap, Transaction* trans);
+
+    /// Apply a chosen value to the state machine. If applyTo is
+    /// supported, the log entry recording the value and the instance
+    /// number are written in the same transaction.
+    void applyValue(
+        std::unique_lock<std::mutex>& lk, std::int64_t instance,
+        const PaxosCommand& value);
+
+    /// Add a log entry to the transaction, if needed, so that the
+    /// entry for an instance we are applying holds its chosen value
+    /// and we can send it to peers which are catching up
+    void recordChosen(
+        std::unique_lock<std::mutex>& lk, std::int64_t instance,
+        const PaxosCommand& value, Transaction* trans);
+
+    /// Return the log key for an instance
+    static std::shared_ptr<Buffer> instanceKey(std::int64_t instance);
+
+    /// Write promisedRnd_ and promisedInstance_ to the db
+    void savePromise(std::unique_lock<std::mutex>& lk);
+
     /// Add the current instance number to a transaction
     void saveInstance(std::int64_t instance, Transaction* trans);
 
+    /// Discard log entries which are more than logRetain_ instances
+    /// behind appliedInstance_, once the applied state is on stable
+    /// storage. The database is flushed on truncateThread_ which then
+    /// takes the lock to remove the entries.
+    void truncateLog(std::unique_lock<std::mutex>& lk);
+
+    /// Remove all application data from the database, leaving the
+    /// PaxosMeta and PaxosLog namespaces intact. The lock is dropped
+    /// while removing the data.
+    void clearState(std::unique_lock<std::mutex>& lk);
+
+    /// Start fetching a snapshot from a peer. The lock will be
+    /// unlocked on exit
+    void startFetch(std::unique_lock<std::mutex>& lk, const UUID& peer);
+
+    /// Send a fetch request and set a timer to re-send it. The lock
+    /// will be unlocked on exit
+    void sendFetch(std::unique_lock<std::mutex>& lk, bool resend);
+
+    /// Encode entries and split them into chunks until the window is
+    /// full or the snapshot is exhausted
+    void fillChunks(std::unique_lock<std::mutex>& lk, SnapshotSender* sp);
+
+    /// Add the complete entries in the receive buffer to the pending
+    /// transaction, committing it if it is large enough or this is
+    /// the last chunk
+    void applyChunk(
+        std::unique_lock<std::mutex>& lk, SnapshotReceiver* rp, bool last);
+
+    /// If we are missing enough instances, start streaming them from
+    /// a healthy peer. Returns true if catchup is in progress.
+    bool startCatchup(std::unique_lock<std::mutex>& lk);
+
+    /// Send a catchup request for the instances we still need and set
+    /// a timer to re-send it
+    void sendCatchup(std::unique_lock<std::mutex>& lk);
+
+    /// Stop catching up, falling back to recovering each instance
+    /// with the full protocol
+    void abandonCatchup(std::unique_lock<std::mutex>& lk);
+
+    /// Apply chosen values for consecutive instances starting at
+    /// appliedInstance_ + 1, using a single database transaction if
+    /// applyTo is supported
+    void applyChosen(
+        std::unique_lock<std::mutex>& lk,
+        const std::vector<PaxosCommand>& values);
+
+    /// We have applied all instances up to the given one without
+    /// learning them through the protocol. Discard any protocol state
+    /// for them, returning any of our transactions which completed -
+    /// these must be completed after unlocking.
+    std::vector<std::shared_ptr<PendingTransaction>> completeThrough(
+        std::unique_lock<std::mutex>& lk, std::int64_t instance);
+
+    /// Called when we have received the whole snapshot. Returns any
+    /// of our transactions which the snapshot completed - these must
+    /// be completed after unlocking
+    std::vector<std::shared_ptr<PendingTransaction>> finishFetch(
+        std::unique_lock<std::mutex>& lk);
+
     UUID uuid_;
     std::mutex mutex_;
     std::shared_ptr<IPaxos1> proto_;
@@ -481,6 +806,11 @@ protected:
     /// LEADER_WAIT_TIME.
     oncrpc::TimeoutManager::task_type leaseTimer_ = 0;
 
+    /// Commands which arrive while an instance is in flight wait for
+    /// it to complete so that they can share the next instance. This
+    /// timer limits how long they wait.
+    oncrpc::TimeoutManager::task_type batchTimer_ = 0;
+
     /// Identity of current leader
     UUID leader_;
 
@@ -490,12 +820,22 @@ protected:
     /// True if automatic leadership elections are enabled
     bool leaderElections_ = true;
 
-    /// True if we have only just become leader - we need to run the
-    /// full paxos protocol in the next instance
-    bool newLeader_;
+    /// If a quorum of acceptors has promised us a round for all
+    /// instances after stableInstance_, this is that round and we can
+    /// skip phase 1 for new instances. It is cleared if we see a
+    /// higher round or the peer group changes.
+    PaxosRound stableRnd_ = {0};
+    std::int64_t stableInstance_ = 0;
+
+    /// As an acceptor, the round we have promised for all instances
+    /// from promisedInstance_ onwards
+    PaxosRound promisedRnd_ = {0};
+    std::int64_t promisedInstance_ = 0;
 
-    /// The last round number we used as leader
-    PaxosRound crnd_;
+    /// The highest instance we may have voted in as an acceptor. We
+    /// can only promise a round for all later instances if this is
+    /// not greater than the instance being prepared.
+    std::int64_t maxVoted_ = 0;
 
     /// The paxos state for all instances that we have participated in
     ///
@@ -515,6 +855,52 @@ protected:
     /// Pending commands that have not yet been processed
     ///
     std::deque<std::shared_ptr<PendingTransaction>> pendingCommands_;
+
+    /// The number of instances we may have in flight as leader
+    int window_ = 1;
+
+    /// The last instance we have discarded from the log. We can't
+    /// take part in instances up to this one.
+    std::int64_t truncatedInstance_ = 0;
+    std::int64_t logRetain_ = LOG_RETAIN_INSTANCES;
+    std::int64_t logTruncateInterval_ = LOG_TRUNCATE_INTERVAL;
+
+    /// Flushes the database before discarding log entries. While
+    /// truncating_ is set, a flush is in progress.
+    std::thread truncateThread_;
+    bool truncating_ = false;
+
+    /// Snapshots we are sending to peers, indexed by peer
+    std::unordered_map<UUID, std::unique_ptr<SnapshotSender>> senders_;
+
+    /// If we are fetching a snapshot from a peer, this tracks our
+    /// progress. While it is set, we don't apply any commands.
+    std::unique_ptr<SnapshotReceiver> receiver_;
+
+    /// True while clearState is removing our application data. We
+    /// ignore snapshot chunks until it finishes.
+    bool clearing_ = false;
+
+    /// If we are streaming chosen values from a peer, this tracks our
+    /// progress
+    std::unique_ptr<CatchupState> catchup_;
+
+    /// Log entries from this instance onwards hold the chosen value
+    /// once applied so we can send them to peers which are catching
+    /// up. Entries written before we kept this guarantee may hold a
+    /// losing vote.
+    std::int64_t chosenFrom_ = 1;
+
+    /// The instance at which catchup last failed. We don't try again
+    /// until we have recovered past it.
+    std::int64_t catchupFailed_ = 0;
+
+    /// Our transactions for instances which have been chosen but not
+    /// yet applied. Instances may be chosen out of order when
+    /// pipelined so we wait until they are applied before completing
+    /// the transactions.
+    std::map<std::int64_t,
+             std::vector<std::shared_ptr<PendingTransaction>>> chosen_;
 };
 
 /// A specialisation of Replica which uses the replicated log to implement a
@@ -539,13 +925,27 @@ public:
     // Replica overrides
     void apply(
         std::int64_t instance, const std::vector<uint8_t>& command) override;
+    bool applyTo(
+        const std::vector<uint8_t>& command,
+        keyval::Transaction* trans) override;
     void leaderChanged() override;
+    bool merge(
+        std::vector<uint8_t>& batch,
+        const std::vector<uint8_t>& command) override;
 
     // Database overrides
     std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
     std::unique_ptr<Transaction> beginTransaction() override;
     void commit(std::unique_ptr<Transaction>&& transaction) override;
+    void commitAsync(
+        std::unique_ptr<Transaction>&& transaction,
+        std::function<void(std::exception_ptr)> cb) override;
     void flush() override;
+    std::shared_ptr<Snapshot> snapshot() override
+    {
+        // Snapshots read the local replica state directly
+        return db_->snapshot();
+    }
     bool isReplicated() override { return true; }
     bool isMaster() override { return isLeader_; }
     bool get(
@@ -554,6 +954,11 @@ public:
     void onMasterChange(std::function<void(bool)> cb) override;
     void setAppData(const std::vector<uint8_t>& data) override;
     std::vector<ReplicaInfo> getReplicas() override;
+    std::shared_ptr<DatabaseStats> stats() override
+    {
+        // Reads and local commits are counted by the replica state
+        return db_->stats();
+    }
 
     std::shared_ptr<Buffer> toBuffer(const std::vector<uint8_t>& vec)
     {
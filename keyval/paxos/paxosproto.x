@@ -50,6 +50,7 @@ struct PROMISEargs {
     PaxosRound i;               /* paxos round number */
     PaxosRound vrnd;            /* highest round which sender has voted in */
     PaxosCommand vval;          /* value sender voted for in round vrnd */
+    bool all;                   /* promise also covers all later instances */
 };
 
 struct ACCEPTargs {
@@ -65,6 +66,52 @@ struct NACKargs {
     PaxosRound i;               /* paxos round number */
 };
 
+struct TRUNCATEDargs {
+    UUID uuid;                  /* identity of sender */
+    hyper instance;             /* sender's log starts after this instance */
+};
+
+struct FETCHargs {
+    UUID uuid;                  /* identity of sender */
+    UUID peer;                  /* replica which should send the snapshot */
+    hyper seq;                  /* next chunk the sender expects */
+    bool resend;                /* resend any chunks from seq onwards */
+};
+
+struct CHUNKargs {
+    UUID uuid;                  /* identity of sender */
+    UUID peer;                  /* replica which requested the snapshot */
+    hyper instance;             /* instance the snapshot was taken at */
+    hyper seq;                  /* chunk sequence number */
+    opaque data<>;              /* part of the snapshot entry stream */
+    bool last;                  /* true for the last chunk of the snapshot */
+};
+
+struct CATCHUPargs {
+    UUID uuid;                  /* identity of sender */
+    UUID peer;                  /* replica which should send the values */
+    hyper start;                /* first instance wanted */
+    hyper end;                  /* instance after the last one wanted */
+};
+
+struct CHOSENargs {
+    UUID uuid;                  /* identity of sender */
+    UUID peer;                  /* replica which requested the values */
+    hyper start;                /* instance of the first value */
+    PaxosCommand values<>;      /* chosen values for consecutive instances */
+    bool last;                  /* true for the last batch of this reply */
+};
+
+/*
+ * A snapshot is sent as a stream of entries, each preceded by its
+ * encoded size. Chunks split the stream at arbitrary points.
+ */
+struct SnapshotEntry {
+    string ns<>;
+    opaque key<>;
+    opaque value<>;
+};
+
 /*
  * The Paxos network protocol.
  *
@@ -124,6 +171,12 @@ program PAXOS {
          * Note: as an optimization, we modify this so that the acceptor
          * sends a nack message with the highest round that it has
          * promised so far.
+         *
+         * If a has not voted in any instance after this one, it also
+         * promises round i for all later instances and sets the all
+         * flag in its reply. A coordinator which receives such
+         * promises from a majority of the acceptors may skip phase 1
+         * for later instances until it sees a higher round.
          */
         oneway PAXOSPROC_PROMISE(PROMISEargs) = 3;
 
@@ -164,6 +217,39 @@ program PAXOS {
          * round which is older than the last one we responded to.
          */
         oneway PAXOSPROC_NACK(NACKargs) = 6;
+
+        /*
+         * Replicas periodically discard log entries for old
+         * instances. This is the response to prepare or accept for
+         * an instance which the acceptor no longer has a record of -
+         * the sender should recover by fetching a snapshot.
+         */
+        oneway PAXOSPROC_TRUNCATED(TRUNCATEDargs) = 7;
+
+        /*
+         * Ask a peer to send a snapshot of its database, starting
+         * with chunk seq. This also acknowledges all chunks before
+         * seq. A request with seq 0 starts a new snapshot.
+         */
+        oneway PAXOSPROC_FETCH(FETCHargs) = 8;
+
+        /*
+         * Part of a snapshot sent in response to fetch.
+         */
+        oneway PAXOSPROC_CHUNK(CHUNKargs) = 9;
+
+        /*
+         * Ask a peer for the values chosen for a range of instances
+         * which we have missed. The peer replies with a sequence of
+         * chosen messages covering some prefix of the range, limited
+         * by the instances it has applied.
+         */
+        oneway PAXOSPROC_CATCHUP(CATCHUPargs) = 10;
+
+        /*
+         * A batch of chosen values sent in response to catchup.
+         */
+        oneway PAXOSPROC_CHOSEN(CHOSENargs) = 11;
     } = 1;
 
 } = 0x20160816;
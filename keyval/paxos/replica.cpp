@@ -24,6 +24,7 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <iomanip>
@@ -117,8 +118,7 @@ Replica::Replica(
       db_(db),
       status_(STATUS_HEALTHY),
       leader_(UUID::null),
-      isLeader_(false),
-      newLeader_(false)
+      isLeader_(false)
 {
     // We use the PaxosLog namespace to record the state of the
     // distributed consensus. Keys are XDR-encoded instance numbers
@@ -157,6 +157,69 @@ Replica::Replica(
     catch (std::system_error& e) {
     }
 
+    // Read the last instance we have discarded from the log
+    try {
+        auto val = meta_->get(std::make_shared<Buffer>("truncated"));
+        oncrpc::XdrMemory xmv(val->data(), val->size());
+        xdr(truncatedInstance_, static_cast<oncrpc::XdrSource*>(&xmv));
+    }
+    catch (std::system_error& e) {
+    }
+
+    // Log entries for instances from chosenFrom_ onwards hold the
+    // chosen value once applied. Older entries may hold a losing vote
+    // so if this is the first time we have run with this guarantee,
+    // start it after the last applied instance.
+    try {
+        auto val = meta_->get(std::make_shared<Buffer>("chosen"));
+        oncrpc::XdrMemory xmv(val->data(), val->size());
+        xdr(chosenFrom_, static_cast<oncrpc::XdrSource*>(&xmv));
+    }
+    catch (std::system_error& e) {
+        chosenFrom_ = appliedInstance_ + 1;
+        auto val = std::make_shared<Buffer>(oncrpc::XdrSizeof(chosenFrom_));
+        oncrpc::XdrMemory xmv(val->data(), val->size());
+        xdr(chosenFrom_, static_cast<oncrpc::XdrSink*>(&xmv));
+        auto trans = db_->beginTransaction();
+        trans->put(meta_, std::make_shared<Buffer>("chosen"), val);
+        db_->commit(std::move(trans));
+    }
+
+    // If we crashed while installing a snapshot, our state is
+    // incomplete. Discard it and recover from scratch.
+    try {
+        meta_->get(std::make_shared<Buffer>("fetching"));
+        LOG(INFO) << "discarding incomplete snapshot";
+        std::unique_lock<std::mutex> lk(mutex_);
+        clearState(lk);
+        auto trans = db_->beginTransaction();
+        trans->remove(meta_, std::make_shared<Buffer>("fetching"));
+        db_->commit(std::move(trans));
+    }
+    catch (std::system_error& e) {
+    }
+
+    // Read any promise we made which covers all future instances
+    try {
+        auto val = meta_->get(std::make_shared<Buffer>("promise"));
+        oncrpc::XdrMemory xmv(val->data(), val->size());
+        xdr(promisedInstance_, static_cast<oncrpc::XdrSource*>(&xmv));
+        xdr(promisedRnd_, static_cast<oncrpc::XdrSource*>(&xmv));
+    }
+    catch (std::system_error& e) {
+    }
+
+    // We don't know which log entries have votes so be conservative
+    // and assume we may have voted in the last one
+    auto it = log_->iterator();
+    it->seekToLast();
+    if (it->valid()) {
+        auto key = it->key();
+        oncrpc::XdrMemory xmk(key->data(), key->size());
+        xdr(maxVoted_, static_cast<oncrpc::XdrSource*>(&xmk));
+    }
+    it.reset();
+
     LOG(INFO) << "uuid: " << uuid_
               << ": last applied instance " << appliedInstance_;
 
@@ -228,7 +291,15 @@ Replica::Replica(
 
 Replica::~Replica()
 {
+    if (truncateThread_.joinable())
+        truncateThread_.join();
     tman_->cancel(identityTimer_);
+    if (batchTimer_)
+        tman_->cancel(batchTimer_);
+    if (receiver_ && receiver_->timer)
+        tman_->cancel(receiver_->timer);
+    if (catchup_ && catchup_->timer)
+        tman_->cancel(catchup_->timer);
     for (auto& entry: proposerState_) {
         auto pp = entry.second.get();
         if (pp->prepareTimer)
@@ -272,18 +343,41 @@ void Replica::prepare(const PREPAREargs& args)
         VLOG(2) << instance
                 << ": from: " << args.uuid
                 << ": prepare " << i;
+    if (instance <= truncatedInstance_) {
+        // We no longer have a record of this instance - the peer
+        // must fetch a snapshot to catch up
+        VLOG(2) << instance << ": sending truncated " << truncatedInstance_;
+        proto_->truncated({uuid_, truncatedInstance_});
+        return;
+    }
     auto ap = findAcceptorState(lk, instance, true);
-    if (i > ap->rnd) {
+    auto rnd = promisedRound(lk, ap.get());
+    if (i > ap->rnd && i >= rnd) {
         if (instance > maxInstance_)
             setLeader(lk, args.uuid);
-        if (VLOG_IS_ON(2))
-            VLOG(2) << instance << ": sending promise " << i;
+        if (i > stableRnd_)
+            stableRnd_ = PaxosRound{0};
         ap->rnd = i;
         saveAcceptorState(lk, ap);
-        proto_->promise({uuid_, instance, i, ap->vrnd, ap->vval});
-    } else if (i != ap->rnd) {
-        VLOG(2) << instance << ": sending nack " << ap->rnd;
-        proto_->nack({uuid_, instance, ap->rnd});
+
+        // If we haven't voted in any later instance, there is
+        // nothing the proposer needs to learn about those instances
+        // so we can promise this round for all of them
+        bool all = false;
+        if (instance >= maxVoted_ && i >= promisedRnd_) {
+            if (promisedRnd_ == PaxosRound{0} || instance < promisedInstance_)
+                promisedInstance_ = instance;
+            promisedRnd_ = i;
+            savePromise(lk);
+            all = true;
+        }
+        if (VLOG_IS_ON(2))
+            VLOG(2) << instance << ": sending promise " << i
+                    << (all ? " for all later instances" : "");
+        proto_->promise({uuid_, instance, i, ap->vrnd, ap->vval, all});
+    } else if (i != rnd) {
+        VLOG(2) << instance << ": sending nack " << rnd;
+        proto_->nack({uuid_, instance, rnd});
     }
 }
 
@@ -302,6 +396,8 @@ void Replica::promise(const PROMISEargs& args)
 
     if (pp->state == ProposerState::PHASE1 && i == pp->crnd) {
         pp->promisers.insert(args.uuid);
+        if (args.all)
+            pp->allPromisers.insert(args.uuid);
 
         if (pp->log)
             LOG(INFO) << instance
@@ -317,6 +413,14 @@ void Replica::promise(const PROMISEargs& args)
             assert(vrnd > PaxosRound{0});
             pp->largestVrnd = vrnd;
             pp->cval = vval;
+
+            // If we already chose a value for this instance, it has
+            // been superseded so our commands must wait for a later
+            // instance
+            while (pp->transactions.size() > 0) {
+                pendingCommands_.push_front(pp->transactions.back());
+                pp->transactions.pop_back();
+            }
         }
 
         if (pp->promisers.size() >= quorum()) {
@@ -328,6 +432,18 @@ void Replica::promise(const PROMISEargs& args)
             tman_->cancel(pp->prepareTimer);
             pp->prepareTimer = 0;
 
+            // If every acceptor in the quorum also promised this
+            // round for all later instances, we can skip phase 1 for
+            // those instances until we see a higher round
+            if (pp->allPromisers.size() >= quorum() &&
+                status_ != STATUS_RECOVERING) {
+                if (pp->log || stableRnd_ != pp->crnd)
+                    LOG(INFO) << instance
+                              << ": stable round " << pp->crnd;
+                stableRnd_ = pp->crnd;
+                stableInstance_ = instance;
+            }
+
             // If a value was voted on in some previous round, we must use
             // that value otherwise we take the next command from our pending
             // list as the value. If we have no pending commands, just execute
@@ -337,15 +453,10 @@ void Replica::promise(const PROMISEargs& args)
                 // value suggested by one of our peers. If none of
                 // them have a value, this must be an empty
                 // transaction.
-                if (status_ != STATUS_RECOVERING &&
-                    pendingCommands_.size() > 0) {
-                    pp->transaction = pendingCommands_.front();
-                    pendingCommands_.pop_front();
-                    pp->cval = pp->transaction->value();
-                }
-                else {
+                if (status_ != STATUS_RECOVERING)
+                    takeCommands(lk, pp);
+                else
                     pp->cval = {};
-                }
                 pp->largestVrnd = pp->crnd;
             }
             sendAccept(lk, pp);
@@ -360,8 +471,13 @@ void Replica::accept(const ACCEPTargs& args)
     auto& i = args.i;
     auto& v = args.v;
 
+    if (instance <= truncatedInstance_) {
+        proto_->truncated({uuid_, truncatedInstance_});
+        return;
+    }
     auto ap = findAcceptorState(lk, instance, true);
-    if (i >= ap->rnd && i != ap->vrnd) {
+    auto rnd = promisedRound(lk, ap.get());
+    if (i >= rnd && i != ap->vrnd) {
         if (VLOG_IS_ON(2))
             LOG(INFO) << instance
                       << ": from: " << args.uuid
@@ -370,6 +486,17 @@ void Replica::accept(const ACCEPTargs& args)
         updateLeaderTimer(lk);
         if (instance > maxInstance_) {
             setLeader(lk, args.uuid);
+
+            // A pipelined leader may have several instances in
+            // flight so if we skipped some, their accept messages are
+            // probably just delayed
+            if (instance - maxInstance_ <= MAX_WINDOW) {
+                for (auto j = maxInstance_ + 1; j < instance; j++) {
+                    auto lp = findLearnerState(lk, j, true);
+                    if (!lp->value)
+                        lp->gap = true;
+                }
+            }
             maxInstance_ = instance;
         }
 
@@ -378,6 +505,10 @@ void Replica::accept(const ACCEPTargs& args)
         // this one
         findLearnerState(lk, instance, true);
 
+        if (i > stableRnd_)
+            stableRnd_ = PaxosRound{0};
+        if (instance > maxVoted_)
+            maxVoted_ = instance;
         ap->rnd = i;
         ap->vrnd = i;
         ap->vval = v;
@@ -387,7 +518,7 @@ void Replica::accept(const ACCEPTargs& args)
         saveAcceptorState(lk, ap);
         proto_->accepted({uuid_, instance, i, ap->vval});
     } else {
-        proto_->nack({uuid_, instance, ap->rnd});
+        proto_->nack({uuid_, instance, rnd});
     }
 }
 
@@ -408,6 +539,7 @@ void Replica::accepted(const ACCEPTargs& args)
 
     auto pp = findProposerState(lk, instance, false);
     auto lp = findLearnerState(lk, instance, true);
+    std::vector<std::shared_ptr<PendingTransaction>> completed;
     auto it = lp->acceptors.find(args.uuid);
     if (it == lp->acceptors.end()) {
         lp->values[v]++;
@@ -448,12 +580,6 @@ void Replica::accepted(const ACCEPTargs& args)
         // and inform the client
         if (pp) {
             if (isLeader_) {
-                // Clear the newLeader flag if there was no conflict with
-                // some other proposer
-                if (pp->nackCount == 0) {
-                    newLeader_ = false;
-                }
-
                 // Reset the lease timer since we have successfully
                 // executed a transaction
                 updateLeaseTimer(lk);
@@ -467,20 +593,44 @@ void Replica::accepted(const ACCEPTargs& args)
                 tman_->cancel(pp->prepareTimer);
                 pp->prepareTimer = 0;
             }
-            if (pp->transaction) {
-                pp->transaction->complete();
-                pp->transaction.reset();
+            // Instances may be chosen out of order so don't complete
+            // the transactions until this instance is applied. If a
+            // competing proposer's value was chosen instead of ours,
+            // our commands must wait for a later instance.
+            if (*value == pp->cval) {
+                if (pp->transactions.size() > 0)
+                    chosen_[instance] = std::move(pp->transactions);
+            }
+            else {
+                if (pp->log || VLOG_IS_ON(2))
+                    LOG(INFO) << instance << ": our value was superseded";
+                pendingCommands_.insert(
+                    pendingCommands_.begin(),
+                    pp->transactions.begin(), pp->transactions.end());
             }
             proposerState_.erase(instance);
         }
 
         bool sync = applyCommands(lk);
+        if (sync)
+            truncateLog(lk);
+
+        // Defer completing transactions until we drop the lock since
+        // their callbacks may start new transactions
+        while (chosen_.size() > 0 &&
+               chosen_.begin()->first <= appliedInstance_) {
+            auto& trans = chosen_.begin()->second;
+            completed.insert(completed.end(), trans.begin(), trans.end());
+            chosen_.erase(chosen_.begin());
+        }
 
-        // If we are leader and still have commands pending start a
-        // new round to try and get them executed
-        if (isLeader_ && pendingCommands_.size() > 0 &&
-            proposerState_.size() == 0) {
-            startNewInstance(lk, maxInstance_ + 1);
+        // If we still have commands pending start new instances to
+        // try and get them executed. These may have been waiting for
+        // this instance so that they can be merged into a single
+        // batch.
+        while (pendingCommands_.size() > 0 &&
+               int(proposerState_.size()) < pipelineWindow(lk)) {
+            startNewInstance(lk, nextInstance(lk));
         }
 
         if (sync && status_ == STATUS_RECOVERING) {
@@ -492,6 +642,12 @@ void Replica::accepted(const ACCEPTargs& args)
         }
 
         progress_.notify_all();
+
+        if (completed.size() > 0) {
+            lk.unlock();
+            for (auto& trans: completed)
+                trans->complete();
+        }
     }
 }
 
@@ -511,6 +667,10 @@ void Replica::nack(const NACKargs& args)
                       << ": current crnd " << pp->crnd;
         }
         if (pp->crnd.gen > 0 && i > pp->crnd) {
+            // Some other proposer has a higher round so we must run
+            // phase 1 for new instances
+            if (i > stableRnd_)
+                stableRnd_ = PaxosRound{0};
             pp->nackCount++;
             pp->crnd = PaxosRound{i.gen + 1, uuid_};
             sendPrepare(lk, pp);
@@ -522,25 +682,52 @@ std::shared_ptr<PendingTransaction> Replica::execute(
         const std::vector<uint8_t>& command)
 {
     // Must be small enough for a single UDP packet
-    if (command.size() > 1400)
+    if (command.size() > MAX_COMMAND_SIZE)
         LOG(FATAL) << "paxos transaction too large {"
                    << command.size() << " bytes}";
 
     std::unique_lock<std::mutex> lk(mutex_);
     auto trans = std::make_shared<PendingTransaction>(command);
     pendingCommands_.push_back(trans);
-    auto pp = startNewInstance(lk, maxInstance_ + 1);
+
+    // If we already have as many instances in flight as we are
+    // allowed, let the command wait for one to complete so that it
+    // can share the next instance with any other commands which
+    // arrive in the meantime
+    if (int(proposerState_.size()) >= pipelineWindow(lk) &&
+        int(pendingCommands_.size()) < MAX_BATCH_COMMANDS) {
+        if (!batchTimer_) {
+            batchTimer_ = tman_->add(
+                clock_->now() + MAX_BATCH_DELAY,
+                [this]() {
+                    std::unique_lock<std::mutex> lk2(mutex_);
+                    batchTimer_ = 0;
+                    if (pendingCommands_.size() > 0)
+                        startNewInstance(lk2, nextInstance(lk2));
+                });
+        }
+        VLOG(2) << "deferring command until the next batch";
+        return trans;
+    }
+
+    auto pp = startNewInstance(lk, nextInstance(lk));
     VLOG(2) << pp->instance
             << ": executing command in new instance";
     return trans;
 }
 
+void Replica::setWindow(int window)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+    window_ = std::max(1, std::min(window, MAX_WINDOW));
+}
+
 void Replica::forceLeader()
 {
     std::unique_lock<std::mutex> lk(mutex_);
     leader_ = uuid_;
     isLeader_ = true;
-    newLeader_ = true;
+    stableRnd_ = PaxosRound{0};
     updateLeaseTimer(lk);
 }
 
@@ -623,25 +810,21 @@ ProposerState* Replica::startNewInstance(
     auto pp = findProposerState(lk, instance, true);
     if (pp->state == ProposerState::INIT) {
         assert(pp->crnd == PaxosRound{0});
-        if (!isLeader_ || newLeader_) {
+        if (!isLeader_ || stableRnd_ == PaxosRound{0} ||
+            instance <= stableInstance_) {
             // If we are a follower trying to catch up or if we have
-            // only just become leader, run the full protocol
+            // not yet completed phase 1 for all future instances, run
+            // the full protocol
             pp->crnd = PaxosRound{1, uuid_};
             sendPrepare(lk, pp);
             lk.lock();
         }
         else {
-            // Otherwise just send accept right away with the value of
-            // our choice
-            pp->crnd = crnd_;
-            if (pendingCommands_.size() > 0) {
-                pp->transaction = pendingCommands_.front();
-                pendingCommands_.pop_front();
-                pp->cval = pp->transaction->value();
-            }
-            else {
-                pp->cval = {};
-            }
+            // Otherwise a quorum has already promised stableRnd_ for
+            // this instance so just send accept right away with the
+            // value of our choice
+            pp->crnd = stableRnd_;
+            takeCommands(lk, pp);
             pp->largestVrnd = pp->crnd;
             sendAccept(lk, pp);
             lk.lock();
@@ -650,6 +833,46 @@ ProposerState* Replica::startNewInstance(
     return pp;
 }
 
+std::int64_t Replica::nextInstance(std::unique_lock<std::mutex>& lk)
+{
+    auto instance = maxInstance_;
+    for (auto& entry: proposerState_)
+        instance = std::max(instance, entry.first);
+    return instance + 1;
+}
+
+int Replica::pipelineWindow(std::unique_lock<std::mutex>& lk)
+{
+    if (isLeader_ && stableRnd_ != PaxosRound{0})
+        return window_;
+    return 1;
+}
+
+void Replica::takeCommands(std::unique_lock<std::mutex>& lk, ProposerState* pp)
+{
+    pp->cval = {};
+    pp->transactions.clear();
+    while (pendingCommands_.size() > 0 &&
+           int(pp->transactions.size()) < MAX_BATCH_COMMANDS) {
+        auto& trans = pendingCommands_.front();
+        if (pp->transactions.size() == 0) {
+            pp->cval = trans->value();
+        }
+        else {
+            auto& value = trans->value();
+            if (pp->cval.size() + value.size() > MAX_COMMAND_SIZE ||
+                !merge(pp->cval, value))
+                break;
+        }
+        pp->transactions.push_back(trans);
+        pendingCommands_.pop_front();
+    }
+    if (pp->transactions.size() > 1)
+        VLOG(2) << pp->instance << ": merged "
+                << pp->transactions.size() << " commands"
+                << " {" << pp->cval.size() << " bytes}";
+}
+
 void Replica::sendIdentity(std::unique_lock<std::mutex>& lk)
 {
     if (VLOG_IS_ON(3)) {
@@ -707,7 +930,7 @@ void Replica::sendPrepare(std::unique_lock<std::mutex>& lk, ProposerState* pp)
             });
     pp->state = ProposerState::PHASE1;
     pp->promisers.clear();
-    crnd_ = pp->crnd;
+    pp->allPromisers.clear();
     lk.unlock();
     proto_->prepare({uuid_, pp->instance, pp->crnd});
 }
@@ -777,12 +1000,13 @@ void Replica::updatePeers(std::unique_lock<std::mutex>& lk)
                 p.second.status = STATUS_DEAD;
                 logPeer(p.second);
             }
+            senders_.erase(p.first);
         }
     }
     if (peers() != oldPeerCount) {
         // Make sure we run the full protocol when the peer group
         // changes
-        newLeader_ = true;
+        stableRnd_ = PaxosRound{0};
         if (peers() < quorum())
             LOG(INFO) << "peer count " << peers() << ": not a quorum";
         else
@@ -809,7 +1033,8 @@ void Replica::setLeader(std::unique_lock<std::mutex>& lk, const UUID& id)
         auto wasLeader = isLeader_;
         leader_ = id;
         isLeader_ = (leader_ == uuid_);
-        newLeader_ = true;
+        if (!isLeader_)
+            stableRnd_ = PaxosRound{0};
         if (isLeader_ != wasLeader) {
             if (isLeader_) {
                 LOG(INFO) << "becoming leader";
@@ -838,7 +1063,7 @@ void Replica::updateLeaderTimer(std::unique_lock<std::mutex>& lk)
             [this]() {
                 LOG(INFO) << "leadership timeout";
                 std::unique_lock<std::mutex> lk2(mutex_);
-                startNewInstance(lk2, maxInstance_ + 1);
+                startNewInstance(lk2, nextInstance(lk2));
             });
 }
 
@@ -858,17 +1083,34 @@ void Replica::updateLeaseTimer(std::unique_lock<std::mutex>& lk)
                 if (pendingCommands_.size() > 0 && proposerState_.size() == 0)
                     LOG(FATAL) << "pending commands but no active instances";
 
-                startNewInstance(lk2, maxInstance_ + 1);
+                startNewInstance(lk2, nextInstance(lk2));
             });
 }
 
 bool Replica::applyCommands(std::unique_lock<std::mutex>& lk)
 {
+    // Our state is incomplete while we are installing a snapshot
+    if (receiver_)
+        return false;
+
     auto now = clock_->now();
     while (appliedInstance_ < maxInstance_) {
         auto instance = appliedInstance_ + 1;
         auto lp = findLearnerState(lk, instance, false);
-        if (!lp || (!lp->value && (now - lp->time) > 10*LEADER_WAIT_TIME)) {
+        auto timeout = (lp && lp->gap) ? rtt_ : 10*LEADER_WAIT_TIME;
+
+        // If we are proposing this instance ourselves, our re-send
+        // timers will take care of any lost messages
+        auto pp = findProposerState(lk, instance, false);
+        if (pp && (!lp || !lp->value))
+            return false;
+
+        if (!lp || (!lp->value && (now - lp->time) > timeout)) {
+            // If we are already streaming the missing values from a
+            // peer, wait for them to arrive
+            if (catchup_)
+                return false;
+
             // If we don't have a learner state entry for the next
             // instance to apply or if the state we do have is too
             // old, attempt to recover the gap. Note: since we are
@@ -892,23 +1134,13 @@ bool Replica::applyCommands(std::unique_lock<std::mutex>& lk)
                 // certainly not us.
                 setLeader(lk, UUID::null);
             }
-            startNewInstance(lk, instance);
+            if (!startCatchup(lk))
+                startNewInstance(lk, instance);
             sendIdentity(lk);
             return false;
         }
         if (!lp->applied && lp->value) {
-            if (lp->value->size() > 0) {
-                apply(instance, *lp->value);
-            }
-            else {
-                VLOG(2) << instance
-                        << ": empty command - not applying";
-
-                // We do need to write the instance number
-                auto trans = db()->beginTransaction();
-                saveInstance(instance, trans.get());
-                db()->commit(std::move(trans));
-            }
+            applyValue(lk, instance, *lp->value);
             lp->applied = true;
             learnerState_.erase(instance);
             appliedInstance_++;
@@ -920,20 +1152,70 @@ bool Replica::applyCommands(std::unique_lock<std::mutex>& lk)
     return true;
 }
 
+PaxosRound Replica::promisedRound(
+    std::unique_lock<std::mutex>& lk, const AcceptorState* ap)
+{
+    if (ap->instance >= promisedInstance_ && promisedRnd_ > ap->rnd)
+        return promisedRnd_;
+    return ap->rnd;
+}
+
 void Replica::saveAcceptorState(
     std::unique_lock<std::mutex>& lk, std::shared_ptr<AcceptorState> ap)
 {
-    auto key = std::make_shared<Buffer>(oncrpc::XdrSizeof(ap->instance));
-    oncrpc::XdrMemory xmk(key->data(), key->size());
-    xdr(ap->instance, static_cast<oncrpc::XdrSink*>(&xmk));
+    auto trans = db_->beginTransaction();
+    putAcceptorState(ap.get(), trans.get());
+    db_->commit(std::move(trans));
+}
 
+void Replica::putAcceptorState(AcceptorState* ap, Transaction* trans)
+{
     auto val = std::make_shared<Buffer>(oncrpc::XdrSizeof(*ap));
     oncrpc::XdrMemory xmv(val->data(), val->size());
     xdr(*ap, static_cast<oncrpc::XdrSink*>(&xmv));
+    trans->put(log_, instanceKey(ap->instance), val);
+}
 
+void Replica::applyValue(
+    std::unique_lock<std::mutex>& lk, std::int64_t instance,
+    const PaxosCommand& value)
+{
     auto trans = db_->beginTransaction();
-    trans->put(log_, key, val);
-    db_->commit(std::move(trans));
+    recordChosen(lk, instance, value, trans.get());
+    if (value.size() == 0 || applyTo(value, trans.get())) {
+        if (value.size() == 0)
+            VLOG(2) << instance << ": empty command - not applying";
+
+        // We do need to write the instance number
+        saveInstance(instance, trans.get());
+        db_->commit(std::move(trans));
+    }
+    else {
+        // The derived class applies the command in its own
+        // transaction
+        db_->commit(std::move(trans));
+        apply(instance, value);
+    }
+}
+
+void Replica::recordChosen(
+    std::unique_lock<std::mutex>& lk, std::int64_t instance,
+    const PaxosCommand& value, Transaction* trans)
+{
+    // If we voted for a different value in an earlier round or
+    // didn't vote at all, replace our vote with the chosen value. This
+    // is safe since any proposer which sees it must propose the chosen
+    // value in any case. If we didn't vote, we use the lowest possible
+    // round so that any real vote takes precedence.
+    auto ap = findAcceptorState(lk, instance, true);
+    if (ap->vrnd != PaxosRound{0} && ap->vval == value)
+        return;
+    if (ap->vrnd == PaxosRound{0})
+        ap->vrnd = PaxosRound{1, UUID::null};
+    ap->vval = value;
+    if (instance > maxVoted_)
+        maxVoted_ = instance;
+    putAcceptorState(ap.get(), trans);
 }
 
 void Replica::saveInstance(std::int64_t instance, Transaction* trans)
@@ -943,3 +1225,76 @@ void Replica::saveInstance(std::int64_t instance, Transaction* trans)
     xdr(instance, static_cast<oncrpc::XdrSink*>(&xmv));
     trans->put(meta_, std::make_shared<Buffer>("instance"), val);
 }
+
+std::shared_ptr<Buffer> Replica::instanceKey(std::int64_t instance)
+{
+    auto key = std::make_shared<Buffer>(oncrpc::XdrSizeof(instance));
+    oncrpc::XdrMemory xmk(key->data(), key->size());
+    xdr(instance, static_cast<oncrpc::XdrSink*>(&xmk));
+    return key;
+}
+
+void Replica::truncateLog(std::unique_lock<std::mutex>& lk)
+{
+    auto instance = appliedInstance_ - logRetain_;
+    if (truncating_ || instance - truncatedInstance_ < logTruncateInterval_)
+        return;
+
+    // Make sure the state we have applied is on stable storage
+    // before discarding the log entries which could re-create it.
+    // Flushing can take a long time so we do it without the lock. The
+    // previous thread has finished with the lock if truncating_ is
+    // clear.
+    if (truncateThread_.joinable())
+        truncateThread_.join();
+    truncating_ = true;
+    truncateThread_ = std::thread(
+        [this, instance]() {
+            db_->flush();
+
+            std::unique_lock<std::mutex> lk(mutex_);
+            truncating_ = false;
+
+            // If we started receiving a snapshot while flushing, the
+            // state we flushed is gone and the log will be truncated
+            // when the snapshot is installed
+            if (receiver_ || instance <= truncatedInstance_)
+                return;
+
+            // Log keys are XDR-encoded so they sort in instance order
+            auto trans = db_->beginTransaction();
+            trans->removeRange(
+                log_, instanceKey(truncatedInstance_ + 1),
+                instanceKey(instance + 1));
+            for (auto i = truncatedInstance_ + 1; i <= instance; i++)
+                acceptorState_.remove(i);
+            auto val = std::make_shared<Buffer>(oncrpc::XdrSizeof(instance));
+            oncrpc::XdrMemory xmv(val->data(), val->size());
+            xdr(instance, static_cast<oncrpc::XdrSink*>(&xmv));
+            trans->put(meta_, std::make_shared<Buffer>("truncated"), val);
+            db_->commit(std::move(trans));
+
+            VLOG(1) << "truncated log to " << instance;
+            truncatedInstance_ = instance;
+        });
+}
+
+void Replica::setLogRetention(std::int64_t retain, std::int64_t interval)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+    logRetain_ = std::max(std::int64_t(0), retain);
+    logTruncateInterval_ = std::max(std::int64_t(1), interval);
+}
+
+void Replica::savePromise(std::unique_lock<std::mutex>& lk)
+{
+    auto val = std::make_shared<Buffer>(
+        oncrpc::XdrSizeof(promisedInstance_) + oncrpc::XdrSizeof(promisedRnd_));
+    oncrpc::XdrMemory xmv(val->data(), val->size());
+    xdr(promisedInstance_, static_cast<oncrpc::XdrSink*>(&xmv));
+    xdr(promisedRnd_, static_cast<oncrpc::XdrSink*>(&xmv));
+
+    auto trans = db_->beginTransaction();
+    trans->put(meta_, std::make_shared<Buffer>("promise"), val);
+    db_->commit(std::move(trans));
+}
@@ -0,0 +1,396 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <glog/logging.h>
+
+#include "paxos.h"
+
+using namespace keyval;
+using namespace keyval::paxos;
+
+static std::vector<uint8_t> toVector(std::shared_ptr<Buffer> buf)
+{
+    return std::vector<uint8_t>(buf->data(), buf->data() + buf->size());
+}
+
+static std::shared_ptr<Buffer> toBuffer(const std::vector<uint8_t>& vec)
+{
+    return std::make_shared<Buffer>(vec.size(), vec.data());
+}
+
+static bool isPaxosNamespace(const std::string& name)
+{
+    return name == "PaxosMeta" || name == "PaxosLog";
+}
+
+void Replica::truncated(const TRUNCATEDargs& args)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+
+    // If we are recovering and the peer has discarded the instances
+    // we need, the only way to catch up is to fetch a snapshot
+    if (status_ != STATUS_RECOVERING || receiver_ ||
+        args.instance <= appliedInstance_)
+        return;
+
+    LOG(INFO) << "peer " << args.uuid
+              << " has truncated its log to " << args.instance
+              << ": fetching snapshot";
+    if (catchup_)
+        abandonCatchup(lk);
+    startFetch(lk, args.uuid);
+}
+
+void Replica::fetch(const FETCHargs& args)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+
+    // Ignore requests for other replicas and don't send a snapshot if
+    // we are in the middle of receiving one ourselves
+    if (args.peer != uuid_ || receiver_)
+        return;
+
+    auto& sp = senders_[args.uuid];
+    if (!sp || (args.seq == 0 && sp->base > 0)) {
+        // The database is only modified with the lock held so the
+        // snapshot matches appliedInstance_
+        sp = std::make_unique<SnapshotSender>();
+        sp->peer = args.uuid;
+        sp->snapshot = db_->snapshot();
+        sp->instance = appliedInstance_;
+        for (auto& name: sp->snapshot->namespaces()) {
+            if (!isPaxosNamespace(name))
+                sp->namespaces.push_back(name);
+        }
+        LOG(INFO) << "sending snapshot at instance " << sp->instance
+                  << " to " << args.uuid;
+    }
+
+    // Ignore requests for chunks we have discarded or not yet sent
+    if (args.seq < sp->base || args.seq > sp->sent)
+        return;
+
+    // Discard the chunks the peer has acknowledged
+    while (sp->base < args.seq) {
+        sp->chunks.pop_front();
+        sp->base++;
+    }
+    if (args.resend)
+        sp->sent = args.seq;
+
+    fillChunks(lk, sp.get());
+    bool done = sp->exhausted && sp->pending.size() == 0;
+    if (done && sp->chunks.size() == 0) {
+        LOG(INFO) << "finished sending snapshot to " << args.uuid;
+        senders_.erase(args.uuid);
+        return;
+    }
+
+    std::vector<CHUNKargs> msgs;
+    auto end = sp->base + std::int64_t(sp->chunks.size());
+    while (sp->sent < end) {
+        auto seq = sp->sent++;
+        msgs.push_back(
+            CHUNKargs{
+                uuid_, sp->peer, sp->instance, seq,
+                sp->chunks[seq - sp->base],
+                done && seq == end - 1});
+    }
+    lk.unlock();
+    for (auto& msg: msgs)
+        proto_->chunk(msg);
+}
+
+void Replica::chunk(const CHUNKargs& args)
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+
+    auto rp = receiver_.get();
+    if (args.peer != uuid_ || !rp || args.uuid != rp->peer)
+        return;
+
+    // We only accept chunks in order - if we miss one, our fetch
+    // timer will ask for the rest to be re-sent
+    if (args.seq != rp->seq || clearing_)
+        return;
+
+    if (args.seq == 0) {
+        // Discard our current state, removing our instance record so
+        // that if we restart before the snapshot is complete, we
+        // start again from an empty database
+        LOG(INFO) << "receiving snapshot at instance " << args.instance
+                  << " from " << rp->peer;
+        auto trans = db_->beginTransaction();
+        trans->remove(meta_, std::make_shared<Buffer>("instance"));
+        trans->put(
+            meta_, std::make_shared<Buffer>("fetching"),
+            std::make_shared<Buffer>("true"));
+        db_->commit(std::move(trans));
+        clearState(lk);
+        rp->instance = args.instance;
+    }
+    else if (args.instance != rp->instance) {
+        return;
+    }
+
+    rp->timeouts = 0;
+    rp->buffer.insert(rp->buffer.end(), args.data.begin(), args.data.end());
+    applyChunk(lk, rp, args.last);
+    rp->seq++;
+
+    if (!args.last) {
+        sendFetch(lk, false);
+        return;
+    }
+
+    // Acknowledge the last chunk so that the peer can discard its
+    // state
+    FETCHargs ack{uuid_, rp->peer, rp->seq, false};
+    auto completed = finishFetch(lk);
+    lk.unlock();
+    proto_->fetch(ack);
+    for (auto& trans: completed)
+        trans->complete();
+}
+
+void Replica::clearState(std::unique_lock<std::mutex>& lk)
+{
+    // Removing a large database can take a long time so drop the
+    // lock. Nothing else modifies the application data while we are
+    // receiving a snapshot and further chunks wait for clearing_.
+    auto snapshot = db_->snapshot();
+    clearing_ = true;
+    lk.unlock();
+    for (auto& name: snapshot->namespaces()) {
+        if (isPaxosNamespace(name))
+            continue;
+        auto ns = db_->getNamespace(name);
+        auto trans = db_->beginTransaction();
+        int count = 0;
+        auto it = snapshot->getNamespace(name)->iterator();
+        for (; it->valid(); it->next()) {
+            trans->remove(ns, it->key());
+            if (++count == 1000) {
+                db_->commit(std::move(trans));
+                trans = db_->beginTransaction();
+                count = 0;
+            }
+        }
+        if (count > 0)
+            db_->commit(std::move(trans));
+    }
+    lk.lock();
+    clearing_ = false;
+}
+
+void Replica::startFetch(std::unique_lock<std::mutex>& lk, const UUID& peer)
+{
+    receiver_ = std::make_unique<SnapshotReceiver>();
+    receiver_->peer = peer;
+    sendFetch(lk, false);
+}
+
+void Replica::sendFetch(std::unique_lock<std::mutex>& lk, bool resend)
+{
+    auto rp = receiver_.get();
+    if (rp->timer)
+        tman_->cancel(rp->timer);
+    rp->timer = tman_->add(
+        clock_->now() + rtt_,
+        [this]() {
+            std::unique_lock<std::mutex> lk2(mutex_);
+            if (!receiver_)
+                return;
+            receiver_->timer = 0;
+
+            // Don't abandon or restart the transfer while clearState
+            // has dropped the lock - the chunk which started it
+            // re-arms the timer when it finishes
+            if (clearing_)
+                return;
+
+            // If the peer has gone away, give up - our recovery
+            // proposal will find another peer to fetch from
+            auto it = peers_.find(receiver_->peer);
+            if (it == peers_.end() || it->second.status == STATUS_DEAD) {
+                LOG(INFO) << "snapshot peer " << receiver_->peer
+                          << " is dead: abandoning snapshot";
+                receiver_.reset();
+                return;
+            }
+            LOG(INFO) << "snapshot fetch timeout";
+            if (++receiver_->timeouts == SNAPSHOT_MAX_TIMEOUTS) {
+                LOG(INFO) << "restarting snapshot transfer";
+                receiver_->seq = 0;
+                receiver_->buffer.clear();
+                receiver_->trans.reset();
+                receiver_->transBytes = 0;
+                receiver_->timeouts = 0;
+            }
+            sendFetch(lk2, true);
+        });
+    FETCHargs args{uuid_, rp->peer, rp->seq, resend};
+    lk.unlock();
+    proto_->fetch(args);
+}
+
+void Replica::fillChunks(std::unique_lock<std::mutex>& lk, SnapshotSender* sp)
+{
+    std::size_t pos = 0;
+    while (int(sp->chunks.size()) < SNAPSHOT_WINDOW) {
+        // Encode entries until we have enough for a chunk, each
+        // preceded by its size
+        while (!sp->exhausted &&
+               sp->pending.size() - pos < SNAPSHOT_CHUNK_SIZE) {
+            if (!sp->iterator) {
+                if (sp->namespaces.size() == 0) {
+                    sp->exhausted = true;
+                    break;
+                }
+                sp->iterator = sp->snapshot->getNamespace(
+                    sp->namespaces.front())->iterator();
+            }
+            if (!sp->iterator->valid()) {
+                sp->iterator.reset();
+                sp->namespaces.pop_front();
+                continue;
+            }
+            SnapshotEntry entry{
+                sp->namespaces.front(),
+                toVector(sp->iterator->key()),
+                toVector(sp->iterator->value())};
+            std::uint32_t len = oncrpc::XdrSizeof(entry);
+            auto off = sp->pending.size();
+            sp->pending.resize(off + sizeof(len) + len);
+            oncrpc::XdrMemory xm(
+                sp->pending.data() + off, sizeof(len) + len);
+            xdr(len, static_cast<oncrpc::XdrSink*>(&xm));
+            xdr(entry, static_cast<oncrpc::XdrSink*>(&xm));
+            sp->iterator->next();
+        }
+
+        auto n = std::min(SNAPSHOT_CHUNK_SIZE, sp->pending.size() - pos);
+        if (n == 0) {
+            // An empty snapshot still needs one chunk to tell the
+            // peer the instance number
+            if (sp->exhausted && sp->base == 0 && sp->chunks.size() == 0)
+                sp->chunks.emplace_back();
+            break;
+        }
+        sp->chunks.emplace_back(
+            sp->pending.begin() + pos, sp->pending.begin() + pos + n);
+        pos += n;
+    }
+    sp->pending.erase(sp->pending.begin(), sp->pending.begin() + pos);
+}
+
+void Replica::applyChunk(
+    std::unique_lock<std::mutex>& lk, SnapshotReceiver* rp, bool last)
+{
+    std::size_t pos = 0;
+    for (;;) {
+        std::uint32_t len;
+        if (rp->buffer.size() - pos < sizeof(len))
+            break;
+        oncrpc::XdrMemory xl(rp->buffer.data() + pos, sizeof(len));
+        xdr(len, static_cast<oncrpc::XdrSource*>(&xl));
+        if (rp->buffer.size() - pos - sizeof(len) < len)
+            break;
+        SnapshotEntry entry;
+        oncrpc::XdrMemory xm(rp->buffer.data() + pos + sizeof(len), len);
+        xdr(entry, static_cast<oncrpc::XdrSource*>(&xm));
+        if (!rp->trans)
+            rp->trans = db_->beginTransaction();
+        rp->trans->put(
+            db_->getNamespace(entry.ns),
+            toBuffer(entry.key), toBuffer(entry.value));
+        pos += sizeof(len) + len;
+        rp->transBytes += len;
+    }
+    rp->buffer.erase(rp->buffer.begin(), rp->buffer.begin() + pos);
+
+    // Entries are committed in batches spanning several chunks. If we
+    // restart before the snapshot is complete, we start again from an
+    // empty database so it doesn't matter that we have acknowledged
+    // chunks which are not yet committed.
+    if (rp->trans && (last || rp->transBytes >= SNAPSHOT_COMMIT_SIZE)) {
+        db_->commit(std::move(rp->trans));
+        rp->trans.reset();
+        rp->transBytes = 0;
+    }
+}
+
+std::vector<std::shared_ptr<PendingTransaction>> Replica::finishFetch(
+    std::unique_lock<std::mutex>& lk)
+{
+    auto instance = receiver_->instance;
+    if (receiver_->timer)
+        tman_->cancel(receiver_->timer);
+    receiver_.reset();
+
+    // Our log entries up to the snapshot instance are no longer
+    // useful to anyone so treat them as truncated
+    auto trans = db_->beginTransaction();
+    saveInstance(instance, trans.get());
+    trans->remove(meta_, std::make_shared<Buffer>("fetching"));
+    if (instance > truncatedInstance_) {
+        trans->removeRange(
+            log_, instanceKey(truncatedInstance_ + 1),
+            instanceKey(instance + 1));
+        std::vector<std::int64_t> stale;
+        for (auto& entry: acceptorState_)
+            if (entry.first <= instance)
+                stale.push_back(entry.first);
+        for (auto i: stale)
+            acceptorState_.remove(i);
+        auto val = std::make_shared<Buffer>(oncrpc::XdrSizeof(instance));
+        oncrpc::XdrMemory xmv(val->data(), val->size());
+        xdr(instance, static_cast<oncrpc::XdrSink*>(&xmv));
+        trans->put(meta_, std::make_shared<Buffer>("truncated"), val);
+        truncatedInstance_ = instance;
+    }
+    db_->commit(std::move(trans));
+    LOG(INFO) << "installed snapshot at instance " << instance;
+
+    auto completed = completeThrough(lk, instance);
+    appliedInstance_ = instance;
+    if (maxInstance_ < instance)
+        maxInstance_ = instance;
+
+    // Apply any later instances we learned while fetching. If there
+    // are still gaps, applyCommands starts recovering them and
+    // unlocks.
+    if (applyCommands(lk) && status_ == STATUS_RECOVERING) {
+        LOG(INFO) << "recovered to " << maxInstance_;
+        status_ = STATUS_HEALTHY;
+        sendIdentity(lk);
+    }
+    if (!lk.owns_lock())
+        lk.lock();
+    progress_.notify_all();
+    return completed;
+}
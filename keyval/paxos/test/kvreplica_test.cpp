@@ -99,11 +99,43 @@ struct KVReplicaTest: public ::testing::Test
             reinterpret_cast<const char*>(buf->data()), buf->size());
     }
 
+    /// Commit a transaction without waiting for it to complete
+    void commitAsync(
+        std::shared_ptr<KVReplica> replica,
+        std::unique_ptr<Transaction>&& trans)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        pending++;
+        lk.unlock();
+        replica->commitAsync(
+            std::move(trans),
+            [this](std::exception_ptr e) {
+                EXPECT_FALSE(e);
+                std::unique_lock<std::mutex> lk(mutex);
+                pending--;
+                cv.notify_one();
+            });
+    }
+
+    /// Wait for all transactions started with commitAsync to complete
+    /// then give the timeout thread an opportunity to drain
+    void waitAll()
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        while (pending > 0)
+            cv.wait(lk);
+        lk.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
     std::shared_ptr<util::MockClock> clock;
     std::shared_ptr<MyTimeoutManager> tman;
     std::shared_ptr<Reflector> reflector;
     std::vector<std::shared_ptr<KVReplica>> replicas;
     std::vector<std::shared_ptr<Database>> dbs;
+    std::mutex mutex;
+    std::condition_variable cv;
+    int pending = 0;
 
     PaxosCommand null = {};
 };
@@ -182,6 +214,128 @@ TEST_F(KVReplicaTest, Multiple)
     }
 }
 
+TEST_F(KVReplicaTest, CommitAsync)
+{
+    // Start a batch of transactions without waiting for each one and
+    // verify that they all complete
+    auto ns = replicas[0]->getNamespace("default");
+
+    constexpr int iterations = 100;
+
+    for (int i = 0; i < iterations; i++) {
+        auto trans = replicas[0]->beginTransaction();
+        trans->put(
+            ns, toBuffer("key" + std::to_string(i)),
+            toBuffer(std::to_string(i)));
+        commitAsync(replicas[0], std::move(trans));
+    }
+    waitAll();
+
+    for (int i = 0; i < iterations; i++) {
+        EXPECT_EQ(std::to_string(i),
+                  toString(ns->get(toBuffer("key" + std::to_string(i)))));
+    }
+}
+
+TEST_F(KVReplicaTest, BatchRemoveRange)
+{
+    // A range removal merged into a batch must only remove keys put
+    // by transactions committed before it, including earlier puts in
+    // its own transaction
+    auto ns = replicas[0]->getNamespace("default");
+
+    auto trans = replicas[0]->beginTransaction();
+    for (auto key: {"a", "b", "c", "d"})
+        trans->put(ns, toBuffer(key), toBuffer(key));
+    commitAsync(replicas[0], std::move(trans));
+
+    trans = replicas[0]->beginTransaction();
+    trans->put(ns, toBuffer("bb"), toBuffer("bb"));
+    trans->removeRange(ns, toBuffer("b"), toBuffer("d"));
+    trans->put(ns, toBuffer("bc"), toBuffer("bc"));
+    commitAsync(replicas[0], std::move(trans));
+
+    trans = replicas[0]->beginTransaction();
+    trans->put(ns, toBuffer("c"), toBuffer("lemon"));
+    commitAsync(replicas[0], std::move(trans));
+    waitAll();
+
+    for (int i = 0; i < int(dbs.size()); i++) {
+        auto dbns = dbs[i]->getNamespace("default");
+        std::string keys;
+        for (auto it = dbns->iterator(); it->valid(); it->next())
+            keys += toString(it->key()) + ",";
+        EXPECT_EQ("a,bc,c,d,", keys);
+        EXPECT_EQ("lemon", toString(dbns->get(toBuffer("c"))));
+    }
+}
+
+TEST_F(KVReplicaTest, Pipeline)
+{
+    // Transactions merged into batches and spread over concurrent
+    // instances must be applied in the order they were committed
+    for (auto replica: replicas)
+        replica->setWindow(8);
+    auto ns = replicas[0]->getNamespace("default");
+
+    constexpr int iterations = 100;
+
+    for (int i = 0; i < iterations; i++) {
+        auto trans = replicas[0]->beginTransaction();
+        if (i % 10 == 5)
+            trans->remove(ns, toBuffer("value"));
+        else
+            trans->put(ns, toBuffer("value"), toBuffer(std::to_string(i)));
+        commitAsync(replicas[0], std::move(trans));
+    }
+    waitAll();
+
+    std::string s = std::to_string(iterations - 1);
+    for (int i = 0; i < int(dbs.size()); i++) {
+        auto dbns = dbs[i]->getNamespace("default");
+        EXPECT_EQ(s, toString(dbns->get(toBuffer("value"))));
+    }
+}
+
+TEST_F(KVReplicaTest, CompetingProposer)
+{
+    // Two replicas proposing at the same time compete for the same
+    // instances. Every transaction must still be applied exactly once
+    // and all the replicas must agree on the result.
+    for (auto replica: replicas)
+        replica->setWindow(8);
+    auto ns0 = replicas[0]->getNamespace("default");
+    auto ns1 = replicas[1]->getNamespace("default");
+
+    constexpr int iterations = 50;
+
+    for (int i = 0; i < iterations; i++) {
+        auto trans = replicas[0]->beginTransaction();
+        trans->put(ns0, toBuffer("a" + std::to_string(i)), toBuffer("a"));
+        trans->put(ns0, toBuffer("value"), toBuffer("a"));
+        commitAsync(replicas[0], std::move(trans));
+
+        trans = replicas[1]->beginTransaction();
+        trans->put(ns1, toBuffer("b" + std::to_string(i)), toBuffer("b"));
+        trans->put(ns1, toBuffer("value"), toBuffer("b"));
+        commitAsync(replicas[1], std::move(trans));
+    }
+    waitAll();
+
+    auto value = toString(dbs[0]->getNamespace("default")->get(
+                              toBuffer("value")));
+    for (int i = 0; i < int(dbs.size()); i++) {
+        auto dbns = dbs[i]->getNamespace("default");
+        for (int j = 0; j < iterations; j++) {
+            EXPECT_EQ("a", toString(
+                          dbns->get(toBuffer("a" + std::to_string(j)))));
+            EXPECT_EQ("b", toString(
+                          dbns->get(toBuffer("b" + std::to_string(j)))));
+        }
+        EXPECT_EQ(value, toString(dbns->get(toBuffer("value"))));
+    }
+}
+
 TEST_F(KVReplicaTest, Catchup)
 {
     // Write a series of values to replicas[0] and verify that its
@@ -249,3 +403,44 @@ TEST_F(KVReplicaTest, Reboot)
         EXPECT_EQ(s, toString(ns->get(toBuffer("value"))));
     }
 }
+
+TEST_F(KVReplicaTest, Snapshot)
+{
+    // Keep only a short log so that a replica which misses enough
+    // instances must catch up by fetching a snapshot
+    for (auto replica: replicas)
+        replica->setLogRetention(5, 5);
+    auto ns = replicas[0]->getNamespace("default");
+
+    constexpr int iterations = 100;
+
+    for (int i = 0; i < iterations; i++) {
+        // Disable one replica on the 20th iteration and re-enable it
+        // on the 60th, by which time the others have discarded the
+        // instances it missed
+        if (i == 20)
+            reflector->disable(1);
+        if (i == 60) {
+            EXPECT_LT(20, replicas[0]->truncatedInstance());
+            reflector->enable(1);
+        }
+
+        auto trans = replicas[0]->beginTransaction();
+        trans->put(
+            ns, toBuffer("key" + std::to_string(i)),
+            toBuffer(std::to_string(i)));
+        replicas[0]->commit(std::move(trans));
+    }
+
+    // Give the timeout thread an opportunity to drain then test the
+    // replicas
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    for (int i = 0; i < int(dbs.size()); i++) {
+        auto dbns = dbs[i]->getNamespace("default");
+        for (int j = 0; j < iterations; j++) {
+            EXPECT_EQ(
+                std::to_string(j),
+                toString(dbns->get(toBuffer("key" + std::to_string(j)))));
+        }
+    }
+}
@@ -137,6 +137,76 @@ struct Reflector: public IPaxos1
                 });
         }
     }
+    void truncated(const TRUNCATEDargs& args) override
+    {
+        auto lk = clock_->lock();
+        auto now = clock_->now();
+        for (auto& entry: replicas_) {
+            if (!entry.enabled)
+                continue;
+            auto replica = entry.proto;
+            tman_->add(
+                now, [replica, args]() {
+                    replica->truncated(args);
+                });
+        }
+    }
+    void fetch(const FETCHargs& args) override
+    {
+        auto lk = clock_->lock();
+        auto now = clock_->now();
+        for (auto& entry: replicas_) {
+            if (!entry.enabled)
+                continue;
+            auto replica = entry.proto;
+            tman_->add(
+                now, [replica, args]() {
+                    replica->fetch(args);
+                });
+        }
+    }
+    void chunk(const CHUNKargs& args) override
+    {
+        auto lk = clock_->lock();
+        auto now = clock_->now();
+        for (auto& entry: replicas_) {
+            if (!entry.enabled)
+                continue;
+            auto replica = entry.proto;
+            tman_->add(
+                now, [replica, args]() {
+                    replica->chunk(args);
+                });
+        }
+    }
+    void catchup(const CATCHUPargs& args) override
+    {
+        auto lk = clock_->lock();
+        auto now = clock_->now();
+        for (auto& entry: replicas_) {
+            if (!entry.enabled)
+                continue;
+            auto replica = entry.proto;
+            tman_->add(
+                now, [replica, args]() {
+                    replica->catchup(args);
+                });
+        }
+    }
+    void chosen(const CHOSENargs& args) override
+    {
+        auto lk = clock_->lock();
+        auto now = clock_->now();
+        for (auto& entry: replicas_) {
+            if (!entry.enabled)
+                continue;
+            auto replica = entry.proto;
+            tman_->add(
+                now, [replica, args]() {
+                    replica->chosen(args);
+                });
+        }
+    }
 
     void add(std::shared_ptr<IPaxos1> replica)
     {
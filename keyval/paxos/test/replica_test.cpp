@@ -60,6 +60,11 @@ struct MockProto: public IPaxos1
     MOCK_METHOD1(accept, void(const ACCEPTargs&));
     MOCK_METHOD1(accepted, void(const ACCEPTargs&));
     MOCK_METHOD1(nack, void(const NACKargs&));
+    MOCK_METHOD1(truncated, void(const TRUNCATEDargs&));
+    MOCK_METHOD1(fetch, void(const FETCHargs&));
+    MOCK_METHOD1(chunk, void(const CHUNKargs&));
+    MOCK_METHOD1(catchup, void(const CATCHUPargs&));
+    MOCK_METHOD1(chosen, void(const CHOSENargs&));
 };
 
 struct SaveRound
@@ -104,7 +109,18 @@ public:
                   << (isLeader_ ? "leader" : "follower");
     }
 
+    bool merge(
+        std::vector<uint8_t>& batch,
+        const std::vector<uint8_t>& command) override
+    {
+        if (!batching)
+            return false;
+        batch.insert(batch.end(), command.begin(), command.end());
+        return true;
+    }
+
     int count = 0;
+    bool batching = false;
 };
 
 /// This fixture aims to test the behaviour of a single replica in
@@ -253,6 +269,44 @@ TEST_F(ReplicaTest, Accept)
     self->accept({MockId(2), 1, j, c});
 }
 
+TEST_F(ReplicaTest, PromiseAll)
+{
+    // If the replica hasn't voted in any later instance, its promise
+    // should cover all later instances
+    PaxosRound i{2, MockId(1)};
+    EXPECT_CALL(*proto, promise(
+                    AllOf(Field(&PROMISEargs::instance, 1),
+                          Field(&PROMISEargs::i, i),
+                          Field(&PROMISEargs::all, true))))
+        .Times(1);
+    self->prepare({MockId(1), 1, i});
+
+    // An accept for a later instance in that round doesn't need a
+    // prepare but one with an older round is rejected
+    PaxosRound j{1, MockId(2)};
+    PaxosCommand c = ToOpaque("fruit");
+    EXPECT_CALL(*proto, accepted(
+                    AllOf(Field(&ACCEPTargs::instance, 3),
+                          Field(&ACCEPTargs::i, i))))
+        .Times(1);
+    EXPECT_CALL(*proto, nack(
+                    AllOf(Field(&NACKargs::instance, 4),
+                          Field(&NACKargs::i, i))))
+        .Times(1);
+    self->accept({MockId(1), 3, i, c});
+    self->accept({MockId(2), 4, j, c});
+
+    // Since we voted in instance 3, a prepare for an earlier instance
+    // can only be promised for that instance
+    PaxosRound k{3, MockId(2)};
+    EXPECT_CALL(*proto, promise(
+                    AllOf(Field(&PROMISEargs::instance, 2),
+                          Field(&PROMISEargs::i, k),
+                          Field(&PROMISEargs::all, false))))
+        .Times(1);
+    self->prepare({MockId(2), 2, k});
+}
+
 TEST_F(ReplicaTest, Simple)
 {
     // Simple un-contested operation.
@@ -286,6 +340,251 @@ TEST_F(ReplicaTest, Simple)
     EXPECT_EQ(1, self->count);
 }
 
+TEST_F(ReplicaTest, StableLeader)
+{
+    // Once a quorum has promised a round for all later instances, the
+    // leader should skip phase 1 for new instances until it sees a
+    // higher round
+    addReplicas(4);
+
+    PaxosRound i;
+    PaxosCommand c = ToOpaque("lemon");
+    PaxosCommand c2 = ToOpaque("orange");
+
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 1)))
+        .Times(1)
+        .WillOnce(Invoke(SaveRound(i)));
+    self->execute(c);
+
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 1),
+                          Field(&ACCEPTargs::i, i),
+                          Field(&ACCEPTargs::v, c))));
+    self->promise({MockId(1), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(2), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(3), 1, i, PaxosRound(), null, true});
+    self->accepted({MockId(1), 1, i, c});
+    self->accepted({MockId(2), 1, i, c});
+    self->accepted({MockId(3), 1, i, c});
+    EXPECT_EQ(true, self->isLeader());
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // The next command goes straight to phase 2 in the same round
+    EXPECT_CALL(*proto, prepare(_)).Times(0);
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 2),
+                          Field(&ACCEPTargs::i, i),
+                          Field(&ACCEPTargs::v, c2))));
+    self->execute(c2);
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // A nack with a higher round means we must run phase 1 again
+    PaxosRound j{i.gen + 1, MockId(3)};
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 2)))
+        .Times(1)
+        .WillOnce(Invoke(SaveRound(i)));
+    self->nack({MockId(3), 2, j});
+    EXPECT_GT(i, j);
+}
+
+TEST_F(ReplicaTest, Pipeline)
+{
+    // A stable leader may have up to window() instances in flight
+    // and applies them in order even if they are chosen out of order
+    addReplicas(4);
+    self->setWindow(3);
+
+    PaxosRound i;
+    PaxosCommand c1 = ToOpaque("lemon");
+    PaxosCommand c2 = ToOpaque("orange");
+    PaxosCommand c3 = ToOpaque("lime");
+    PaxosCommand c4 = ToOpaque("grapefruit");
+
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 1)))
+        .Times(1)
+        .WillOnce(Invoke(SaveRound(i)));
+    auto t1 = self->execute(c1);
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 1),
+                          Field(&ACCEPTargs::v, c1))));
+    self->promise({MockId(1), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(2), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(3), 1, i, PaxosRound(), null, true});
+    self->accepted({MockId(1), 1, i, c1});
+    self->accepted({MockId(2), 1, i, c1});
+    self->accepted({MockId(3), 1, i, c1});
+    EXPECT_EQ(1, self->count);
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // The next three commands each get their own instance and the
+    // fourth waits for space in the window
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 2),
+                          Field(&ACCEPTargs::v, c2))));
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 3),
+                          Field(&ACCEPTargs::v, c3))));
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 4),
+                          Field(&ACCEPTargs::v, c1))));
+    auto t2 = self->execute(c2);
+    auto t3 = self->execute(c3);
+    auto t4 = self->execute(c1);
+    auto t5 = self->execute(c4);
+    EXPECT_EQ(3, self->activeInstances());
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // Instance 3 is chosen first - it can't be applied until instance
+    // 2 is but the waiting command can use the space in the window
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 5),
+                          Field(&ACCEPTargs::v, c4))));
+    self->accepted({MockId(1), 3, i, c3});
+    self->accepted({MockId(2), 3, i, c3});
+    self->accepted({MockId(3), 3, i, c3});
+    EXPECT_EQ(1, self->count);
+    EXPECT_EQ(std::cv_status::timeout,
+              t3->wait_for(std::chrono::seconds(0)));
+
+    self->accepted({MockId(1), 2, i, c2});
+    self->accepted({MockId(2), 2, i, c2});
+    self->accepted({MockId(3), 2, i, c2});
+    EXPECT_EQ(3, self->count);
+    for (auto t: {t1, t2, t3}) {
+        EXPECT_EQ(std::cv_status::no_timeout,
+                  t->wait_for(std::chrono::seconds(0)));
+    }
+    EXPECT_EQ(std::cv_status::timeout,
+              t4->wait_for(std::chrono::seconds(0)));
+    EXPECT_EQ(std::cv_status::timeout,
+              t5->wait_for(std::chrono::seconds(0)));
+}
+
+TEST_F(ReplicaTest, CompetingProposer)
+{
+    // If another proposer's value is chosen for an instance we are
+    // proposing, our command must not complete - it should be retried
+    // in a later instance
+    addReplicas(4);
+
+    PaxosRound i;
+    PaxosRound j = {2, MockId(1)};
+    PaxosCommand c1 = ToOpaque("lemon");
+    PaxosCommand c2 = ToOpaque("orange");
+
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 1)))
+        .Times(1)
+        .WillOnce(Invoke(SaveRound(i)));
+    auto t1 = self->execute(c1);
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 1),
+                          Field(&ACCEPTargs::v, c1))));
+    self->promise({MockId(1), 1, i, PaxosRound(), null});
+    self->promise({MockId(2), 1, i, PaxosRound(), null});
+    self->promise({MockId(3), 1, i, PaxosRound(), null});
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // A competing proposer with a higher round gets its value chosen
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 2)))
+        .Times(1);
+    self->accepted({MockId(1), 1, j, c2});
+    self->accepted({MockId(2), 1, j, c2});
+    self->accepted({MockId(3), 1, j, c2});
+    EXPECT_EQ(1, self->count);
+    EXPECT_EQ(std::cv_status::timeout,
+              t1->wait_for(std::chrono::seconds(0)));
+    EXPECT_EQ(1, self->activeInstances());
+}
+
+TEST_F(ReplicaTest, Batch)
+{
+    // Commands which arrive while an instance is in flight should be
+    // merged into a single value for the next instance
+    addReplicas(4);
+    self->batching = true;
+
+    PaxosRound i;
+    PaxosCommand c2 = ToOpaque("orangelime");
+
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 1)))
+        .Times(1)
+        .WillOnce(Invoke(SaveRound(i)));
+    auto t1 = self->execute(ToOpaque("lemon"));
+
+    // The first instance is still in phase 1 so these should both
+    // wait and share an instance
+    auto t2 = self->execute(ToOpaque("orange"));
+    auto t3 = self->execute(ToOpaque("lime"));
+
+    // The first instance can take all the pending commands since it
+    // hasn't chosen a value yet
+    PaxosCommand all = ToOpaque("lemonorangelime");
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 1),
+                          Field(&ACCEPTargs::i, i),
+                          Field(&ACCEPTargs::v, all))));
+    self->promise({MockId(1), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(2), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(3), 1, i, PaxosRound(), null, true});
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // Commands arriving now wait for the accept round to complete
+    auto t4 = self->execute(ToOpaque("orange"));
+    self->execute(ToOpaque("lime"));
+
+    // Once the value is chosen, the whole batch is applied once and
+    // each transaction completes. The waiting commands go in the
+    // next instance, skipping phase 1 since we are now leader.
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 2),
+                          Field(&ACCEPTargs::v, c2))));
+    self->accepted({MockId(1), 1, i, all});
+    self->accepted({MockId(2), 1, i, all});
+    self->accepted({MockId(3), 1, i, all});
+    EXPECT_EQ(1, self->count);
+    for (auto t: {t1, t2, t3}) {
+        EXPECT_EQ(std::cv_status::no_timeout,
+                  t->wait_for(std::chrono::seconds(0)));
+    }
+    EXPECT_EQ(std::cv_status::timeout,
+              t4->wait_for(std::chrono::seconds(0)));
+}
+
+TEST_F(ReplicaTest, BatchLimit)
+{
+    // Batches are limited to what fits in a single packet
+    addReplicas(4);
+    self->batching = true;
+
+    PaxosRound i;
+    PaxosCommand c(MAX_COMMAND_SIZE / 2, 'a');
+    PaxosCommand c2(MAX_COMMAND_SIZE / 2, 'b');
+    PaxosCommand c3(MAX_COMMAND_SIZE / 2, 'c');
+    PaxosCommand both = c;
+    both.insert(both.end(), c2.begin(), c2.end());
+
+    EXPECT_CALL(*proto, prepare(Field(&PREPAREargs::instance, 1)))
+        .Times(1)
+        .WillOnce(Invoke(SaveRound(i)));
+    self->execute(c);
+    self->execute(c2);
+    self->execute(c3);
+
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 1),
+                          Field(&ACCEPTargs::v, both))));
+    self->promise({MockId(1), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(2), 1, i, PaxosRound(), null, true});
+    self->promise({MockId(3), 1, i, PaxosRound(), null, true});
+
+    EXPECT_CALL(*proto, accept(
+                    AllOf(Field(&ACCEPTargs::instance, 2),
+                          Field(&ACCEPTargs::v, c3))));
+    self->accepted({MockId(1), 1, i, both});
+    self->accepted({MockId(2), 1, i, both});
+    self->accepted({MockId(3), 1, i, both});
+}
+
 TEST_F(ReplicaTest, PrepareConflict)
 {
     // Check that prepare is re-sent if a replica replies that it has
@@ -495,6 +794,91 @@ TEST_F(ReplicaTest, Recovery)
     self->accepted({MockId(3), 1, j, c});
 }
 
+TEST_F(ReplicaTest, SendChosen)
+{
+    // A replica should answer a catchup request with the values
+    // chosen for the instances it has applied
+    addReplicas(4);
+    PaxosRound i = {1, MockId(1)};
+    std::vector<PaxosCommand> values = {
+        ToOpaque("lemon"), ToOpaque("orange"), ToOpaque("lime")};
+    for (int j = 0; j < int(values.size()); j++) {
+        self->accepted({MockId(1), j + 1, i, values[j]});
+        self->accepted({MockId(2), j + 1, i, values[j]});
+        self->accepted({MockId(3), j + 1, i, values[j]});
+    }
+    EXPECT_EQ(3, self->count);
+
+    // We can only send values up to the last applied instance
+    EXPECT_CALL(*proto, chosen(
+                    AllOf(Field(&CHOSENargs::start, 1),
+                          Field(&CHOSENargs::values, values),
+                          Field(&CHOSENargs::last, true))));
+    self->catchup({MockId(4), self->uuid(), 1, 10});
+}
+
+TEST_F(ReplicaTest, ChosenWatermark)
+{
+    // A database written before log entries were guaranteed to hold
+    // chosen values may have a losing vote in the log. The replica
+    // must not send those entries to a peer which is catching up.
+    auto db = keyval::make_memdb();
+    std::int64_t applied = 3;
+    auto val = std::make_shared<keyval::Buffer>(oncrpc::XdrSizeof(applied));
+    oncrpc::XdrMemory xmv(val->data(), val->size());
+    xdr(applied, static_cast<oncrpc::XdrSink*>(&xmv));
+    auto trans = db->beginTransaction();
+    trans->put(
+        db->getNamespace("PaxosMeta"),
+        std::make_shared<keyval::Buffer>("instance"), val);
+    db->commit(std::move(trans));
+
+    EXPECT_CALL(*proto, identity(_)).Times(1);
+    self = std::make_shared<MyReplica>(proto, clock, tman, db);
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    std::vector<PaxosCommand> none;
+    EXPECT_CALL(*proto, chosen(
+                    AllOf(Field(&CHOSENargs::start, 1),
+                          Field(&CHOSENargs::values, none),
+                          Field(&CHOSENargs::last, true))));
+    self->catchup({MockId(4), self->uuid(), 1, 10});
+}
+
+TEST_F(ReplicaTest, Catchup)
+{
+    // If the replica is missing many instances, it should ask a
+    // healthy peer to stream the chosen values instead of recovering
+    // each instance in turn
+    addReplicas(4);
+    PaxosRound i = {1, MockId(1)};
+    PaxosCommand c = ToOpaque("lemon");
+    UUID peer;
+
+    EXPECT_CALL(*proto, prepare(_)).Times(0);
+    EXPECT_CALL(*proto, catchup(
+                    AllOf(Field(&CATCHUPargs::start, 1),
+                          Field(&CATCHUPargs::end, 11))))
+        .Times(1)
+        .WillOnce(Invoke([&](const CATCHUPargs& args) { peer = args.peer; }));
+    EXPECT_CALL(*proto, identity(
+                    Field(&IDENTITYargs::status, STATUS_RECOVERING)));
+
+    self->accepted({MockId(1), 10, i, c});
+    self->accepted({MockId(2), 10, i, c});
+    self->accepted({MockId(3), 10, i, c});
+    Mock::VerifyAndClearExpectations(proto.get());
+
+    // Applying the streamed values lets the replica apply the
+    // instance it has already learned and it should report healthy
+    EXPECT_CALL(*proto, identity(
+                    AllOf(Field(&IDENTITYargs::status, STATUS_HEALTHY),
+                          Field(&IDENTITYargs::instance, 10))));
+    std::vector<PaxosCommand> values(9, c);
+    self->chosen({peer, self->uuid(), 1, values, true});
+    EXPECT_EQ(10, self->count);
+}
+
 /// Making sure that a set of replicas can reach consensus on a
 /// sequence of commands
 struct ConsensusTest: public ::testing::Test
@@ -24,8 +24,11 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <set>
 #include <system_error>
 
+#include <glog/logging.h>
 #include <rpc++/rest.h>
 #include "rocks.h"
 
@@ -34,8 +37,17 @@ using namespace keyval::rocks;
 using namespace rocksdb;
 using namespace std;
 
-RocksDatabase::RocksDatabase(const string& filename)
-    : filename_(filename)
+// Copy the contents of a slice into a new buffer
+static shared_ptr<Buffer> toBuffer(const Slice& s)
+{
+    return make_shared<Buffer>(
+        s.size(), reinterpret_cast<const uint8_t*>(s.data()));
+}
+
+RocksDatabase::RocksDatabase(
+    const string& filename, const DatabaseOptions& options)
+    : filename_(filename),
+      options_(options)
 {
     Status status;
     DB* db;
@@ -44,6 +56,9 @@ RocksDatabase::RocksDatabase(const string& filename)
     options.create_if_missing = true;
     options.keep_log_file_num = 5;
 
+    if (options_.blockCacheSize > 0)
+        blockCache_ = NewLRUCache(options_.blockCacheSize);
+
     vector<string> cfnames;
     DB::ListColumnFamilies(options, filename_, &cfnames);
     if (cfnames.size() == 0)
@@ -52,21 +67,32 @@ RocksDatabase::RocksDatabase(const string& filename)
     vector<ColumnFamilyDescriptor> descriptors;
     vector<ColumnFamilyHandle*> handles;
     for (auto& cfname: cfnames)
-        descriptors.emplace_back(cfname, ColumnFamilyOptions());
+        descriptors.emplace_back(cfname, namespaceOptions(cfname));
 
     status = DB::Open(options, filename_, descriptors, &handles, &db);
     assert(status.ok());
 
     for (int i = 0; i < int(cfnames.size()); i++) {
-        namespaces_[cfnames[i]] =
-            make_shared<RocksNamespace>(db, handles[i]);
+        namespaces_[cfnames[i]] = make_shared<RocksNamespace>(
+            db, handles[i], stats_->getNamespace(cfnames[i]),
+            options_.namespaces[cfnames[i]].prefixLength);
     }
 
     db_.reset(db);
+
+    if (options_.durability != DatabaseOptions::Durability::ASYNC)
+        syncThread_ = thread([this]() { syncLoop(); });
 }
 
 RocksDatabase::~RocksDatabase()
 {
+    if (syncThread_.joinable()) {
+        unique_lock<mutex> lk(syncMutex_);
+        syncStopping_ = true;
+        syncCv_.notify_one();
+        lk.unlock();
+        syncThread_.join();
+    }
     for (auto& ns: namespaces_)
         ns.second->clearHandle();
     db_.reset();
@@ -74,6 +100,11 @@ RocksDatabase::~RocksDatabase()
 
 // Database overrides
 shared_ptr<Namespace> RocksDatabase::getNamespace(const string& name)
+{
+    return getRocksNamespace(name);
+}
+
+shared_ptr<RocksNamespace> RocksDatabase::getRocksNamespace(const string& name)
 {
     auto it = namespaces_.find(name);
     if (it != namespaces_.end())
@@ -81,9 +112,11 @@ shared_ptr<Namespace> RocksDatabase::getNamespace(const string& name)
 
     Status status;
     ColumnFamilyHandle* h;
-    status = db_->CreateColumnFamily(ColumnFamilyOptions(), name, &h);
+    status = db_->CreateColumnFamily(namespaceOptions(name), name, &h);
     assert(status.ok());
-    auto ns = make_shared<RocksNamespace>(db_.get(), h);
+    auto ns = make_shared<RocksNamespace>(
+        db_.get(), h, stats_->getNamespace(name),
+        options_.namespaces[name].prefixLength);
     namespaces_[name] = ns;
 
     return ns;
@@ -94,17 +127,167 @@ unique_ptr<Transaction> RocksDatabase::beginTransaction()
     return make_unique<RocksTransaction>();
 }
 
-void RocksDatabase::commit(unique_ptr<Transaction>&& transaction)
+void RocksDatabase::write(Transaction* transaction)
 {
-    auto p = reinterpret_cast<RocksTransaction*>(transaction.get());
+    // Concurrent writes are already merged by RocksDB into a single
+    // append to the WAL so we only need to coalesce syncs here
+    OpTimer timer(stats_->commit);
+    auto p = reinterpret_cast<RocksTransaction*>(transaction);
+    timer.setBytes(p->batch()->GetDataSize());
     auto status = db_->Write(WriteOptions(), p->batch());
     assert(status.ok());
+}
+
+void RocksDatabase::commit(unique_ptr<Transaction>&& transaction)
+{
+    write(transaction.get());
     transaction.reset();
+    if (options_.durability == DatabaseOptions::Durability::COMMIT)
+        syncWait();
+}
+
+void RocksDatabase::commitAsync(
+    unique_ptr<Transaction>&& transaction,
+    function<void(exception_ptr)> cb)
+{
+    // Without sync, RocksDB writes only append to the WAL and update
+    // the memtable so there is nothing to gain by deferring the
+    // write. With sync, the callback is called from the sync thread.
+    try {
+        write(transaction.get());
+        transaction.reset();
+    }
+    catch (...) {
+        cb(current_exception());
+        return;
+    }
+    if (options_.durability == DatabaseOptions::Durability::COMMIT)
+        sync(cb);
+    else
+        cb(nullptr);
 }
 
 void RocksDatabase::flush()
 {
-    db_->SyncWAL();
+    // With commit durability, every completed commit is already on
+    // stable storage
+    if (options_.durability == DatabaseOptions::Durability::FLUSH)
+        syncWait();
+}
+
+void RocksDatabase::sync(function<void(exception_ptr)> cb)
+{
+    unique_lock<mutex> lk(syncMutex_);
+    syncRequests_++;
+    syncWaiters_.push_back(move(cb));
+    syncCv_.notify_one();
+}
+
+void RocksDatabase::syncWait()
+{
+    mutex m;
+    condition_variable cv;
+    bool done = false;
+    exception_ptr error;
+    sync(
+        [&](exception_ptr ex) {
+            unique_lock<mutex> lk(m);
+            error = ex;
+            done = true;
+            cv.notify_one();
+        });
+    unique_lock<mutex> lk(m);
+    while (!done)
+        cv.wait(lk);
+    if (error)
+        rethrow_exception(error);
+}
+
+void RocksDatabase::syncLoop()
+{
+    unique_lock<mutex> lk(syncMutex_);
+    for (;;) {
+        while (syncWaiters_.empty() && !syncStopping_)
+            syncCv_.wait(lk);
+        if (syncWaiters_.empty())
+            return;
+        auto waiters = move(syncWaiters_);
+        syncWaiters_.clear();
+        lk.unlock();
+
+        exception_ptr error;
+        auto start = OpStats::clock::now();
+        auto status = db_->SyncWAL();
+        stats_->sync.add(OpStats::clock::now() - start);
+        syncCount_++;
+        if (!status.ok()) {
+            LOG(ERROR) << "error syncing WAL: " << status.ToString();
+            error = make_exception_ptr(system_error(EIO, system_category()));
+        }
+        for (auto& cb: waiters)
+            cb(error);
+
+        lk.lock();
+    }
+}
+
+shared_ptr<Snapshot> RocksDatabase::snapshot()
+{
+    vector<string> names;
+    for (auto& entry: namespaces_)
+        names.push_back(entry.first);
+    sort(names.begin(), names.end());
+    return make_shared<RocksSnapshot>(
+        shared_from_this(), db_.get(), move(names));
+}
+
+shared_ptr<Namespace> RocksSnapshot::getNamespace(const string& name)
+{
+    return make_shared<RocksSnapshotNamespace>(
+        shared_from_this(), db_->getRocksNamespace(name));
+}
+
+ColumnFamilyOptions RocksDatabase::namespaceOptions(const string& name)
+{
+    ColumnFamilyOptions cfopts;
+    auto it = options_.namespaces.find(name);
+    if (it == options_.namespaces.end() && !blockCache_)
+        return cfopts;
+
+    BlockBasedTableOptions bbo;
+    if (blockCache_)
+        bbo.block_cache = blockCache_;
+    if (it != options_.namespaces.end()) {
+        auto& nsopts = it->second;
+        if (nsopts.bloomBitsPerKey > 0) {
+            bbo.filter_policy.reset(
+                NewBloomFilterPolicy(nsopts.bloomBitsPerKey, false));
+        }
+        if (nsopts.prefixLength > 0) {
+            cfopts.prefix_extractor.reset(
+                NewFixedPrefixTransform(nsopts.prefixLength));
+        }
+        if (nsopts.compression.size() > 0) {
+            static unordered_map<string, CompressionType> types = {
+                {"none", kNoCompression},
+                {"snappy", kSnappyCompression},
+                {"zlib", kZlibCompression},
+                {"bzip2", kBZip2Compression},
+                {"lz4", kLZ4Compression},
+                {"lz4hc", kLZ4HCCompression},
+            };
+            auto t = types.find(nsopts.compression);
+            if (t == types.end()) {
+                LOG(ERROR) << "namespace " << name
+                           << ": unknown compression type: "
+                           << nsopts.compression;
+                throw system_error(EINVAL, system_category());
+            }
+            cfopts.compression = t->second;
+        }
+    }
+    cfopts.table_factory.reset(NewBlockBasedTableFactory(bbo));
+    return cfopts;
 }
 
 bool RocksDatabase::get(
@@ -117,7 +300,8 @@ bool RocksDatabase::get(
     auto options = db_->GetOptions();
     BlockBasedTableOptions* bbo = reinterpret_cast<BlockBasedTableOptions*>(
         options.table_factory->GetOptions());
-    obj->field("blockCacheMem")->number(long(bbo->block_cache->GetUsage()));
+    auto cache = blockCache_ ? blockCache_ : bbo->block_cache;
+    obj->field("blockCacheMem")->number(long(cache->GetUsage()));
 
     db_->GetIntProperty("rocksdb.estimate-table-readers-mem", &val);
     obj->field("tableReadersMem")->number(long(val));
@@ -125,33 +309,124 @@ bool RocksDatabase::get(
     db_->GetIntProperty("rocksdb.cur-size-all-mem-tables", &val);
     obj->field("memtableSize")->number(long(val));
 
+    // Comparing these shows how well concurrent syncs are coalesced
+    obj->field("syncRequests")->number(long(syncRequests_));
+    obj->field("walSyncs")->number(long(syncCount_));
+
+    stats_->report(obj);
+
     return true;
 }
 
 unique_ptr<keyval::Iterator> RocksNamespace::iterator()
 {
-    return make_unique<RocksIterator>(db_, handle_.get(), nullptr, nullptr);
+    return make_unique<RocksIterator>(this, nullptr, nullptr);
 }
 
 unique_ptr<keyval::Iterator> RocksNamespace::iterator(
     shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey)
 {
-    return make_unique<RocksIterator>(db_, handle_.get(), startKey, endKey);
+    return make_unique<RocksIterator>(this, startKey, endKey);
+}
+
+ReadOptions RocksNamespace::iteratorOptions(
+    const Slice* startKey, const Slice* endKey) const
+{
+    ReadOptions opts;
+    if (prefixLength_ == 0)
+        return opts;
+    opts.total_order_seek = true;
+    if (!startKey || !endKey || startKey->size() < size_t(prefixLength_))
+        return opts;
+
+    // The range stays within the start key's prefix if the end key is
+    // no greater than the first key with the next prefix
+    string next(startKey->data(), prefixLength_);
+    int i;
+    for (i = prefixLength_ - 1; i >= 0; i--) {
+        if (uint8_t(next[i]) != 0xff) {
+            next[i]++;
+            break;
+        }
+        next[i] = 0;
+    }
+    if (i >= 0 && endKey->compare(Slice(next)) <= 0)
+        opts.total_order_seek = false;
+    return opts;
 }
 
 shared_ptr<Buffer> RocksNamespace::get(shared_ptr<Buffer> key)
 {
-    string val;
+    return get(KeySpan(key->data(), key->size()), nullptr);
+}
+
+shared_ptr<Buffer> RocksNamespace::get(const KeySpan& key)
+{
+    return get(key, nullptr);
+}
+
+vector<shared_ptr<Buffer>> RocksNamespace::multiGet(
+    const vector<shared_ptr<Buffer>>& keys)
+{
+    return multiGet(keys, nullptr);
+}
+
+unique_ptr<keyval::Iterator> RocksNamespace::iterator(
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey,
+    shared_ptr<RocksSnapshot> snapshot)
+{
+    return make_unique<RocksIterator>(this, startKey, endKey, snapshot);
+}
+
+shared_ptr<Buffer> RocksNamespace::get(
+    const KeySpan& key, const rocksdb::Snapshot* snapshot)
+{
+    // The version of RocksDB we use has no PinnableSlice so Get
+    // always copies the value into a string. Re-using a per-thread
+    // string avoids allocating for each lookup, leaving the single
+    // copy into the caller's buffer.
+    OpTimer timer(stats_->get);
+    thread_local string val;
+    ReadOptions opts;
+    opts.snapshot = snapshot;
     auto status = db_->Get(
-        ReadOptions(), handle_.get(),
-        Slice(reinterpret_cast<const char*>(key->data()), key->size()),
+        opts, handle_.get(),
+        Slice(reinterpret_cast<const char*>(key.data()), key.size()),
         &val);
     if (status.IsNotFound())
         throw system_error(ENOENT, system_category());
-    // XXX: avoid copy somehow?
-    auto res = make_shared<Buffer>(val.size());
-    copy_n(
-        reinterpret_cast<const uint8_t*>(val.data()), val.size(), res->data());
+    timer.setBytes(val.size());
+    return toBuffer(val);
+}
+
+vector<shared_ptr<Buffer>> RocksNamespace::multiGet(
+    const vector<shared_ptr<Buffer>>& keys, const rocksdb::Snapshot* snapshot)
+{
+    OpTimer timer(stats_->get);
+    vector<ColumnFamilyHandle*> handles(keys.size(), handle_.get());
+    vector<Slice> slices;
+    slices.reserve(keys.size());
+    for (auto& key: keys)
+        slices.emplace_back(
+            reinterpret_cast<const char*>(key->data()), key->size());
+
+    vector<string> vals;
+    ReadOptions opts;
+    opts.snapshot = snapshot;
+    auto statuses = db_->MultiGet(opts, handles, slices, &vals);
+
+    vector<shared_ptr<Buffer>> res;
+    res.reserve(keys.size());
+    size_t bytes = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (statuses[i].IsNotFound()) {
+            res.push_back(nullptr);
+            continue;
+        }
+        bytes += vals[i].size();
+        res.push_back(toBuffer(vals[i]));
+    }
+    timer.setBytes(bytes);
     return res;
 }
 
@@ -167,51 +442,79 @@ uint64_t RocksNamespace::spaceUsed(
 }
 
 RocksIterator::RocksIterator(
-    rocksdb::DB* db,
-    rocksdb::ColumnFamilyHandle* ns,
+    const RocksNamespace* ns,
     std::shared_ptr<Buffer> startKey,
-    std::shared_ptr<Buffer> endKey)
+    std::shared_ptr<Buffer> endKey,
+    std::shared_ptr<RocksSnapshot> snapshot)
+    : ns_(ns),
+      snapshot_(snapshot),
+      startBuf_(startKey),
+      endBuf_(endKey)
 {
-    ReadOptions opts;
+    if (startKey) {
+        startKey_ = Slice(
+            reinterpret_cast<const char*>(startKey->data()), startKey->size());
+    }
     if (endKey) {
         endKey_ = Slice(
             reinterpret_cast<const char*>(endKey->data()), endKey->size());
-        opts.iterate_upper_bound = &endKey_;
     }
-    it_.reset(move(db->NewIterator(opts, ns)));
-    if (startKey) {
-        startKey_ = Slice(
-            reinterpret_cast<const char*>(startKey->data()), startKey->size());
+    auto opts = ns->iteratorOptions(
+        startKey ? &startKey_ : nullptr, endKey ? &endKey_ : nullptr);
+    if (endKey)
+        opts.iterate_upper_bound = &endKey_;
+    if (snapshot)
+        opts.snapshot = snapshot->snapshot();
+    prefixMode_ = !opts.total_order_seek;
+    it_.reset(move(ns->db()->NewIterator(opts, ns->handle())));
+    if (startKey)
         it_->Seek(startKey_);
-    }
-    else {
+    else
         it_->SeekToFirst();
-    }
 }
 
 void RocksIterator::seek(shared_ptr<Buffer> key)
 {
+    OpTimer timer(ns_->stats().seek);
+    invalidate();
     it_->Seek(Slice(reinterpret_cast<const char*>(key->data()), key->size()));
 }
 
 void RocksIterator::seekToFirst()
 {
-    it_->SeekToFirst();
+    OpTimer timer(ns_->stats().seek);
+    invalidate();
+    // A prefix mode iterator can only see keys with the start key's
+    // prefix so we seek to the start of that prefix instead
+    if (prefixMode_)
+        it_->Seek(Slice(startKey_.data(), ns_->prefixLength()));
+    else
+        it_->SeekToFirst();
 }
 
 void RocksIterator::seekToLast()
 {
+    OpTimer timer(ns_->stats().seek);
+    invalidate();
     it_->SeekToLast();
 }
 
 void RocksIterator::next()
 {
+    OpTimer timer(ns_->stats().next);
+    invalidate();
     it_->Next();
+    if (it_->Valid())
+        timer.setBytes(it_->key().size() + it_->value().size());
 }
 
 void RocksIterator::prev()
 {
+    OpTimer timer(ns_->stats().next);
+    invalidate();
     it_->Prev();
+    if (it_->Valid())
+        timer.setBytes(it_->key().size() + it_->value().size());
 }
 
 bool RocksIterator::valid() const
@@ -221,36 +524,135 @@ bool RocksIterator::valid() const
 
 shared_ptr<Buffer> RocksIterator::key() const
 {
-    auto k = it_->key();
-    auto res = make_shared<Buffer>(k.size());
-    copy_n(reinterpret_cast<const uint8_t*>(k.data()), k.size(), res->data());
-    return res;
+    if (!key_)
+        key_ = toBuffer(it_->key());
+    return key_;
 }
 
 shared_ptr<Buffer> RocksIterator::value() const
 {
-    auto v = it_->value();
-    auto res = make_shared<Buffer>(v.size());
-    copy_n(reinterpret_cast<const uint8_t*>(v.data()), v.size(), res->data());
-    return res;
+    if (!value_)
+        value_ = toBuffer(it_->value());
+    return value_;
+}
+
+IteratorBatch RocksIterator::nextBatch(size_t maxEntries, size_t maxBytes)
+{
+    // Copy straight from the iterator's slices into the batch, skipping
+    // the per-entry buffers allocated by key() and value()
+    OpTimer timer(ns_->stats().next);
+    invalidate();
+    IteratorBatch batch(maxBytes);
+    while (batch.size() < maxEntries && it_->Valid()) {
+        auto k = it_->key();
+        auto v = it_->value();
+        if (!batch.add(
+                reinterpret_cast<const uint8_t*>(k.data()), k.size(),
+                reinterpret_cast<const uint8_t*>(v.data()), v.size()))
+            break;
+        it_->Next();
+    }
+    timer.setBytes(batch.bytes());
+    return batch;
 }
 
 void RocksTransaction::put(
     shared_ptr<Namespace> ns, shared_ptr<Buffer> key, shared_ptr<Buffer> val)
+{
+    put(ns, KeySpan(key->data(), key->size()), val);
+}
+
+void RocksTransaction::remove(
+    shared_ptr<Namespace> ns, shared_ptr<Buffer> key)
+{
+    remove(ns, KeySpan(key->data(), key->size()));
+}
+
+void RocksTransaction::put(
+    shared_ptr<Namespace> ns, const KeySpan& key, shared_ptr<Buffer> val)
 {
     auto ons = dynamic_pointer_cast<RocksNamespace>(ns);
+    ons->stats().write.count(1, key.size() + val->size());
     batch_.Put(
         ons->handle(),
-        Slice(reinterpret_cast<const char*>(key->data()), key->size()),
+        Slice(reinterpret_cast<const char*>(key.data()), key.size()),
         Slice(reinterpret_cast<const char*>(val->data()), val->size()));
 }
 
-void RocksTransaction::remove(
-    shared_ptr<Namespace> ns, shared_ptr<Buffer> key)
+void RocksTransaction::remove(shared_ptr<Namespace> ns, const KeySpan& key)
 {
     auto ons = dynamic_pointer_cast<RocksNamespace>(ns);
+    ons->stats().write.count(1, key.size());
     batch_.Delete(
         ons->handle(),
-        Slice(reinterpret_cast<const char*>(key->data()), key->size()));
+        Slice(reinterpret_cast<const char*>(key.data()), key.size()));
+}
+
+namespace {
+
+// Find the keys in [start, end) which are put in a write batch and not
+// subsequently deleted
+struct BatchPuts: public WriteBatch::Handler
+{
+    BatchPuts(uint32_t id, const Slice& start, const Slice& end)
+        : id(id), start(start), end(end)
+    {
+    }
+
+    Status PutCF(uint32_t cf, const Slice& key, const Slice&) override
+    {
+        if (cf == id && key.compare(start) >= 0 && key.compare(end) < 0)
+            keys.insert(key.ToString());
+        return Status::OK();
+    }
+
+    Status DeleteCF(uint32_t cf, const Slice& key) override
+    {
+        if (cf == id)
+            keys.erase(key.ToString());
+        return Status::OK();
+    }
+
+    uint32_t id;
+    Slice start;
+    Slice end;
+    set<string> keys;
+};
+
 }
 
+void RocksTransaction::removeRange(
+    shared_ptr<Namespace> ns,
+    shared_ptr<Buffer> startKey, shared_ptr<Buffer> endKey)
+{
+    // The version of RocksDB we use does not support DeleteRange so
+    // we expand the range into point deletes. This only affects the
+    // local write batch - replicated transactions still carry the
+    // range as a single operation. Keys put earlier in this
+    // transaction are not visible to the iterator so we find those by
+    // scanning the batch, matching the in-memory backends which apply
+    // the operations in order at commit time. This keeps put and
+    // remove cheap at the expense of the rarer removeRange.
+    auto ons = dynamic_pointer_cast<RocksNamespace>(ns);
+    Slice end(reinterpret_cast<const char*>(endKey->data()), endKey->size());
+    Slice start(
+        reinterpret_cast<const char*>(startKey->data()), startKey->size());
+    if (batch_.Count() > 0) {
+        BatchPuts puts(ons->handle()->GetID(), start, end);
+        auto status = batch_.Iterate(&puts);
+        if (!status.ok()) {
+            LOG(ERROR) << "error scanning write batch: " << status.ToString();
+            throw system_error(EIO, system_category());
+        }
+        for (auto& key: puts.keys)
+            batch_.Delete(ons->handle(), Slice(key));
+    }
+
+    auto opts = ons->iteratorOptions(&start, &end);
+    opts.iterate_upper_bound = &end;
+    unique_ptr<rocksdb::Iterator> it(
+        ons->db()->NewIterator(opts, ons->handle()));
+    for (it->Seek(start); it->Valid(); it->Next()) {
+        batch_.Delete(ons->handle(), it->key());
+    }
+}
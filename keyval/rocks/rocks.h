@@ -27,27 +27,44 @@
 // -*- c++ -*-
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
 #include <keyval/keyval.h>
+#include <keyval/stats.h>
 #include <rocksdb/db.h>
 #include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
 #include <rocksdb/table.h>
 
 namespace keyval {
 namespace rocks {
 
 class RocksNamespace;
+class RocksSnapshot;
 
-class RocksDatabase: public Database
+class RocksDatabase: public Database,
+                     public std::enable_shared_from_this<RocksDatabase>
 {
 public:
-    RocksDatabase(const std::string& filename);
+    RocksDatabase(
+        const std::string& filename,
+        const DatabaseOptions& options = DatabaseOptions());
     ~RocksDatabase() override;
 
     // Database overrides
     std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
     std::unique_ptr<Transaction> beginTransaction() override;
     void commit(std::unique_ptr<Transaction>&& transaction) override;
+    void commitAsync(
+        std::unique_ptr<Transaction>&& transaction,
+        std::function<void(std::exception_ptr)> cb) override;
     void flush() override;
+    std::shared_ptr<Snapshot> snapshot() override;
     bool isReplicated() override { return false; }
     bool isMaster() override { return true; }
     bool get(
@@ -56,21 +73,56 @@ public:
     void onMasterChange(std::function<void(bool)> cb) override {}
     void setAppData(const std::vector<uint8_t>& data) override {}
     std::vector<ReplicaInfo> getReplicas() override { return {}; }
+    std::shared_ptr<DatabaseStats> stats() override { return stats_; }
+
+    std::shared_ptr<RocksNamespace> getRocksNamespace(const std::string& name);
 
 private:
+    /// Return the column family options for the given namespace
+    rocksdb::ColumnFamilyOptions namespaceOptions(const std::string& name);
+
+    /// Write a transaction's batch without syncing
+    void write(Transaction* transaction);
+
+    /// Request a sync of the write-ahead log, calling cb when all
+    /// writes made before the request are on stable storage
+    void sync(std::function<void(std::exception_ptr)> cb);
+
+    /// Request a sync of the write-ahead log and wait for it
+    void syncWait();
+
+    /// Sync thread main loop. Requests which arrive while a sync is
+    /// in progress are all satisfied by the next one so concurrent
+    /// commits and flushes share a single SyncWAL call.
+    void syncLoop();
+
     std::string filename_;
+    DatabaseOptions options_;
+    std::shared_ptr<rocksdb::Cache> blockCache_;
     std::unordered_map<std::string, std::shared_ptr<RocksNamespace>>
         namespaces_;
     std::unique_ptr<rocksdb::DB> db_;
+    std::shared_ptr<DatabaseStats> stats_ = std::make_shared<DatabaseStats>();
+
+    std::mutex syncMutex_;
+    std::condition_variable syncCv_;
+    std::vector<std::function<void(std::exception_ptr)>> syncWaiters_;
+    bool syncStopping_ = false;
+    std::thread syncThread_;
+    std::atomic<std::uint64_t> syncCount_{0};
+    std::atomic<std::uint64_t> syncRequests_{0};
 };
 
 class RocksNamespace: public Namespace
 {
 public:
     RocksNamespace(
-        rocksdb::DB* db, rocksdb::ColumnFamilyHandle* handle)
+        rocksdb::DB* db, rocksdb::ColumnFamilyHandle* handle,
+        std::shared_ptr<NamespaceStats> stats, int prefixLength = 0)
         : db_(db),
-          handle_(handle)
+          handle_(handle),
+          stats_(stats),
+          prefixLength_(prefixLength)
     {
     }
 
@@ -78,9 +130,28 @@ public:
     std::unique_ptr<Iterator> iterator(
         std::shared_ptr<Buffer> startKey, std::shared_ptr<Buffer> endKey) override;
     std::shared_ptr<Buffer> get(std::shared_ptr<Buffer> key) override;
+    std::shared_ptr<Buffer> get(const KeySpan& key) override;
+    std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys) override;
     std::uint64_t spaceUsed(
         std::shared_ptr<Buffer> start, std::shared_ptr<Buffer> end) override;
 
+    /// Variants of get, multiGet and iterator which read from a
+    /// snapshot. If the snapshot is null, they read the latest state.
+    std::shared_ptr<Buffer> get(
+        const KeySpan& key, const rocksdb::Snapshot* snapshot);
+    std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys,
+        const rocksdb::Snapshot* snapshot);
+    std::unique_ptr<Iterator> iterator(
+        std::shared_ptr<Buffer> startKey, std::shared_ptr<Buffer> endKey,
+        std::shared_ptr<RocksSnapshot> snapshot);
+
+    rocksdb::DB* db() const
+    {
+        return db_;
+    }
+
     rocksdb::ColumnFamilyHandle* handle() const
     {
         return handle_.get();
@@ -91,19 +162,123 @@ public:
         handle_.reset();
     }
 
+    int prefixLength() const
+    {
+        return prefixLength_;
+    }
+
+    NamespaceStats& stats() const
+    {
+        return *stats_;
+    }
+
+    /// Return read options suitable for iterating from startKey up
+    /// to endKey. If the namespace has a prefix extractor and the
+    /// range is within a single prefix, the iterator can use prefix
+    /// bloom filters, otherwise it must use total order seek.
+    rocksdb::ReadOptions iteratorOptions(
+        const rocksdb::Slice* startKey, const rocksdb::Slice* endKey) const;
+
 private:
     rocksdb::DB* db_;
     std::unique_ptr<rocksdb::ColumnFamilyHandle> handle_;
+    std::shared_ptr<NamespaceStats> stats_;
+    int prefixLength_;
+};
+
+/// A point-in-time view of a RocksDatabase using a RocksDB snapshot
+class RocksSnapshot: public Snapshot,
+                     public std::enable_shared_from_this<RocksSnapshot>
+{
+public:
+    RocksSnapshot(
+        std::shared_ptr<RocksDatabase> db, rocksdb::DB* rdb,
+        std::vector<std::string>&& names)
+        : db_(db),
+          rdb_(rdb),
+          snapshot_(rdb->GetSnapshot()),
+          names_(std::move(names))
+    {
+    }
+
+    ~RocksSnapshot() override
+    {
+        rdb_->ReleaseSnapshot(snapshot_);
+    }
+
+    // Snapshot overrides
+    std::shared_ptr<Namespace> getNamespace(const std::string& name) override;
+    std::vector<std::string> namespaces() override { return names_; }
+
+    const rocksdb::Snapshot* snapshot() const { return snapshot_; }
+
+private:
+    std::shared_ptr<RocksDatabase> db_;
+    rocksdb::DB* rdb_;
+    const rocksdb::Snapshot* snapshot_;
+    std::vector<std::string> names_;
+};
+
+/// A namespace which reads from a snapshot
+class RocksSnapshotNamespace: public Namespace
+{
+public:
+    RocksSnapshotNamespace(
+        std::shared_ptr<RocksSnapshot> snapshot,
+        std::shared_ptr<RocksNamespace> ns)
+        : snapshot_(snapshot),
+          ns_(ns)
+    {
+    }
+
+    std::unique_ptr<Iterator> iterator() override
+    {
+        return ns_->iterator(nullptr, nullptr, snapshot_);
+    }
+
+    std::unique_ptr<Iterator> iterator(
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey) override
+    {
+        return ns_->iterator(startKey, endKey, snapshot_);
+    }
+
+    std::shared_ptr<Buffer> get(std::shared_ptr<Buffer> key) override
+    {
+        return ns_->get(
+            KeySpan(key->data(), key->size()), snapshot_->snapshot());
+    }
+
+    std::shared_ptr<Buffer> get(const KeySpan& key) override
+    {
+        return ns_->get(key, snapshot_->snapshot());
+    }
+
+    std::vector<std::shared_ptr<Buffer>> multiGet(
+        const std::vector<std::shared_ptr<Buffer>>& keys) override
+    {
+        return ns_->multiGet(keys, snapshot_->snapshot());
+    }
+
+    std::uint64_t spaceUsed(
+        std::shared_ptr<Buffer> start, std::shared_ptr<Buffer> end) override
+    {
+        return ns_->spaceUsed(start, end);
+    }
+
+private:
+    std::shared_ptr<RocksSnapshot> snapshot_;
+    std::shared_ptr<RocksNamespace> ns_;
 };
 
 class RocksIterator: public Iterator
 {
 public:
     RocksIterator(
-        rocksdb::DB* db,
-        rocksdb::ColumnFamilyHandle* ns,
+        const RocksNamespace* ns,
         std::shared_ptr<Buffer> startKey,
-        std::shared_ptr<Buffer> endKey);
+        std::shared_ptr<Buffer> endKey,
+        std::shared_ptr<RocksSnapshot> snapshot = nullptr);
     void seek(std::shared_ptr<Buffer> key) override;
     void seekToFirst() override;
     void seekToLast() override;
@@ -112,11 +287,30 @@ public:
     bool valid() const override;
     std::shared_ptr<Buffer> key() const override;
     std::shared_ptr<Buffer> value() const override;
+    IteratorBatch nextBatch(
+        std::size_t maxEntries, std::size_t maxBytes) override;
 
 private:
+    /// Discard the cached key and value when the iterator moves
+    void invalidate()
+    {
+        key_.reset();
+        value_.reset();
+    }
+
+    const RocksNamespace* ns_;
+    std::shared_ptr<RocksSnapshot> snapshot_;
     std::unique_ptr<rocksdb::Iterator> it_;
+    bool prefixMode_ = false;
     rocksdb::Slice startKey_;
+    std::shared_ptr<Buffer> startBuf_;
     rocksdb::Slice endKey_;
+    std::shared_ptr<Buffer> endBuf_;   // keeps endKey_ valid
+
+    /// The key and value at the current position, copied out of the
+    /// iterator on first use so that repeated calls share one copy
+    mutable std::shared_ptr<Buffer> key_;
+    mutable std::shared_ptr<Buffer> value_;
 };
 
 class RocksTransaction: public Transaction
@@ -127,6 +321,15 @@ public:
         std::shared_ptr<Buffer> key, std::shared_ptr<Buffer> val) override;
     void remove(
         std::shared_ptr<Namespace> ns, std::shared_ptr<Buffer> key) override;
+    void put(
+        std::shared_ptr<Namespace> ns,
+        const KeySpan& key, std::shared_ptr<Buffer> val) override;
+    void remove(
+        std::shared_ptr<Namespace> ns, const KeySpan& key) override;
+    void removeRange(
+        std::shared_ptr<Namespace> ns,
+        std::shared_ptr<Buffer> startKey,
+        std::shared_ptr<Buffer> endKey) override;
 
     auto batch() { return &batch_; }
 
@@ -0,0 +1,308 @@
+/*-
+ * Copyright (c) 2016-present Doug Rabson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <keyval/keyval.h>
+
+using namespace keyval;
+using namespace std;
+
+/// Each backend is described by a function which creates an empty
+/// database in the given scratch directory
+typedef function<shared_ptr<Database>(const string&)> DatabaseFactory;
+
+struct DatabaseTest: public ::testing::TestWithParam<DatabaseFactory>
+{
+    void SetUp() override
+    {
+        char tmpl[] = "/tmp/keyval_testXXXXXX";
+        ASSERT_NE(nullptr, ::mkdtemp(tmpl));
+        dir = tmpl;
+        db = GetParam()(dir + "/db");
+    }
+
+    void TearDown() override
+    {
+        db.reset();
+        ::nftw(
+            dir.c_str(),
+            [](const char* path, const struct stat*, int, struct FTW*) {
+                return ::remove(path);
+            },
+            16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    shared_ptr<Buffer> toBuffer(const string& s)
+    {
+        return make_shared<Buffer>(s);
+    }
+
+    string toString(shared_ptr<Buffer> buf)
+    {
+        return string(reinterpret_cast<const char*>(buf->data()), buf->size());
+    }
+
+    bool exists(shared_ptr<Namespace> ns, const string& key)
+    {
+        try {
+            ns->get(toBuffer(key));
+            return true;
+        }
+        catch (system_error& e) {
+            return false;
+        }
+    }
+
+    string dir;
+    shared_ptr<Database> db;
+};
+
+TEST_P(DatabaseTest, RemoveRange)
+{
+    auto ns = db->getNamespace("default");
+    auto trans = db->beginTransaction();
+    for (auto key: {"a", "b", "c", "d"})
+        trans->put(ns, toBuffer(key), toBuffer(key));
+    db->commit(move(trans));
+
+    trans = db->beginTransaction();
+    trans->removeRange(ns, toBuffer("b"), toBuffer("d"));
+    db->commit(move(trans));
+
+    EXPECT_TRUE(exists(ns, "a"));
+    EXPECT_FALSE(exists(ns, "b"));
+    EXPECT_FALSE(exists(ns, "c"));
+    EXPECT_TRUE(exists(ns, "d"));
+}
+
+TEST_P(DatabaseTest, RemoveRangeSameTransaction)
+{
+    // Keys put earlier in the same transaction must be removed and
+    // keys put afterwards must survive so that merged transactions
+    // have the same effect on every backend
+    auto ns = db->getNamespace("default");
+    auto trans = db->beginTransaction();
+    trans->put(ns, toBuffer("a"), toBuffer("a"));
+    trans->put(ns, toBuffer("d"), toBuffer("d"));
+    db->commit(move(trans));
+
+    trans = db->beginTransaction();
+    trans->put(ns, toBuffer("b"), toBuffer("b"));
+    trans->put(ns, toBuffer("c"), toBuffer("c"));
+    trans->removeRange(ns, toBuffer("b"), toBuffer("d"));
+    trans->put(ns, toBuffer("c"), toBuffer("lemon"));
+    db->commit(move(trans));
+
+    EXPECT_TRUE(exists(ns, "a"));
+    EXPECT_FALSE(exists(ns, "b"));
+    EXPECT_EQ("lemon", toString(ns->get(toBuffer("c"))));
+    EXPECT_TRUE(exists(ns, "d"));
+}
+
+TEST_P(DatabaseTest, RemoveRangeOtherNamespace)
+{
+    // A range removal only affects its own namespace, even for keys
+    // put in the same transaction
+    auto ns1 = db->getNamespace("ns1");
+    auto ns2 = db->getNamespace("ns2");
+    auto trans = db->beginTransaction();
+    trans->put(ns1, toBuffer("b"), toBuffer("b"));
+    trans->put(ns2, toBuffer("b"), toBuffer("b"));
+    trans->removeRange(ns1, toBuffer("a"), toBuffer("z"));
+    db->commit(move(trans));
+
+    EXPECT_FALSE(exists(ns1, "b"));
+    EXPECT_TRUE(exists(ns2, "b"));
+}
+
+TEST_P(DatabaseTest, MultiGet)
+{
+    // Results are in key order with nullptr for missing keys, including
+    // when reading through a snapshot
+    auto ns = db->getNamespace("default");
+    auto trans = db->beginTransaction();
+    for (auto key: {"a", "c", "e"})
+        trans->put(ns, toBuffer(key), toBuffer(string(key) + "1"));
+    db->commit(move(trans));
+
+    auto snap = db->snapshot();
+    trans = db->beginTransaction();
+    trans->put(ns, toBuffer("a"), toBuffer("a2"));
+    trans->put(ns, toBuffer("b"), toBuffer("b2"));
+    trans->remove(ns, toBuffer("c"));
+    db->commit(move(trans));
+
+    vector<shared_ptr<Buffer>> keys;
+    for (auto key: {"e", "d", "c", "b", "a", "e"})
+        keys.push_back(toBuffer(key));
+    auto values = [this](vector<shared_ptr<Buffer>> vals) {
+        vector<string> res;
+        for (auto& val: vals)
+            res.push_back(val ? toString(val) : "<null>");
+        return res;
+    };
+    EXPECT_EQ((vector<string>{"e1", "<null>", "<null>", "b2", "a2", "e1"}),
+              values(ns->multiGet(keys)));
+    EXPECT_EQ((vector<string>{"e1", "<null>", "c1", "<null>", "a1", "e1"}),
+              values(snap->getNamespace("default")->multiGet(keys)));
+    EXPECT_TRUE(ns->multiGet({}).empty());
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Backends, DatabaseTest,
+    ::testing::Values(
+        DatabaseFactory([](const string&) { return make_memdb(); }),
+        DatabaseFactory(
+            [](const string&) {
+                MemoryOptions options;
+                options.shards = 4;
+                return make_memdb(options);
+            }),
+        DatabaseFactory(
+            [](const string& path) { return make_rocksdb(path); })));
+
+TEST(ShardedMemoryTest, IteratorConcurrentCommit)
+{
+    // An open iterator must not return entries removed by a later
+    // commit, even if they were already cached from another shard
+    auto toBuffer = [](const string& s) { return make_shared<Buffer>(s); };
+    MemoryOptions options;
+    options.shards = 4;
+    auto db = make_memdb(options);
+    auto ns = db->getNamespace("default");
+    auto trans = db->beginTransaction();
+    for (auto key: {"a", "b", "c", "d"})
+        trans->put(ns, toBuffer(key), toBuffer(key));
+    db->commit(move(trans));
+
+    auto it = ns->iterator();
+    ASSERT_TRUE(it->valid());
+    trans = db->beginTransaction();
+    trans->removeRange(ns, toBuffer("b"), toBuffer("d"));
+    trans->put(ns, toBuffer("e"), toBuffer("e"));
+    db->commit(move(trans));
+
+    string keys;
+    for (; it->valid(); it->next())
+        keys += string(
+            reinterpret_cast<const char*>(it->key()->data()),
+            it->key()->size());
+    EXPECT_EQ("ade", keys);
+}
+
+TEST(ShardedMemoryTest, IteratorCommitCost)
+{
+    // Commits while an iterator is open must not copy the shards, so
+    // their cost must not grow with the size of the namespace
+    auto toBuffer = [](const string& s) { return make_shared<Buffer>(s); };
+    auto commitTime = [&](int size) {
+        MemoryOptions options;
+        options.shards = 4;
+        auto db = make_memdb(options);
+        auto ns = db->getNamespace("default");
+        auto trans = db->beginTransaction();
+        for (int i = 0; i < size; i++)
+            trans->put(ns, toBuffer("key" + to_string(i)), toBuffer("x"));
+        db->commit(move(trans));
+
+        auto it = ns->iterator();
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < 100; i++) {
+            trans = db->beginTransaction();
+            trans->put(ns, toBuffer("key" + to_string(i)), toBuffer("y"));
+            db->commit(move(trans));
+            it->next();
+        }
+        return chrono::steady_clock::now() - start;
+    };
+    auto small = commitTime(100);
+    auto large = commitTime(200000);
+    EXPECT_LT(large, max<chrono::steady_clock::duration>(
+                  10 * small, chrono::milliseconds(50)));
+}
+
+TEST(DatabaseOptionsTest, Parse)
+{
+    DatabaseOptions options;
+    EXPECT_TRUE(options.parse("cache", "64M"));
+    EXPECT_EQ(64u << 20, options.blockCacheSize);
+    EXPECT_TRUE(options.parse("bloom.data", "10"));
+    EXPECT_EQ(10, options.namespaces["data"].bloomBitsPerKey);
+    EXPECT_TRUE(options.parse("compression.data", "lz4"));
+    EXPECT_TRUE(options.parse("window", "16"));
+    EXPECT_EQ(16, options.paxosWindow);
+    EXPECT_FALSE(options.parse("unknown", "1"));
+
+    // Bad values are rejected rather than ignored or truncated
+    auto bad = [&options](const string& name, const string& value) {
+        try {
+            options.parse(name, value);
+            return false;
+        }
+        catch (system_error& e) {
+            return e.code().value() == EINVAL;
+        }
+    };
+    EXPECT_TRUE(bad("cache", "-1"));
+    EXPECT_TRUE(bad("cache", "64X"));
+    EXPECT_TRUE(bad("cache", "99999999999999999999"));
+    EXPECT_TRUE(bad("bloom.data", "ten"));
+    EXPECT_TRUE(bad("prefix.data", "8x"));
+    EXPECT_TRUE(bad("prefix.data", "-8"));
+    EXPECT_TRUE(bad("compression.data", "zstd-ish"));
+    EXPECT_TRUE(bad("durability", "sometimes"));
+    EXPECT_TRUE(bad("window", "0"));
+    EXPECT_TRUE(bad("window", "65"));
+    EXPECT_TRUE(bad("window", "8x"));
+}
+
+TEST(DatabaseOptionsTest, ParseValues)
+{
+    // The value parsers are shared with other components' options
+    EXPECT_EQ(4096u, parseSizeOption("inline", "4K", 4096));
+    EXPECT_EQ(100u, parseSizeOption("inline", "100", 4096));
+    EXPECT_THROW(parseSizeOption("inline", "8K", 4096), system_error);
+    EXPECT_THROW(parseSizeOption("inline", "-1", 4096), system_error);
+    EXPECT_EQ(-3, parseIntOption("n", "-3", -5, 5));
+    EXPECT_THROW(parseIntOption("n", "6", -5, 5), system_error);
+}
+
+int main(int argc, char **argv) {
+    gflags::AllowCommandLineReparsing();
+    gflags::ParseCommandLineFlags(&argc, &argv, false);
+    testing::InitGoogleTest(&argc, argv);
+    google::InitGoogleLogging(argv[0]);
+    return RUN_ALL_TESTS();
+}
@@ -42,6 +42,10 @@ using namespace oncrpc;
 using namespace std;
 using namespace std::chrono;
 
+// Number of directory entries to fetch attributes for in a single batch
+// when building readdir replies which include attributes
+static constexpr int READDIR_PREFETCH = 64;
+
 DECLARE_int32(iosize);
 
 static nfsstat3 exportStatus(const system_error& e)
@@ -972,8 +976,9 @@ READDIRPLUS3res NfsServer::readdirplus(const READDIRPLUS3args& args)
         count3 dirSize = 0;
         unique_ptr<entryplus3>* entryp = &res.resok().reply.entries;
         res.resok().reply.eof = true;
-        for (auto iter = dir->readdir(cred, args.cookie);
-            iter->valid(); iter->next()) {
+        auto iter = dir->readdir(cred, args.cookie);
+        iter->prefetchFiles(READDIR_PREFETCH);
+        for (; iter->valid(); iter->next()) {
             auto entry = make_unique<entryplus3>();
             entry->fileid = iter->fileid();
             entry->name = iter->name();
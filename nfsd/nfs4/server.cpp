@@ -49,6 +49,10 @@ using namespace oncrpc;
 using namespace std;
 using namespace chrono;
 
+// Number of directory entries to fetch attributes for in a single batch
+// when building readdir replies which include attributes
+static constexpr int READDIR_PREFETCH = 64;
+
 DECLARE_int32(iosize);
 DECLARE_int32(grace_time);
 DECLARE_int32(lease_time);
@@ -343,6 +347,10 @@ CLOSE4res NfsServer::close(
         auto ns = client->findState(state, args.open_stateid);
         if (ns->type() != StateType::OPEN)
             return CLOSE4res(NFS4ERR_BAD_STATEID);
+        // Write out anything the file is still holding while we can
+        // report an error
+        if (ns->of())
+            ns->of()->flush();
         auto trans = beginTransaction();
         ns->remove(trans.get());
         commit(move(trans));
@@ -358,6 +366,9 @@ CLOSE4res NfsServer::close(
     catch (nfsstat4 status) {
         return CLOSE4res(status);
     }
+    catch (system_error& e) {
+        return CLOSE4res(exportStatus(e));
+    }
 }
 
 COMMIT4res NfsServer::commit(
@@ -1208,8 +1219,9 @@ READDIR4res NfsServer::readdir(
         count4 replySize = XdrSizeof(res);
         count4 dirSize = 0;
         unique_ptr<entry4>* entryp = &res.resok4().reply.entries;
-        for (auto iter = state.curr.file->readdir(cred, args.cookie);
-            iter->valid(); iter->next()) {
+        auto iter = state.curr.file->readdir(cred, args.cookie);
+        iter->prefetchFiles(READDIR_PREFETCH);
+        for (; iter->valid(); iter->next()) {
             // Skip "." and ".." entries
             if (iter->name() == "." || iter->name() == "..")
                 continue;
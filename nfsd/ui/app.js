@@ -8,7 +8,8 @@ angular.module(
         'ngResource',
         'clientList',
         'operationList',
-        'filesystemSummary'
+        'filesystemSummary',
+        'databaseStats'
     ])
     .config([
         '$locationProvider',
@@ -26,7 +27,9 @@ angular.module(
                         template: (
                             '<filesystem-summary></filesystem-summary>' +
                             '<br/>' +
-                            '<operation-list></operation-list>')
+                            '<operation-list></operation-list>' +
+                            '<br/>' +
+                            '<database-stats></database-stats>')
                     })
                 .otherwise('/stats');
             $mdIconProvider
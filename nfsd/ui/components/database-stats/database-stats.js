@@ -0,0 +1,117 @@
+'use strict';
+
+angular.module(
+    'databaseStats', [
+        'ngResource',
+        'ngMaterial'
+    ])
+    .directive('databaseStats', function factory() {
+        return {
+            restrict: 'E',
+            scope: {
+            },
+            templateUrl: 'components/database-stats/database-stats.html',
+            controller: [
+                '$scope',
+                '$interval',
+                '$resource',
+                function($scope, $interval, $resource)
+                {
+                    var self = this;
+
+                    $scope.showDB = true;
+                    $scope.hideDB = false;
+                    $scope.ops = [];
+
+                    // Latencies are reported in nanoseconds
+                    $scope.micros = function(val) {
+                        let v = Number(val) / 1000.0;
+                        if (v < 10)
+                            return v.toFixed(1);
+                        return v.toFixed(0);
+                    }
+
+                    $scope.humanizeNumber = function(val) {
+                        let suffix = "KMGTPE";
+                        let divisor = 1024.0;
+
+                        if (val < divisor)
+                            return String(val);
+
+                        let v = Number(val) / divisor;
+                        let i = 0;
+                        while (v > divisor && i < 6) {
+                            v /= divisor;
+                            i++;
+                        }
+                        if (v < 10)
+                            return v.toFixed(1) + suffix[i];
+                        else
+                            return v.toFixed(0) + suffix[i];
+                    }
+
+                    self.Data = $resource('/dbstats', {}, {}, {});
+                    function updateList() {
+                        function addOps(list, ns, ops) {
+                            for (let op of Object.keys(ops).sort()) {
+                                let v = ops[op];
+                                if (v.ops == 0)
+                                    continue;
+                                list.push({
+                                    ns: ns,
+                                    op: op,
+                                    ops: v.ops,
+                                    bytes: v.bytes,
+                                    p50: v.p50,
+                                    p99: v.p99,
+                                    max: v.max
+                                });
+                            }
+                        }
+                        self.Data.get(function(v) {
+                            // Backends which don't collect operation
+                            // statistics have no namespaces field
+                            if (!v.namespaces) {
+                                $scope.hideDB = true;
+                                return;
+                            }
+                            let newList = [];
+                            addOps(newList, '', {
+                                commit: v.commit,
+                                sync: v.sync,
+                                replicate: v.replicate
+                            });
+                            for (let ns of Object.keys(v.namespaces).sort())
+                                addOps(newList, ns, v.namespaces[ns]);
+
+                            let listChanged =
+                                $scope.ops.length != newList.length;
+                            for (let i = 0; !listChanged &&
+                                 i < newList.length; i++) {
+                                if ($scope.ops[i].ns != newList[i].ns ||
+                                    $scope.ops[i].op != newList[i].op)
+                                    listChanged = true;
+                            }
+                            if (listChanged) {
+                                $scope.ops = newList;
+                                return;
+                            }
+                            for (let i = 0; i < newList.length; i++) {
+                                let oldEntry = $scope.ops[i];
+                                let newEntry = newList[i];
+                                for (let field in newEntry) {
+                                    if (oldEntry[field] != newEntry[field])
+                                        oldEntry[field] = newEntry[field];
+                                }
+                            }
+                        });
+                    }
+                    updateList();
+                    var timer = $interval(updateList, 1000);
+                    $scope.$on('$destroy', function() {
+                        $interval.cancel(timer);
+                    });
+                }
+            ]
+        };
+    });
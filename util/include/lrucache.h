@@ -28,6 +28,7 @@
 #pragma once
 
 #include <cassert>
+#include <functional>
 #include <list>
 #include <memory>
 #include <shared_mutex>
@@ -80,6 +81,35 @@ public:
         add(std::unique_lock<std::mutex>(mutex_), fileid, file);
     }
 
+    /// Return the entry for fileid if it exists, otherwise nullptr. Unlike
+    /// find, this does not affect the entry's position in the LRU list.
+    std::shared_ptr<OBJ> peek(const ID& fileid)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto i = cache_.find(fileid);
+        if (i != cache_.end())
+            return i->second->second;
+        return nullptr;
+    }
+
+    /// Add an entry at the least recently used end of the cache unless
+    /// an entry for fileid already exists. Returns the cached entry. This
+    /// allows objects created by a scan to be shared via the cache while
+    /// making them the first candidates for expiry, so that the scan does
+    /// not displace the working set.
+    std::shared_ptr<OBJ> addCold(const ID& fileid, std::shared_ptr<OBJ> file)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto i = cache_.find(fileid);
+        if (i != cache_.end())
+            return i->second->second;
+        auto p = lru_.insert(lru_.end(), std::make_pair(fileid, file));
+        cache_[fileid] = p;
+        totalCost_ += file->cost();
+        expire(std::move(lock));
+        return file;
+    }
+
     /// Remove a cache entry, returning the entry if it was present
     /// otherwise nullptr
     std::shared_ptr<OBJ> remove(const ID& fileid)
@@ -123,6 +153,16 @@ public:
         expire(std::move(lock));
     }
 
+    /// Set a callback which is called with the cache locked for each
+    /// entry just before it is expired. This lets the owner keep hold
+    /// of an entry which still has work to do without doing that work
+    /// under the cache lock.
+    void setExpireCallback(std::function<void(std::shared_ptr<OBJ>)> cb)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        expireCallback_ = cb;
+    }
+
     /// Return true if the cache contains this id
     bool contains(ID id)
     {
@@ -175,6 +215,8 @@ private:
                     // we can expire it.
                     const auto& oldest = *i;
                     //VLOG(2) << "expiring fileid: " << oldest->fileid();
+                    if (expireCallback_)
+                        expireCallback_(oldest.second);
                     auto p = cache_[oldest.first];
                     cache_.erase(oldest.first);
                     lru_.erase(p);
@@ -196,6 +238,7 @@ private:
     std::mutex mutex_;
     lruT lru_;
     std::unordered_map<ID, typename lruT::iterator, HASH, EQUAL> cache_;
+    std::function<void(std::shared_ptr<OBJ>)> expireCallback_;
     int costLimit_ = DEFAULT_COST_LIMIT;
     int totalCost_ = 0;
     int hits_ = 0;
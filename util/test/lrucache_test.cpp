@@ -119,6 +119,31 @@ TEST_F(LRUCacheTest, Busy)
     EXPECT_EQ(false, cache.contains(1));
 }
 
+TEST_F(LRUCacheTest, Cold)
+{
+    EXPECT_CALL(cb, ctor(_))
+        .Times(cache.costLimit())
+        .WillRepeatedly(Invoke(newFile));
+
+    for (int i = 0; i < cache.costLimit(); i++) {
+        cache.find(i, update, ctor);
+    }
+
+    // Adding a cold entry to a full cache expires the oldest entry
+    auto f = cache.addCold(-1, newFile(-1));
+    EXPECT_EQ(cache.costLimit(), cache.totalCost());
+    EXPECT_EQ(false, cache.contains(0));
+    EXPECT_EQ(f, cache.addCold(-1, newFile(-1)));
+    EXPECT_EQ(f, cache.peek(-1));
+
+    // Once unreferenced, cold entries expire before the others
+    f.reset();
+    cache.addCold(-2, newFile(-2));
+    EXPECT_EQ(false, cache.contains(-1));
+    EXPECT_EQ(true, cache.contains(1));
+    EXPECT_TRUE(cache.peek(-1) == nullptr);
+}
+
 TEST_F(LRUCacheTest, Multithread)
 {
     EXPECT_CALL(cb, ctor(_))